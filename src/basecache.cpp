@@ -0,0 +1,271 @@
+/*(GPLv2)
+------------------------------------------------------------
+	basecache.cpp - Cached base tile layers
+------------------------------------------------------------
+ * Copyright 2017 David Olofson (Kobo Redux)
+ *
+ * This program  is free software; you can redistribute it and/or modify it
+ * under the terms  of  the GNU General Public License  as published by the
+ * Free Software Foundation;  either version 2 of the License,  or (at your
+ * option) any later version.
+ *
+ * This program is  distributed  in  the hope that  it will be useful,  but
+ * WITHOUT   ANY   WARRANTY;   without   even   the   implied  warranty  of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * You should have received  a copy of the GNU General Public License along
+ * with this program; if not,  write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "kobo.h"
+#include "basecache.h"
+#include "logger.h"
+
+
+KOBO_BaseCache::KOBO_BaseCache()
+{
+	nslots = 0;
+	tileset = -1;
+	tw = th = 0;
+	chunk_log2 = KOBO_BASECACHE_MIN_CHUNK_LOG2;
+	frame = 0;
+	failed = false;
+	reset();
+}
+
+
+KOBO_BaseCache::~KOBO_BaseCache()
+{
+	// No renderer to destroy textures with at this point!
+}
+
+
+void KOBO_BaseCache::reset()
+{
+	for(int i = 0; i < nslots; ++i)
+		if(slots[i].texture)
+			SDL_DestroyTexture(slots[i].texture);
+	nslots = 0;
+	for(int i = 0; i < KOBO_BASECACHE_MAX_CHUNKS; ++i)
+		slotof[i] = -1;
+	tileset = -1;
+	failed = false;
+	invalidate();
+}
+
+
+void KOBO_BaseCache::invalidate()
+{
+	for(int i = 0; i < KOBO_BASECACHE_MAX_CHUNKS; ++i)
+		dirty[i] = true;
+}
+
+
+// Tiles may overhang into neighboring chunks (see render_chunk()), so we mark
+// the chunks of the surrounding tiles as well.
+void KOBO_BaseCache::invalidate(int x, int y)
+{
+	for(int dy = -1; dy <= 1; ++dy)
+		for(int dx = -1; dx <= 1; ++dx)
+		{
+			int cx = ((x + dx) & (MAP_SIZEX - 1)) >> chunk_log2;
+			int cy = ((y + dy) & (MAP_SIZEY - 1)) >> chunk_log2;
+			dirty[(cy << (MAP_SIZEX_LOG2 - chunk_log2)) + cx] =
+					true;
+		}
+}
+
+
+// Find or allocate a texture for 'chunk', creating a new one if we're below
+// 'maxslots', or otherwise recycling the least recently used one. Returns the
+// slot index, or -1 if no texture could be created.
+int KOBO_BaseCache::get_slot(int chunk, int maxslots)
+{
+	if(slotof[chunk] >= 0)
+		return slotof[chunk];
+
+	int si;
+	if(nslots < maxslots)
+	{
+		int n = 1 << chunk_log2;
+		SDL_Texture *t = SDL_CreateTexture(gengine->renderer(),
+				KOBO_PIXELFORMAT, SDL_TEXTUREACCESS_TARGET,
+				n * tw, n * th);
+		if(!t)
+		{
+			log_printf(WLOG, "Could not create base chunk "
+					"texture: %s\n", SDL_GetError());
+			return -1;
+		}
+		SDL_SetTextureBlendMode(t, SDL_BLENDMODE_BLEND);
+		si = nslots++;
+		slots[si].texture = t;
+	}
+	else
+	{
+		// Visible chunks are marked with the current frame, so as long
+		// as there are more slots than visible chunks, we never steal a
+		// texture that is already in use.
+		si = -1;
+		for(int i = 0; i < nslots; ++i)
+		{
+			if(slots[i].used == frame)
+				continue;
+			if((si < 0) || ((Sint32)(slots[i].used -
+					slots[si].used) < 0))
+				si = i;
+		}
+		if(si < 0)
+			return -1;
+		if(slots[si].chunk >= 0)
+			slotof[slots[si].chunk] = -1;
+	}
+	slots[si].chunk = chunk;
+	slotof[chunk] = si;
+	dirty[chunk] = true;
+	return si;
+}
+
+
+void KOBO_BaseCache::render_chunk(KOBO_map &map, s_bank_t *b, Slot *s)
+{
+	SDL_Renderer *r = gengine->renderer();
+	int n = 1 << chunk_log2;
+	int ncx = MAP_SIZEX >> chunk_log2;
+	int x0 = (s->chunk & (ncx - 1)) << chunk_log2;
+	int y0 = (s->chunk >> (MAP_SIZEX_LOG2 - chunk_log2)) << chunk_log2;
+
+	SDL_SetRenderTarget(r, s->texture);
+	SDL_SetRenderDrawColor(r, 0, 0, 0, 0);
+	SDL_RenderClear(r);
+
+	// Tiles don't overlap, so we just copy them, alpha channel and all,
+	// and leave the blending to when the chunk is drawn. However, tiles
+	// are offset by their hotspots, and may overhang the chunk edges, so
+	// we also draw a one tile apron around the chunk, and let the render
+	// target clip it.
+	SDL_Texture *last = NULL;
+	SDL_BlendMode bm = SDL_BLENDMODE_BLEND;
+	for(int y = -1; y <= n; ++y)
+		for(int x = -1; x <= n; ++x)
+		{
+			int t = map.pos(x0 + x, y0 + y);
+			if(IS_SPACE(t) && (MAP_TILE(t) == 0))
+				continue;
+			if(t & CORE)
+				continue;	// Animated; drawn by the caller
+			s_sprite_t *sp = s_get_sprite_b(b, MAP_TILE(t));
+			if(!sp || !sp->texture)
+				continue;
+			if(sp->texture != last)
+			{
+				if(last)
+					SDL_SetTextureBlendMode(last, bm);
+				last = sp->texture;
+				SDL_GetTextureBlendMode(last, &bm);
+				SDL_SetTextureBlendMode(last,
+						SDL_BLENDMODE_NONE);
+			}
+			SDL_Rect dr;
+			dr.x = x * tw - (sp->x * b->xs >> 8);
+			dr.y = y * th - (sp->y * b->ys >> 8);
+			dr.w = tw;
+			dr.h = th;
+			SDL_RenderCopy(r, sp->texture, &sp->area, &dr);
+		}
+	if(last)
+		SDL_SetTextureBlendMode(last, bm);
+}
+
+
+bool KOBO_BaseCache::render(window_t *target, KOBO_map &map, int ts,
+		int mx, int my, int xo, int yo, int xmax, int ymax)
+{
+	if(failed)
+		return false;
+	SDL_Renderer *r = gengine->renderer();
+	s_bank_t *b = s_get_bank(gengine->get_gfx(), ts);
+	if(!r || !b)
+		return false;
+	if(!SDL_RenderTargetSupported(r))
+	{
+		log_printf(WLOG, "Render targets not supported. Base tile "
+				"cache disabled.\n");
+		failed = true;
+		return false;
+	}
+
+	// New tileset or scale: start over
+	int ntw = b->w * b->xs >> 8;
+	int nth = b->h * b->ys >> 8;
+	if((ts != tileset) || (ntw != tw) || (nth != th))
+	{
+		reset();
+		tileset = ts;
+		tw = ntw;
+		th = nth;
+		chunk_log2 = KOBO_BASECACHE_MIN_CHUNK_LOG2;
+		while(((b->w << chunk_log2) <
+				KOBO_BASECACHE_CHUNK_PIXELS) &&
+				(chunk_log2 < MAP_SIZEX_LOG2))
+			++chunk_log2;
+	}
+
+	int n = 1 << chunk_log2;
+	int ncx = MAP_SIZEX >> chunk_log2;
+	int cx0 = mx >> chunk_log2;
+	int cy0 = my >> chunk_log2;
+	int cx1 = (mx + xmax - 1) >> chunk_log2;
+	int cy1 = (my + ymax - 1) >> chunk_log2;
+	int visible = (cx1 - cx0 + 1) * (cy1 - cy0 + 1);
+	if(visible > KOBO_BASECACHE_MAX_SLOTS)
+		return false;
+	int maxslots = visible + KOBO_BASECACHE_SPARE;
+	if(maxslots > KOBO_BASECACHE_MAX_SLOTS)
+		maxslots = KOBO_BASECACHE_MAX_SLOTS;
+	++frame;
+
+	// Make sure all visible chunks are present and up to date
+	bool rendered = false;
+	for(int cy = cy0; (cy <= cy1) && !failed; ++cy)
+		for(int cx = cx0; cx <= cx1; ++cx)
+		{
+			int c = ((cy & ((MAP_SIZEY >> chunk_log2) - 1)) *
+					ncx) + (cx & (ncx - 1));
+			int si = get_slot(c, maxslots);
+			if(si < 0)
+			{
+				failed = true;
+				break;
+			}
+			slots[si].used = frame;
+			if(dirty[c])
+			{
+				render_chunk(map, b, &slots[si]);
+				dirty[c] = false;
+				rendered = true;
+			}
+		}
+	if(rendered)
+	{
+		SDL_SetRenderTarget(r, NULL);
+		target->select();
+	}
+	if(failed)
+		return false;
+
+	for(int cy = cy0; cy <= cy1; ++cy)
+		for(int cx = cx0; cx <= cx1; ++cx)
+		{
+			int c = ((cy & ((MAP_SIZEY >> chunk_log2) - 1)) *
+					ncx) + (cx & (ncx - 1));
+			target->texture_fxp(
+					PIXEL2CS((cx * n - mx) * b->w) - xo,
+					PIXEL2CS((cy * n - my) * b->h) - yo,
+					slots[slotof[c]].texture,
+					n * tw, n * th);
+		}
+	return true;
+}
@@ -0,0 +1,91 @@
+/*(GPLv2)
+------------------------------------------------------------
+	basecache.h - Cached base tile layers
+------------------------------------------------------------
+ * Copyright 2017 David Olofson (Kobo Redux)
+ *
+ * This program  is free software; you can redistribute it and/or modify it
+ * under the terms  of  the GNU General Public License  as published by the
+ * Free Software Foundation;  either version 2 of the License,  or (at your
+ * option) any later version.
+ *
+ * This program is  distributed  in  the hope that  it will be useful,  but
+ * WITHOUT   ANY   WARRANTY;   without   even   the   implied  warranty  of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * You should have received  a copy of the GNU General Public License along
+ * with this program; if not,  write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * The base layers hardly ever change, so instead of drawing every visible
+ * tile every frame, the map is split into square chunks of tiles, that are
+ * rendered into target textures as they come into view, and then drawn with
+ * one quad per chunk. Only a limited number of chunk textures is kept around
+ * per layer, recycling the least recently used ones.
+ *
+ * Animated tiles (cores) are not cached, and are left for the caller to draw
+ * on top of the chunks.
+ */
+
+#ifndef KOBO_BASECACHE_H
+#define KOBO_BASECACHE_H
+
+#include "window.h"
+#include "map.h"
+
+// Minimum chunk size in (unscaled) pixels
+#define	KOBO_BASECACHE_CHUNK_PIXELS	128
+
+// Minimum chunk size in tiles (log2); limits the size of the chunk tables
+#define	KOBO_BASECACHE_MIN_CHUNK_LOG2	2
+#define	KOBO_BASECACHE_MAX_CHUNKS	(MAP_SIZEX * MAP_SIZEY >>	\
+		(KOBO_BASECACHE_MIN_CHUNK_LOG2 * 2))
+
+// Chunk textures kept in addition to the ones currently visible
+#define	KOBO_BASECACHE_SPARE		8
+
+// Max number of chunk textures per layer
+#define	KOBO_BASECACHE_MAX_SLOTS	32
+
+class KOBO_BaseCache
+{
+	struct Slot
+	{
+		SDL_Texture	*texture;
+		int		chunk;		// Chunk index, or -1
+		Uint32		used;		// Last frame used
+	};
+	Slot		slots[KOBO_BASECACHE_MAX_SLOTS];
+	int		nslots;
+	signed char	slotof[KOBO_BASECACHE_MAX_CHUNKS];	// -1: none
+	bool		dirty[KOBO_BASECACHE_MAX_CHUNKS];
+	int		tileset;
+	int		tw, th;		// Scaled tile size
+	int		chunk_log2;	// Chunk size in tiles (log2)
+	Uint32		frame;
+	bool		failed;		// Render targets not available
+
+	int get_slot(int chunk, int maxslots);
+	void render_chunk(KOBO_map &map, s_bank_t *b, Slot *s);
+  public:
+	KOBO_BaseCache();
+	~KOBO_BaseCache();
+
+	// Destroy all chunk textures
+	void reset();
+
+	// Mark all chunks, or the chunks affected by map tile (x, y) for update
+	void invalidate();
+	void invalidate(int x, int y);
+
+	// Draw the tiles of 'map' that are visible in 'target' with tile
+	// (mx, my) at (-xo, -yo), not including animated tiles. Returns false
+	// if the cache cannot be used, in which case nothing is drawn.
+	bool render(window_t *target, KOBO_map &map, int tileset,
+			int mx, int my, int xo, int yo, int xmax, int ymax);
+};
+
+#endif /* KOBO_BASECACHE_H */
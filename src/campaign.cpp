@@ -23,6 +23,7 @@
 #include "kobolog.h"
 #include "campaign.h"
 #include "replay_gst.h"
+#include "keyframe.h"
 #include <algorithm>
 
 
@@ -159,24 +160,30 @@ bool KOBO_campaign::load(bool quiet)
 
 	pfile_t *pf = new pfile_t(f);
 	KOBO_replay *r = NULL;
-	int gstd_count = 0;
+	int rep_type = 0;	// Repeated chunk type (GSTD, KFRM), or 0
+	int rep_count = 0;
 
 	while(pf->chunk_read() >= 0)
 	{
 		int ct = pf->chunk_type();
 
-		if(ct == KOBO_PF_GSTD_4CC)
-			++gstd_count;
-		else if(gstd_count)
+		if(rep_count && (ct == rep_type))
+			++rep_count;
+		else
 		{
-			if(prefs->debug && !quiet)
-				log_printf(ULOG, "      x %d\n", gstd_count);
-			gstd_count = 0;
+			if(rep_count && prefs->debug && !quiet)
+				log_printf(ULOG, "      x %d\n", rep_count);
+			if((ct == KOBO_PF_GSTD_4CC) ||
+					(ct == KOBO_PF_KFRM_4CC))
+			{
+				rep_type = ct;
+				rep_count = 1;
+			}
+			else
+				rep_type = rep_count = 0;
 		}
 
-		if(prefs->debug && !quiet &&
-				((ct != KOBO_PF_GSTD_4CC) ||
-				(gstd_count == 1)))
+		if(prefs->debug && !quiet && (rep_count <= 1))
 			log_printf(ULOG, "  [%sv%d, %d bytes]\n",
 					pf->fourcc2string(ct),
 					pf->chunk_version(),
@@ -206,6 +213,8 @@ bool KOBO_campaign::load(bool quiet)
 			_empty = false;
 			break;
 		  case KOBO_PF_REPD_4CC:
+		  case KOBO_PF_HASH_4CC:
+		  case KOBO_PF_KFRM_4CC:
 		  case KOBO_PF_GSTD_4CC:
 			if(!r)
 			{
@@ -232,8 +241,8 @@ bool KOBO_campaign::load(bool quiet)
 			break;
 		}
 	}
-	if(gstd_count && prefs->debug && !quiet)
-		log_printf(ULOG, "      x %d\n", gstd_count);
+	if(rep_count && prefs->debug && !quiet)
+		log_printf(ULOG, "      x %d\n", rep_count);
 
 	delete pf;
 	fclose(f);
@@ -35,6 +35,20 @@
 // version 1.0.0.)
 #define	KOBO_REPLAY_VERSION	KOBO_MAKE_VERSION(0, 7, 5, 0)
 
+// Storage class for game logic state. Each thread gets its own instance of the
+// game logic (player, enemies, map, game parameters, gamerand etc), so that
+// replays can be simulated in parallel by worker threads.
+//
+// NOTE: These objects must be constant initialized (no constructors; use an
+//       explicit init() or similar) so that they can be accessed directly,
+//       rather than via thread_local wrapper and init guard calls. __thread
+//       enforces that with GCC and Clang.
+#if defined(__GNUC__) || defined(__clang__)
+# define	KOBO_TLS	__thread
+#else
+# define	KOBO_TLS	thread_local
+#endif
+
 #include "buildconfig.h"
 
 #ifndef DEBUG
@@ -218,6 +232,7 @@ static inline int kobo_wrapdist(int a, int b, int w)
 /* Health/shield LED bar */
 #define	SHIELD_GRADIENT_SIZE	4
 #define	SHIELD_FILTER_COEFF	0.01f	// (per ms)
+#define	SHIELD_FILTER_SNAP	0.001f	// Close enough; stop filtering
 #undef	SHIELD_DITHER
 
 /* Player ship gun positions */
@@ -268,6 +283,9 @@ static inline int kobo_wrapdist(int a, int b, int w)
 #define	KOBO_RETRY_REWIND		300
 #define	KOBO_RETRY_SKIP_FXTIME		200
 
+/* Replay desync bisection (-bisectreplays) snapshot interval (logic frames) */
+#define	KOBO_BISECT_INTERVAL		50
+
 /* Grid transition effect timings (ms) */
 #define	KOBO_ENTER_STAGE_FXTIME		500
 #define	KOBO_ENTER_TITLE_FXTIME		1500
@@ -432,6 +432,8 @@ label_t::label_t(gfxengine_t *e) : window_t(e)
 {
 	_color = map_rgb(0);
 	_on = 0;
+	_caption[0] = 0;
+	cache(true);
 	caption("CAPTION");
 	on();
 }
@@ -439,6 +441,8 @@ label_t::label_t(gfxengine_t *e) : window_t(e)
 
 void label_t::color(Uint32 _cl)
 {
+	if(_cl == _color)
+		return;
 	_color = _cl;
 	if(_on)
 		invalidate();
@@ -447,6 +451,8 @@ void label_t::color(Uint32 _cl)
 
 void label_t::caption(const char *cap)
 {
+	if(!strncmp(_caption, cap, sizeof(_caption)))
+		return;
 	strncpy(_caption, cap, sizeof(_caption));
 	if(_on)
 		invalidate();
@@ -489,12 +495,15 @@ void label_t::refresh(SDL_Rect *r)
 
 display_t::display_t(gfxengine_t *e) : label_t(e)
 {
+	_text[0] = 0;
 	text("TEXT");
 }
 
 
 void display_t::text(const char *txt)
 {
+	if(!strncmp(_text, txt, sizeof(_text)))
+		return;
 	strncpy(_text, txt, sizeof(_text));
 	if(_on)
 		invalidate();
@@ -531,24 +540,22 @@ bargraph_t::bargraph_t(gfxengine_t *e) : window_t(e)
 {
 	_value = 0.0f;
 	fvalue = 0.0f;
-	_y = -1000;
 	_enabled = 1;
 	led_bank = 0;
 	_warn_level = 0.25f;
 	_ok_level = 0.5f;
+	cache(true);
 }
 
 
 void bargraph_t::value(float val)
 {
 	if(val < 0.0f)
-		_value = 0.0f;
-	else
-		_value = val;
-	if(!_enabled)
+		val = 0.0f;
+	if(val == _value)
 		return;
-	int y = (int)((height() - 2) * _value);
-	if(y != _y)
+	_value = val;
+	if(_enabled)
 		invalidate();
 }
 
@@ -575,6 +582,20 @@ void bargraph_t::refresh(SDL_Rect *r)
 }
 
 
+// Filter the displayed value towards the actual value, keeping the window
+// invalidated until it gets there.
+float bargraph_t::filter()
+{
+	fvalue += (_value - fvalue) * SHIELD_FILTER_COEFF *
+			engine->frame_delta_time();
+	if(fabs(_value - fvalue) < SHIELD_FILTER_SNAP)
+		fvalue = _value;
+	else
+		invalidate();
+	return fvalue;
+}
+
+
 /*----------------------------------------------------------
 	Health/shield LED bar display with overcharge
 ----------------------------------------------------------*/
@@ -605,13 +626,12 @@ void shieldbar_t::refresh(SDL_Rect *r)
 	int off, c0;
 
 	// Filtering
-	fvalue += (_value - fvalue) * SHIELD_FILTER_COEFF *
-			engine->frame_delta_time();
-	float v = fvalue;
+	float v = filter();
 
 #ifdef	SHIELD_DITHER
 	// Dithering
 	v += (pubrand.get(4) - 7.5f) / 16.0f / (leds * SHIELD_GRADIENT_SIZE);
+	invalidate();
 #endif
 
 	// Normal/overcharge/timer
@@ -656,6 +676,10 @@ void shieldbar_t::refresh(SDL_Rect *r)
 		marker_pos = -1;		// No marker!
 	}
 
+	// Blinking timer and marker need continuous updates
+	if(_timer || (marker_pos >= 0))
+		invalidate();
+
 	// Rounding
 	v += 0.5f / (leds * SHIELD_GRADIENT_SIZE);
 
@@ -714,13 +738,12 @@ void chargebar_t::refresh(SDL_Rect *r)
 	}
 
 	// Filtering
-	fvalue += (_value - fvalue) * SHIELD_FILTER_COEFF *
-			engine->frame_delta_time();
-	float v = fvalue;
+	float v = filter();
 
 #ifdef	SHIELD_DITHER
 	// Dithering
 	v += (pubrand.get(4) - 7.5f) / 16.0f / (leds * SHIELD_GRADIENT_SIZE);
+	invalidate();
 #endif
 
 	// Rounding
@@ -761,6 +784,7 @@ hledbar_t::hledbar_t(gfxengine_t *e) : window_t(e)
 	fxtype = PFX_OFF;
 	fxcolor = PCOLOR_OFF;
 	fxstate = fxpos = 0;
+	cache(true);
 }
 
 
@@ -887,6 +911,7 @@ void hledbar_t::frame()
 	}
 
 	// Update LEDs!
+	bool changed = false;
 	for(int i = 0; i < PROXY_LEDS; ++i)
 	{
 		if(leds[i].color != leds[i].tcolor)
@@ -915,6 +940,7 @@ void hledbar_t::frame()
 		}
 		else
 			continue;	// Done! No change.
+		changed = true;
 
 		// Calculate graphics frame to render
 		if(leds[i].intensity < 3 * 65536 / 8)
@@ -943,6 +969,8 @@ void hledbar_t::frame()
 		leds[i].frame += (leds[i].intensity - 3 * 65536 / 8) /
 				(65536 / 4);
 	}
+	if(changed)
+		invalidate();
 }
 
 
@@ -138,19 +138,31 @@ class bargraph_t : public window_t
   protected:
 	float	_value;
 	float	fvalue;
-	int	_y;
 	int	_enabled;
 	int	led_bank;
 	float	_warn_level;
 	float	_ok_level;
+	float filter();
   public:
 	bargraph_t(gfxengine_t *e);
 	void refresh(SDL_Rect *r);
 	void value(float val);
 	void enable(int ena);
-	void set_leds(int _bank)	{ led_bank = _bank; }
-	void warn_level(float l)	{ _warn_level = l; }
-	void ok_level(float l)		{ _ok_level = l; }
+	void set_leds(int _bank)
+	{
+		led_bank = _bank;
+		invalidate();
+	}
+	void warn_level(float l)
+	{
+		_warn_level = l;
+		invalidate();
+	}
+	void ok_level(float l)
+	{
+		_ok_level = l;
+		invalidate();
+	}
 	int led_count();	// Returns number of LEDs with current theme
 };
 
@@ -164,8 +176,18 @@ class shieldbar_t : public bargraph_t
   public:
 	shieldbar_t(gfxengine_t *e);
 	void refresh(SDL_Rect *r);
-	void marker(float m)		{ _marker = m; }
-	void timer(float t)		{ _timer = t; }
+	void marker(float m)
+	{
+		if(m != _marker)
+			invalidate();
+		_marker = m;
+	}
+	void timer(float t)
+	{
+		if(t != _timer)
+			invalidate();
+		_timer = t;
+	}
 };
 
 
@@ -218,7 +240,11 @@ class hledbar_t : public window_t
 	int		fxpos;
   public:
 	hledbar_t(gfxengine_t *e);
-	void set_leds(int _bank)	{ led_bank = _bank; }
+	void set_leds(int _bank)
+	{
+		led_bank = _bank;
+		invalidate();
+	}
 	void reset();
 	void set(int pos, proxy_colors_t color, float intensity);
 	void fx(proxy_fxtypes_t fxt, proxy_colors_t color = PCOLOR_HAZARD);
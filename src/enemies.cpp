@@ -25,16 +25,23 @@
 #include "enemies.h"
 #include "random.h"
 #include "radar.h"
+#include "mathutil.h"
+#include "kobolog.h"
 
-KOBO_enemy *KOBO_enemies::active = NULL;
-KOBO_enemy *KOBO_enemies::pool = NULL;
-const KOBO_enemy_kind *KOBO_enemies::ekind_to_generate_1;
-const KOBO_enemy_kind *KOBO_enemies::ekind_to_generate_2;
-int KOBO_enemies::e1_interval;
-int KOBO_enemies::e2_interval;
-int KOBO_enemies::is_intro = 0;
-int KOBO_enemies::sound_update_period = 3;
-KOBO_enemystats KOBO_enemies::stats[KOBO_EK__COUNT];
+KOBO_TLS KOBO_enemy_block *KOBO_enemies::blocks = NULL;
+KOBO_TLS KOBO_enemy *KOBO_enemies::pool = NULL;
+KOBO_TLS KOBO_enemy **KOBO_enemies::live = NULL;
+KOBO_TLS unsigned KOBO_enemies::nlive = 0;
+KOBO_TLS unsigned KOBO_enemies::livesize = 0;
+KOBO_TLS KOBO_enemy *KOBO_enemies::tiles[MAP_SIZEX * MAP_SIZEY];
+KOBO_TLS KOBO_enemy *KOBO_enemies::moving = NULL;
+KOBO_TLS const KOBO_enemy_kind *KOBO_enemies::ekind_to_generate_1;
+KOBO_TLS const KOBO_enemy_kind *KOBO_enemies::ekind_to_generate_2;
+KOBO_TLS int KOBO_enemies::e1_interval;
+KOBO_TLS int KOBO_enemies::e2_interval;
+KOBO_TLS int KOBO_enemies::is_intro = 0;
+KOBO_TLS int KOBO_enemies::sound_update_period = 3;
+KOBO_TLS KOBO_enemystats KOBO_enemies::stats[KOBO_EK__COUNT];
 
 
 //---------------------------------------------------------------------------//
@@ -70,12 +77,41 @@ const char *KOBO_enemies::enemy_name(KOBO_enemy_kinds eki)
 }
 #undef	KOBO_DEFS
 
+#define	KOBO_DEFS(x, y)	case KOBO_EK_##x: return &y;
+const KOBO_enemy_kind *KOBO_enemies::enemy_kind(KOBO_enemy_kinds eki)
+{
+	switch(eki)
+	{
+	  KOBO_ALLENEMYKINDS
+	  default:	return NULL;
+	}
+}
+#undef	KOBO_DEFS
+
+// Explosions and the like should not affect gameplay, and as they only live for
+// as many frames as there are in the theme sprite banks, they're left out of
+// game state verification.
+bool KOBO_enemies::is_effect(KOBO_enemy_kinds eki)
+{
+	switch(eki)
+	{
+	  case KOBO_EK_RINGEXPL:
+	  case KOBO_EK_GREENBLTEXPL:
+	  case KOBO_EK_REDBLTEXPL:
+	  case KOBO_EK_BLUEBLTEXPL:
+	  case KOBO_EK_BOLTEXPL:
+	  case KOBO_EK_ROCKEXPL:
+		return true;
+	  default:
+		return false;
+	}
+}
+
 void KOBO_enemies::off()
 {
-	while(active)
+	while(nlive)
 	{
-		KOBO_enemy *e = active;
-		active = active->next;
+		KOBO_enemy *e = live[--nlive];
 		if(e->ek)
 			e->release();
 		e->next = pool;
@@ -96,40 +132,189 @@ int KOBO_enemies::init()
 	return 0;
 }
 
-void KOBO_enemies::clean()
+// Get a free slot, from the pool if possible. (The pool is LIFO, and is filled
+// newest to oldest, just like the original linked list implementation.)
+KOBO_enemy *KOBO_enemies::alloc()
 {
-	KOBO_enemy *p = NULL;
-	KOBO_enemy *e = active;
-	while(e)
+	KOBO_enemy *e = pool;
+	if(e)
+		pool = e->next;
+	else
 	{
-		KOBO_enemy *de = e;
-		e = e->next;
-		if(!de->ek)
+		if(!blocks || (blocks->used >= KOBO_ENEMY_BLOCK))
 		{
-			if(p)
-				p->next = e;
-			else
-				active = e;
-			de->next = pool;
-			pool = de;
+			KOBO_enemy_block *b = new KOBO_enemy_block;
+			b->next = blocks;
+			b->used = 0;
+			blocks = b;
 		}
-		else
-			p = de;
+		e = &blocks->slots[blocks->used++];
+	}
+	e->tile = -1;
+	e->pending = KOBO_EP_NONE;
+	return e;
+}
+
+// Add enemy to the live index as the newest one
+void KOBO_enemies::add_live(KOBO_enemy *e)
+{
+	if(nlive >= livesize)
+	{
+		unsigned nls = livesize ? livesize * 2 : KOBO_ENEMY_BLOCK;
+		KOBO_enemy **nl = (KOBO_enemy **)realloc(live,
+				nls * sizeof(KOBO_enemy *));
+		if(!nl)
+		{
+			log_printf(ELOG, "OOM in KOBO_enemies::add_live()!\n");
+			return;
+		}
+		live = nl;
+		livesize = nls;
+	}
+	e->livepos = nlive;
+	live[nlive++] = e;
+	index(e);
+}
+
+// Remove dead enemies from the live index, keeping the order of the rest
+void KOBO_enemies::clean()
+{
+	for(int i = nlive - 1; i >= 0; --i)
+		if(!live[i]->ek)
+		{
+			live[i]->next = pool;
+			pool = live[i];
+		}
+	unsigned n = 0;
+	for(unsigned i = 0; i < nlive; ++i)
+	{
+		KOBO_enemy *e = live[i];
+		if(!e->ek)
+			continue;
+		e->livepos = n;
+		live[n++] = e;
 	}
+	nlive = n;
 }
 
+// Kinds that have a batch version of their move routine. Nothing else may look
+// at the state of these during the frame, so they must either take no splash
+// damage, or be tied to the map, where splash damage does not reach them.
+// (Cannons, bullets and effects make up some 40% of all enemy moves in the
+// bundled demos. The rest take splash damage, and most draw from gamerand.)
+bool KOBO_enemies::is_batched(KOBO_enemy_kinds eki)
+{
+	switch(eki)
+	{
+	  case KOBO_EK_BULLET1:
+	  case KOBO_EK_BULLET2:
+	  case KOBO_EK_BULLET3:
+	  case KOBO_EK_CANNON:
+		return true;
+	  default:
+		return is_effect(eki);
+	}
+}
+
+// Run the batch move routine of kind 'eki' over the batch list 'first'
+void KOBO_enemies::move_batch(KOBO_enemy_kinds eki, KOBO_enemy *first)
+{
+	switch(eki)
+	{
+	  case KOBO_EK_BULLET1:
+	  case KOBO_EK_BULLET2:
+	  case KOBO_EK_BULLET3:
+		for(KOBO_enemy *e = first; e; e = e->next)
+			e->move_bullet_batched();
+		break;
+	  case KOBO_EK_CANNON:
+		for(KOBO_enemy *e = first; e; e = e->next)
+			e->move_cannon_batched();
+		break;
+	  case KOBO_EK_RINGEXPL:
+	  case KOBO_EK_GREENBLTEXPL:
+	  case KOBO_EK_REDBLTEXPL:
+	  case KOBO_EK_BLUEBLTEXPL:
+	  case KOBO_EK_BOLTEXPL:
+	  case KOBO_EK_ROCKEXPL:
+		for(KOBO_enemy *e = first; e; e = e->next)
+			e->move_expl_batched();
+		break;
+	  default:
+		// Not batched after all; left for the main pass
+		break;
+	}
+}
+
+// Gameplay enemies interact through the RNG, spawning, splash damage, the
+// player ship and whatnot, so their side effects have to happen one by one, in
+// list order, or replays break.
+//   Kinds that can be batched (see is_batched()) are first grouped by kind, and
+// each group is moved in one go, without the ek->move() dispatch. The batch
+// routines only update the enemy itself, and leave anything that affects the
+// rest of the game (release, launching, hitting or being hit by the player) in
+// 'pending', for commit() to handle when the main pass gets to the enemy. The
+// tile index is not updated until then either.
+//   Enemies spawned during the frame are not in any batch, and are left alone
+// by the main pass as well, so that they start moving on the next frame.
 void KOBO_enemies::move()
 {
 	clean();
-	for(KOBO_enemy *e = NULL; (e = next(e)); )
-		e->move();
+	int n = nlive;
+
+	// Batch lists, in list order, via KOBO_enemy::next
+	KOBO_enemy *first[KOBO_EK__COUNT];
+	KOBO_enemy **last[KOBO_EK__COUNT];
+	for(int k = 0; k < KOBO_EK__COUNT; ++k)
+	{
+		first[k] = NULL;
+		last[k] = &first[k];
+	}
+	for(int i = n - 1; i >= 0; --i)
+	{
+		KOBO_enemy *e = live[i];
+		if(!e->ek || !is_batched(e->ek->eki))
+			continue;
+		*last[e->ek->eki] = e;
+		last[e->ek->eki] = &e->next;
+	}
+	for(int k = 0; k < KOBO_EK__COUNT; ++k)
+	{
+		*last[k] = NULL;
+		if(first[k])
+			move_batch((KOBO_enemy_kinds)k, first[k]);
+	}
+
+	for(int i = n - 1; i >= 0; --i)
+	{
+		KOBO_enemy *e = live[i];
+		if(!e->ek)
+			continue;
+		moving = e;
+		if(e->pending)
+			e->commit();
+		else
+			e->move();
+		if(e->ek)
+			reindex(e);
+	}
+	moving = NULL;
 }
 
 void KOBO_enemies::move_intro()
 {
 	clean();
-	for(KOBO_enemy *e = NULL; (e = next(e)); )
+	for(int i = nlive - 1; i >= 0; --i)
+	{
+		KOBO_enemy *e = live[i];
+		if(!e->ek)
+			continue;
+		moving = e;
 		e->move_intro();
+		if(e->ek)
+			reindex(e);
+	}
+	moving = NULL;
 }
 
 void KOBO_enemies::detach_sounds()
@@ -146,8 +331,9 @@ void KOBO_enemies::restart_sounds()
 
 void KOBO_enemies::put()
 {
-	for(KOBO_enemy *e = NULL; (e = next(e)); )
-		e->put();
+	for(int i = nlive - 1; i >= 0; --i)
+		if(live[i]->ek)
+			live[i]->put();
 }
 
 void KOBO_enemies::force_positions()
@@ -167,25 +353,94 @@ void KOBO_enemies::render_hit_zones()
 KOBO_enemy *KOBO_enemies::make(const KOBO_enemy_kind *ek,
 		int x, int y, int h, int v, int di)
 {
-	KOBO_enemy *e = pool;
-	if(e)
-		pool = e->next;
-	else
-		e = new KOBO_enemy;
+	KOBO_enemy *e = alloc();
 	e->init(ek, x, y, h, v, di);
 	stats[ek->eki].spawned++;
 	stats[ek->eki].health += e->health;
-	e->next = active;
-	active = e;
+	add_live(e);
 	return e;
 }
 
+void KOBO_enemy_list::add(KOBO_enemy *e)
+{
+	if(count >= size)
+	{
+		unsigned ns = size * 2;
+		KOBO_enemy **ni = (KOBO_enemy **)malloc(
+				ns * sizeof(KOBO_enemy *));
+		if(!ni)
+		{
+			log_printf(ELOG, "OOM in KOBO_enemy_list::add()!\n");
+			return;
+		}
+		memcpy(ni, items, count * sizeof(KOBO_enemy *));
+		if(items != local)
+			free(items);
+		items = ni;
+		size = ns;
+	}
+	items[count++] = e;
+}
+
+// Sort into iteration order; newest (highest livepos) first
+void KOBO_enemy_list::sort()
+{
+	for(unsigned i = 1; i < count; ++i)
+	{
+		KOBO_enemy *e = items[i];
+		unsigned j = i;
+		for( ; j && (items[j - 1]->livepos < e->livepos); --j)
+			items[j] = items[j - 1];
+		items[j] = e;
+	}
+}
+
+void KOBO_enemies::find_in_tile(int tx, int ty, KOBO_enemy_list &result)
+{
+	sync();
+	int t = (ty & (MAP_SIZEY - 1)) * MAP_SIZEX + (tx & (MAP_SIZEX - 1));
+	for(KOBO_enemy *e = tiles[t]; e; e = e->tnext)
+		result.add(e);
+	result.sort();
+}
+
+void KOBO_enemies::find_near(int x, int y, int range, KOBO_enemy_list &result)
+{
+	sync();
+	int x0 = CS2PIXEL(x - range) >> TILE_SIZEX_LOG2;
+	int x1 = CS2PIXEL(x + range) >> TILE_SIZEX_LOG2;
+	int y0 = CS2PIXEL(y - range) >> TILE_SIZEY_LOG2;
+	int y1 = CS2PIXEL(y + range) >> TILE_SIZEY_LOG2;
+	if(x1 - x0 >= MAP_SIZEX)
+	{
+		x0 = 0;
+		x1 = MAP_SIZEX - 1;
+	}
+	if(y1 - y0 >= MAP_SIZEY)
+	{
+		y0 = 0;
+		y1 = MAP_SIZEY - 1;
+	}
+	for(int ty = y0; ty <= y1; ++ty)
+	{
+		KOBO_enemy **row = &tiles[(ty & (MAP_SIZEY - 1)) * MAP_SIZEX];
+		for(int tx = x0; tx <= x1; ++tx)
+			for(KOBO_enemy *e = row[tx & (MAP_SIZEX - 1)]; e;
+					e = e->tnext)
+				result.add(e);
+	}
+	result.sort();
+}
+
 int KOBO_enemies::erase_cannon(int x, int y)
 {
 	int count = 0;
-	for(KOBO_enemy *e = NULL; (e = next(e)); )
-		count += e->erase_cannon(x, y);
-	if(count)
+	KOBO_enemy_list el;
+	find_in_tile(x, y, el);
+	for(unsigned i = 0; i < el.length(); ++i)
+		if(el[i]->ek)
+			count += el[i]->erase_cannon(x, y);
+	if(count && !manage.headless())
 		wradar->update(x, y);
 	return count;
 }
@@ -194,18 +449,16 @@ void KOBO_enemies::hit_map(int x, int y, int dmg)
 {
 	if(!dmg)
 		return;
-	for(KOBO_enemy *e = NULL; (e = next(e)); )
-		if(e->can_hit_map(x, y))
-			e->hit(dmg);
+	KOBO_enemy_list el;
+	find_in_tile(x, y, el);
+	for(unsigned i = 0; i < el.length(); ++i)
+		if(el[i]->ek && el[i]->can_hit_map(x, y))
+			el[i]->hit(dmg);
 }
 
 int KOBO_enemies::exist_pipe()
 {
-	int count = 0;
-	for(KOBO_enemy *e = NULL; (e = next(e)); )
-		if(e->is_pipe())
-			count++;
-	return count;
+	return count(KOBO_EK_PIPEIN) + count(KOBO_EK_PIPEOUT);
 }
 
 void KOBO_enemies::set_ekind_to_generate(const KOBO_enemy_kind * e1, int i1,
@@ -223,9 +476,12 @@ void KOBO_enemies::splash_damage(int x, int y, int damage)
 	int dist;
 
 	// Enemies
-	for(KOBO_enemy *e = NULL; (e = next(e)); )
+	KOBO_enemy_list el;
+	find_near(x, y, maxdist, el);
+	for(unsigned i = 0; i < el.length(); ++i)
 	{
-		if(!e->can_splash_damage())
+		KOBO_enemy *e = el[i];
+		if(!e->ek || !e->can_splash_damage())
 			continue;
 		if(!e->in_range(x, y, maxdist, dist))
 			continue;
@@ -244,3 +500,35 @@ void KOBO_enemies::splash_damage(int x, int y, int damage)
 			myship.hit(dmg);
 	}
 }
+
+
+// Mix the game logic state of all enemies into hash 'h'. As with the game logic
+// itself, the order of the enemy list matters! Animation frames, directions and
+// the like may depend on the graphics theme, and must NOT go in here.
+uint32_t KOBO_enemies::hash(uint32_t h)
+{
+	for(KOBO_enemy *e = NULL; (e = next(e)); )
+	{
+		if(is_effect(e->ek->eki))
+			continue;
+		h = hash_mix(h, e->ek->eki);
+		h = hash_mix(h, e->x);
+		h = hash_mix(h, e->y);
+		h = hash_mix(h, e->h);
+		h = hash_mix(h, e->v);
+		h = hash_mix(h, e->a);
+		h = hash_mix(h, e->b);
+		h = hash_mix(h, e->c);
+		h = hash_mix(h, e->health);
+	}
+	for(int i = 0; i < KOBO_EK__COUNT; ++i)
+	{
+		if(is_effect((KOBO_enemy_kinds)i))
+			continue;
+		h = hash_mix(h, stats[i].spawned);
+		h = hash_mix(h, stats[i].killed);
+		h = hash_mix(h, stats[i].health);
+		h = hash_mix(h, stats[i].damage);
+	}
+	return h;
+}
@@ -112,11 +112,32 @@ struct KOBO_enemystats
 	uint32_t	damage;
 };
 
+// Enemy slots are allocated in blocks of this many
+#define	KOBO_ENEMY_BLOCK	1024
+
+// Side effects of batched moves, held until the enemy's turn in list order
+enum KOBO_enemy_pending
+{
+	KOBO_EP_NONE =		0,
+	KOBO_EP_MOVED =		0x01,	// Moved by kind batch; commit() due
+	KOBO_EP_RELEASE =	0x02,	// Done, or out of range
+	KOBO_EP_CONTACT =	0x04,	// Touching the player ship (if alive)
+	KOBO_EP_LAUNCH =	0x08,	// Launch enemies.ek1()
+	KOBO_EP_BOLTS =		0x10	// Check for player bolt hits
+};
+
+class KOBO_enemy_list;
+
 //---------------------------------------------------------------------------//
 class KOBO_enemy
 {
 	friend class KOBO_enemies;
-	KOBO_enemy	*next;
+	friend class KOBO_enemy_list;
+	friend class KOBO_keyframe;
+	KOBO_enemy	*next;		// Next in free pool or move batch
+	int		livepos;	// Index in KOBO_enemies::live[]
+	KOBO_enemy	*tnext, *tprev;	// Tile index list links
+	int		tile;		// Tile index cell, or -1
 	cs_obj_t	*object;	// For the gfxengine connection
 	const KOBO_enemy_kind	*ek;	// NOTE: NULL if enemy is dead!
 	int	x, y;			// Position
@@ -140,6 +161,7 @@ class KOBO_enemy
 	bool	detonate_on_contact;	// Detonate on contact with player
 	int	diffx, diffy, mindiff;	// Distance to player
 	int	hitsize;		// Hit square/circle radius
+	int	pending;		// KOBO_enemy_pending flags
 	void move_enemy_m(int quick, int maxspeed);
 	void move_enemy_template(int quick, int maxspeed);
 	void move_enemy_template_2(int quick, int maxspeed);
@@ -155,6 +177,11 @@ class KOBO_enemy
 	inline void die();
 	void player_collision(int dx, int dy);
 	inline void move();
+	inline void advance();
+	inline void move_bullet_batched();
+	inline void move_expl_batched();
+	inline void move_cannon_batched();
+	inline void commit();
 	inline void move_intro();
 	inline void put();
 	inline void force_position();
@@ -248,30 +275,92 @@ class KOBO_enemy
 };
 
 //---------------------------------------------------------------------------//
+// Enemies are kept in blocks of preallocated slots, that are never moved or
+// freed, so KOBO_enemy pointers stay valid while iterating, even if make() is
+// called. The live[] index lists all enemies in order of creation. Iteration
+// is done newest to oldest, which matters to the game logic, and means that
+// enemies spawned while iterating are not visited until the next pass. Dead
+// enemies (ek == NULL) are skipped until clean() compacts live[] and returns
+// them to the pool.
+struct KOBO_enemy_block
+{
+	KOBO_enemy_block	*next;
+	unsigned		used;
+	KOBO_enemy		slots[KOBO_ENEMY_BLOCK];
+};
+
+// Result of a spatial enemy query; the enemies found, in the same order as
+// KOBO_enemies::next() would visit them.
+class KOBO_enemy_list
+{
+	KOBO_enemy	*local[32];
+	KOBO_enemy	**items;
+	unsigned	count, size;
+  public:
+	KOBO_enemy_list()
+	{
+		items = local;
+		count = 0;
+		size = sizeof(local) / sizeof(local[0]);
+	}
+	~KOBO_enemy_list()
+	{
+		if(items != local)
+			free(items);
+	}
+	void add(KOBO_enemy *e);
+	void sort();
+	unsigned length()			{ return count; }
+	KOBO_enemy *operator[](unsigned i)	{ return items[i]; }
+};
+
 class KOBO_enemies
 {
-	static KOBO_enemy *active;
-	static KOBO_enemy *pool;
-	static const KOBO_enemy_kind *ekind_to_generate_1;
-	static const KOBO_enemy_kind *ekind_to_generate_2;
-	static int e1_interval;
-	static int e2_interval;
+	friend class KOBO_enemy;
+	friend class KOBO_keyframe;
+	static KOBO_TLS KOBO_enemy_block *blocks;
+	static KOBO_TLS KOBO_enemy *pool;	// Free slots (via 'next')
+	static KOBO_TLS KOBO_enemy **live;	// Live index; oldest first
+	static KOBO_TLS unsigned nlive;
+	static KOBO_TLS unsigned livesize;
+	static KOBO_TLS const KOBO_enemy_kind *ekind_to_generate_1;
+	static KOBO_TLS const KOBO_enemy_kind *ekind_to_generate_2;
+	static KOBO_TLS int e1_interval;
+	static KOBO_TLS int e2_interval;
 	static inline KOBO_enemy *next(KOBO_enemy *current)
 	{
-		if(!current)
-			current = active;
-		else
-			current = current->next;
-		while(current && !current->ek)
-			current = current->next;
-		return current;
+		int i = current ? current->livepos : nlive;
+		while(--i >= 0)
+			if(live[i]->ek)
+				return live[i];
+		return NULL;
 	}
+	static KOBO_enemy *alloc();
+	static void add_live(KOBO_enemy *e);
 	static void clean();
+	static bool is_batched(KOBO_enemy_kinds eki);
+	static void move_batch(KOBO_enemy_kinds eki, KOBO_enemy *first);
+
+	// Tile index; all live enemies, listed by the map tile they're over.
+	// Enemies are reindexed after moving, so the only one that can be out
+	// of date is the one currently moving, which is handled by sync().
+	static KOBO_TLS KOBO_enemy *tiles[MAP_SIZEX * MAP_SIZEY];
+	static KOBO_TLS KOBO_enemy *moving;
+	static inline void index(KOBO_enemy *e);
+	static inline void unindex(KOBO_enemy *e);
+	static inline void reindex(KOBO_enemy *e);
+	static inline void sync()
+	{
+		if(moving && moving->ek)
+			reindex(moving);
+	}
       public:
-	static int is_intro;
-	static int sound_update_period;
-	static KOBO_enemystats stats[KOBO_EK__COUNT];
+	static KOBO_TLS int is_intro;
+	static KOBO_TLS int sound_update_period;
+	static KOBO_TLS KOBO_enemystats stats[KOBO_EK__COUNT];
 	static const char *enemy_name(KOBO_enemy_kinds eki);
+	static const KOBO_enemy_kind *enemy_kind(KOBO_enemy_kinds eki);
+	static bool is_effect(KOBO_enemy_kinds eki);	// No gameplay impact
 	static int init();
 	static void off();
 	static void move();
@@ -289,6 +378,19 @@ class KOBO_enemies
 	static void set_ekind_to_generate(const KOBO_enemy_kind * ek1, int i1,
 			const KOBO_enemy_kind * ek2, int i2);
 	static void splash_damage(int x, int y, int damage);
+
+	// Spatial queries. find_near() finds all enemies over tiles touched by
+	// the square (x +/- range, y +/- range), wrapping. (24:8 coordinates.)
+	static void find_in_tile(int tx, int ty, KOBO_enemy_list &result);
+	static void find_near(int x, int y, int range,
+			KOBO_enemy_list &result);
+
+	// Number of live enemies of the specified kind
+	static int count(KOBO_enemy_kinds eki)
+	{
+		return stats[eki].spawned - stats[eki].killed;
+	}
+	static uint32_t hash(uint32_t h);	// Hash logic state (replays)
 	static const KOBO_enemy_kind *ek1()
 	{
 		return ekind_to_generate_1;
@@ -310,6 +412,42 @@ class KOBO_enemies
 extern KOBO_enemies enemies;
 
 
+inline void KOBO_enemies::index(KOBO_enemy *e)
+{
+	int t = WORLD2MAPY(CS2PIXEL(e->y)) * MAP_SIZEX +
+			WORLD2MAPX(CS2PIXEL(e->x));
+	e->tile = t;
+	e->tprev = NULL;
+	e->tnext = tiles[t];
+	if(tiles[t])
+		tiles[t]->tprev = e;
+	tiles[t] = e;
+}
+
+inline void KOBO_enemies::unindex(KOBO_enemy *e)
+{
+	if(e->tile < 0)
+		return;
+	if(e->tprev)
+		e->tprev->tnext = e->tnext;
+	else
+		tiles[e->tile] = e->tnext;
+	if(e->tnext)
+		e->tnext->tprev = e->tprev;
+	e->tile = -1;
+}
+
+inline void KOBO_enemies::reindex(KOBO_enemy *e)
+{
+	int t = WORLD2MAPY(CS2PIXEL(e->y)) * MAP_SIZEX +
+			WORLD2MAPX(CS2PIXEL(e->x));
+	if(t == e->tile)
+		return;
+	unindex(e);
+	index(e);
+}
+
+
 inline void KOBO_enemy::init(const KOBO_enemy_kind *k, int px, int py,
 		int h1, int v1, int dir)
 {
@@ -359,6 +497,7 @@ inline void KOBO_enemy::release()
 	if(object)
 		gengine->free_obj(object);
 	enemies.stats[ek->eki].killed++;
+	enemies.unindex(this);
 	ek = NULL;	// Mark as dead! (Can't safely remove from list here.)
 }
 
@@ -400,8 +539,16 @@ inline void KOBO_enemy::stopsound()
 inline void KOBO_enemy::set_bank(int new_bank)
 {
 	logical_bank = new_bank;
-	actual_bank = s_get_actual_bank(gengine->get_gfx(), logical_bank);
-	s_bank_t *bnk = s_get_bank(gengine->get_gfx(), actual_bank);
+	s_container_t *gfx = gengine->get_gfx();
+	if(!gfx)
+	{
+		// Engine not open; headless game logic
+		actual_bank = logical_bank;
+		frames = 8;
+		return;
+	}
+	actual_bank = s_get_actual_bank(gfx, logical_bank);
+	s_bank_t *bnk = s_get_bank(gfx, actual_bank);
 	if(bnk)
 		frames = bnk->max + 1;
 	else
@@ -534,6 +681,93 @@ inline void KOBO_enemy::move()
 	hit(dmg);	// Bolt damages object
 }
 
+// The first part of ::move(), for kind batches. Only touches this enemy.
+inline void KOBO_enemy::advance()
+{
+	if((soundhandle > 0) && (soundtimer-- <= 0))
+	{
+		sound.g_move(soundhandle, CS2PIXEL(x), CS2PIXEL(y));
+		soundtimer = enemies.sound_update_period;
+	}
+
+	x += h;
+	y += v;
+	x &= PIXEL2CS(WORLD_SIZEX) - 1;
+	y &= PIXEL2CS(WORLD_SIZEY) - 1;
+	diffx = CS2PIXEL(WRAPDISTXCS(x, myship.get_csx()));
+	diffy = CS2PIXEL(WRAPDISTYCS(y, myship.get_csy()));
+	mindiff = MAX(labs(diffx), labs(diffy));
+	pending = KOBO_EP_MOVED;
+}
+
+// ::move() with ::move_bullet(), minus the side effects, which are left for
+// ::commit(). (Bullets are not shootable, so there are no bolt checks.)
+inline void KOBO_enemy::move_bullet_batched()
+{
+	advance();
+	if(mindiff >= ((VIEWLIMIT >> 1) + 32))
+		pending |= KOBO_EP_RELEASE;
+	else if(!mapcollide && (hitsize >= 0) &&
+			(mindiff < (hitsize + myship.get_hitsize())))
+		pending |= KOBO_EP_CONTACT;
+	else
+		contact = 0;
+	++di;
+	if(di > frames)
+		di = 1;
+}
+
+// ::move() with ::move_expl(). Effects never hurt anything, so contact with
+// the player ship has no effect, and is not checked for.
+inline void KOBO_enemy::move_expl_batched()
+{
+	advance();
+	contact = 0;
+	if(++di > a)
+		pending |= KOBO_EP_RELEASE;
+}
+
+// ::move() with ::move_cannon(). Cannons are tied to the map, so they never
+// collide with the player ship, but they can be hit by bolts.
+inline void KOBO_enemy::move_cannon_batched()
+{
+	advance();
+	c++;
+	c &= b;
+	if(c == a && mindiff < ((VIEWLIMIT >> 1) + 8))
+		pending |= KOBO_EP_LAUNCH;
+	contact = 0;
+	if(shootable && (mindiff < ((VIEWLIMIT >> 1) + 8)))
+		pending |= KOBO_EP_BOLTS;
+}
+
+// Apply whatever a kind batch left in 'pending', in the same order as ::move()
+inline void KOBO_enemy::commit()
+{
+	int p = pending;
+	pending = KOBO_EP_NONE;
+	if(p & KOBO_EP_RELEASE)
+	{
+		release();
+		return;
+	}
+	if(p & KOBO_EP_LAUNCH)
+		launch(enemies.ek1());
+	if(p & KOBO_EP_CONTACT)
+	{
+		if(myship.alive())
+			player_collision(WRAPDISTXCS(x, myship.get_csx()),
+					WRAPDISTYCS(y, myship.get_csy()));
+		else
+			contact = 0;
+		if(!ek)
+			return;
+	}
+	if(p & KOBO_EP_BOLTS)
+		hit(myship.hit_bolt(CS2PIXEL(x), CS2PIXEL(y),
+				hitsize + HIT_BOLT, health));
+}
+
 inline void KOBO_enemy::move_intro()
 {
 	x += h;
@@ -148,7 +148,7 @@ inline void KOBO_enemy::move_enemy_template_3(int quick, int maxspeed)
 		di = ndi;
 }
 
-inline void KOBO_enemy::launch(const KOBO_enemy_kind *ekp)
+void KOBO_enemy::launch(const KOBO_enemy_kind *ekp)
 {
 	if(prefs->cheat_ceasefire || enemies.is_intro || !myship.alive())
 		return;
@@ -185,7 +185,7 @@ void KOBO_enemy::shot_template_8_dir(const KOBO_enemy_kind *ekp)
 void KOBO_enemy::explode()
 {
 	KOBO_ParticleFXDef *pfxd = themedata.pfxdef(ek->deathpfx);
-	if(pfxd)
+	if(pfxd && !manage.headless())
 		wfire->Spawn(x + h, y + v, h, v, pfxd);
 }
 
@@ -560,7 +560,7 @@ void KOBO_enemy::move_bomb1()
 	enemies.make(&bullet3, x, y, vx2, vy2);
 	enemies.make(&bullet3, x, y, vx3, vy3);
 	KOBO_ParticleFXDef *pfxd = themedata.pfxdef(KOBO_PFX_BOMB1DETO);
-	if(pfxd)
+	if(pfxd && !manage.headless())
 		wfire->Spawn(x + h, y + v, vx1, vy1, pfxd);
 	playsound(S_BOMB1_DETONATE);
 	release();
@@ -649,7 +649,7 @@ void KOBO_enemy::move_bomb2()
 	enemies.make(&bullet3, x, y, vx4, vy4);
 	enemies.make(&bullet3, x, y, vx5, vy5);
 	KOBO_ParticleFXDef *pfxd = themedata.pfxdef(KOBO_PFX_BOMB2DETO);
-	if(pfxd)
+	if(pfxd && !manage.headless())
 		wfire->Spawn(x + h, y + v, vx1, vy1, pfxd);
 	playsound(S_BOMB2_DETONATE);
 	release();
@@ -914,7 +914,7 @@ void KOBO_enemy::move_core()
 		int yo = pubrand.get(12) - (1 << 11);
 		KOBO_ParticleFXDef *pfxd = themedata.pfxdef(
 				KOBO_PFX_CORE_FIRE);
-		if(pfxd)
+		if(pfxd && !manage.headless())
 			wfire->Spawn(x + xo, y + yo, xo >> 4, yo >> 4, pfxd);
 		controlsound(2, 0.1f);
 	}
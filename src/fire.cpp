@@ -23,6 +23,13 @@
 #include "gfxengine.h"
 #include "kobo.h"
 #include "logger.h"
+#include <limits.h>
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define	FIRE_X86_SIMD
+#	include <immintrin.h>
+#endif
 
 // Debug: Define to disable "fire effect" filter, to see raw particles
 #undef	FIRE_NOFILTER
@@ -30,11 +37,30 @@
 // Debug: Define to render subtle noise around the edges of the buffer
 #undef	FIRE_SHOW_EDGE
 
+static void fire_select_kernels();
+
+// Sine table for particle spawning; 16 bit angles
+#define	FIRE_SIN_BITS	12
+#define	FIRE_SIN_SIZE	(1 << FIRE_SIN_BITS)
+static float fire_sintab[FIRE_SIN_SIZE];
+
+static inline float fire_sin(int a)
+{
+	return fire_sintab[(a >> (16 - FIRE_SIN_BITS)) & (FIRE_SIN_SIZE - 1)];
+}
+
+static inline float fire_cos(int a)
+{
+	return fire_sin(a + 16384);
+}
+
 
 KOBO_ParticleFXDef::KOBO_ParticleFXDef()
 {
 	next = NULL;
 	child = NULL;
+	program = NULL;
+	programsize = 0;
 	Reset();
 }
 
@@ -47,6 +73,7 @@ KOBO_ParticleFXDef::~KOBO_ParticleFXDef()
 
 void KOBO_ParticleFXDef::Reset()
 {
+	Decompile();
 	while(next)
 	{
 		KOBO_ParticleFXDef *nd = next;
@@ -72,6 +99,7 @@ void KOBO_ParticleFXDef::Reset()
 
 void KOBO_ParticleFXDef::Default()
 {
+	Decompile();
 	delay.Set(0.0f, 0.0f);
 	threshold = 0;
 	init_count = 256;
@@ -88,6 +116,7 @@ void KOBO_ParticleFXDef::Default()
 
 KOBO_ParticleFXDef *KOBO_ParticleFXDef::Add()
 {
+	Decompile();
 	KOBO_ParticleFXDef *d = this;
 	while(d->next)
 		d = d->next;
@@ -98,21 +127,294 @@ KOBO_ParticleFXDef *KOBO_ParticleFXDef::Add()
 
 KOBO_ParticleFXDef *KOBO_ParticleFXDef::Child()
 {
+	Decompile();
 	if(!child)
 		child = new KOBO_ParticleFXDef;
 	return child;
 }
 
 
+void KOBO_ParticleFXDef::Decompile()
+{
+	free(program);
+	program = NULL;
+	programsize = 0;
+}
+
+
+unsigned KOBO_ParticleFXDef::ProgramSize() const
+{
+	unsigned n = 0;
+	for(const KOBO_ParticleFXDef *d = this; d; d = d->next)
+		n += 1 + (d->child ? d->child->ProgramSize() : 0);
+	return n;
+}
+
+
+// Emit the cluster starting at this definition at 'pos', followed by the
+// clusters of the children. Returns the index of the first unused step.
+unsigned KOBO_ParticleFXDef::Emit(KOBO_ParticleFXStep *prog,
+		unsigned pos) const
+{
+	unsigned end = pos;
+	for(const KOBO_ParticleFXDef *d = this; d; d = d->next)
+		++end;
+	for(const KOBO_ParticleFXDef *d = this; d; d = d->next, ++pos)
+	{
+		KOBO_ParticleFXStep *st = &prog[pos];
+		st->last = !d->next;
+		st->child = 0;
+		st->count = d->init_count;
+		if(st->count > FIRE_MAX_PARTICLES)
+		{
+			log_printf(WLOG, "KOBO_ParticleFXDef: Too many "
+					"particles! (%d - max is %d)\n",
+					st->count, FIRE_MAX_PARTICLES);
+			st->count = FIRE_MAX_PARTICLES;
+		}
+		st->threshold = d->threshold;
+		st->delay = d->delay;
+		st->xoffs = d->xoffs;
+		st->yoffs = d->yoffs;
+		st->radius = d->radius;
+		st->twist = d->twist;
+		st->speed = d->speed;
+		st->drag = d->drag;
+		st->heat = d->heat;
+		st->fade = d->fade;
+		if(d->child)
+		{
+			st->child = end;
+			end = d->child->Emit(prog, end);
+		}
+	}
+	return end;
+}
+
+
+bool KOBO_ParticleFXDef::Compile()
+{
+	Decompile();
+	unsigned n = ProgramSize();
+	program = (KOBO_ParticleFXStep *)malloc(n * sizeof(*program));
+	if(!program)
+		return false;
+	programsize = n;
+	Emit(program, 0);
+	return true;
+}
+
+
+/*
+ * Worker pool for filtering and rendering
+ *
+ * Filtering and rendering both write one row of output per row of the heat
+ * buffer, and only read the previous heat buffer, so jobs are split into bands
+ * of tile rows that are processed by the calling thread and the workers in any
+ * order. Each band reads the rows around it (halo) from the source buffer, but
+ * never writes outside of its own rows, or touches the state of tiles outside
+ * them, so the result is the same regardless of the number of threads.
+ *
+ * The pool is shared by all KOBO_Fire instances. Jobs may be issued by the
+ * main thread as well as the async update threads, but only one job runs at a
+ * time. The thread count is only ever changed by the main thread, through
+ * configure().
+ */
+
+typedef void (*fire_band_cb)(void *userdata, int tymin, int tymax);
+
+class KOBO_FirePool
+{
+	static int users;
+	static SDL_mutex *mutex;	// Serializes run()
+	static int nthreads;		// Including the calling thread!
+	static int wanted;		// Last count asked for (main thread)
+	static SDL_Thread *threads[FIRE_MAX_THREADS];
+	static SDL_sem *gosem;
+	static SDL_sem *donesem;
+	static SDL_atomic_t quit;
+
+	// Current job
+	static SDL_atomic_t nextband;
+	static int nbands;
+	static int nunits;
+	static fire_band_cb callback;
+	static void *userdata;
+
+	static void work()
+	{
+		int b;
+		while((b = SDL_AtomicAdd(&nextband, 1)) < nbands)
+			callback(userdata, nunits * b / nbands,
+					nunits * (b + 1) / nbands - 1);
+	}
+	static int worker(void *data)
+	{
+		while(1)
+		{
+			SDL_SemWait(gosem);
+			if(SDL_AtomicGet(&quit))
+				return 0;
+			work();
+			SDL_SemPost(donesem);
+		}
+	}
+	static void stop();
+	static void start(int n);
+  public:
+	static void open()
+	{
+		if(!users++)
+			mutex = SDL_CreateMutex();
+	}
+	static void close()
+	{
+		if(--users)
+			return;
+		stop();
+		wanted = 1;
+		if(mutex)
+			SDL_DestroyMutex(mutex);
+		mutex = NULL;
+	}
+	static void configure(int n);
+	static void run(fire_band_cb cb, void *ud, int units);
+};
+
+int KOBO_FirePool::users = 0;
+SDL_mutex *KOBO_FirePool::mutex = NULL;
+int KOBO_FirePool::nthreads = 1;
+int KOBO_FirePool::wanted = 1;
+SDL_Thread *KOBO_FirePool::threads[FIRE_MAX_THREADS];
+SDL_sem *KOBO_FirePool::gosem = NULL;
+SDL_sem *KOBO_FirePool::donesem = NULL;
+SDL_atomic_t KOBO_FirePool::quit;
+SDL_atomic_t KOBO_FirePool::nextband;
+int KOBO_FirePool::nbands = 0;
+int KOBO_FirePool::nunits = 0;
+fire_band_cb KOBO_FirePool::callback = NULL;
+void *KOBO_FirePool::userdata = NULL;
+
+
+void KOBO_FirePool::stop()
+{
+	SDL_AtomicSet(&quit, 1);
+	for(int i = 1; i < nthreads; ++i)
+		SDL_SemPost(gosem);
+	for(int i = 1; i < nthreads; ++i)
+		SDL_WaitThread(threads[i], NULL);
+	SDL_AtomicSet(&quit, 0);
+	nthreads = 1;
+	if(gosem)
+		SDL_DestroySemaphore(gosem);
+	if(donesem)
+		SDL_DestroySemaphore(donesem);
+	gosem = donesem = NULL;
+}
+
+
+void KOBO_FirePool::start(int n)
+{
+	gosem = SDL_CreateSemaphore(0);
+	donesem = SDL_CreateSemaphore(0);
+	if(!gosem || !donesem)
+	{
+		log_printf(WLOG, "KOBO_Fire: Could not create semaphores: "
+				"%s\n", SDL_GetError());
+		stop();
+		return;
+	}
+	nthreads = 1;
+	while(nthreads < n)
+	{
+		SDL_Thread *t = SDL_CreateThread(worker, "Fire", NULL);
+		if(!t)
+		{
+			log_printf(WLOG, "KOBO_Fire: Could not create worker "
+					"thread: %s\n", SDL_GetError());
+			break;
+		}
+		threads[nthreads++] = t;
+	}
+	log_printf(VLOG, "KOBO_Fire: Using %d threads.\n", nthreads);
+}
+
+
+// Set the number of threads to use, 0 meaning one per CPU. We compare against
+// what we asked for rather than what we got, so that failing to start some or
+// all of the workers doesn't have us retrying every frame.
+void KOBO_FirePool::configure(int n)
+{
+	if(n <= 0)
+		n = SDL_GetCPUCount();
+	if(n > FIRE_MAX_THREADS)
+		n = FIRE_MAX_THREADS;
+	if(n < 1)
+		n = 1;
+	if(n == wanted)
+		return;
+
+	// Wait for any job in progress, as an async thread may be running one
+	if(mutex)
+		SDL_LockMutex(mutex);
+	wanted = n;
+	stop();
+	if(n > 1)
+		start(n);
+	if(mutex)
+		SDL_UnlockMutex(mutex);
+}
+
+
+void KOBO_FirePool::run(fire_band_cb cb, void *ud, int units)
+{
+	if(mutex)
+		SDL_LockMutex(mutex);
+
+	int nb = units;
+	if(nb > nthreads * 4)
+		nb = nthreads * 4;	// Some slack for load balancing
+	if((nthreads < 2) || (nb < 2))
+	{
+		cb(ud, 0, units - 1);
+		if(mutex)
+			SDL_UnlockMutex(mutex);
+		return;
+	}
+
+	callback = cb;
+	userdata = ud;
+	nunits = units;
+	nbands = nb;
+	SDL_AtomicSet(&nextband, 0);
+	for(int i = 1; i < nthreads; ++i)
+		SDL_SemPost(gosem);
+	work();
+	for(int i = 1; i < nthreads; ++i)
+		SDL_SemWait(donesem);
+	if(mutex)
+		SDL_UnlockMutex(mutex);
+}
+
+
 KOBO_Fire::KOBO_Fire(gfxengine_t *e) : stream_window_t(e)
 {
 	worldw = worldh = 0;
 	viewmargin = 0;
 	cxmin = cymin = 0;
+	nextcxmin = nextcymin = 0;
 	xmargin = ymargin = 0;
 	bufw = bufh = 0;
+	scaleshift = 0;
+	tilesw = tilesh = 0;
+	tilestate = NULL;
+	tilehot[0] = tilehot[1] = NULL;
+	tileneed = tiledirty = NULL;
+	tileprev = texdirty = NULL;
 	ncolors = 0;
 	threshold = 0;
+	lutdither = -1;
+	lutcolors = 0;
 	buffers[0] = buffers[1] = NULL;
 	current_buffer = 0;
 	noisestate = 16576;
@@ -122,33 +424,135 @@ KOBO_Fire::KOBO_Fire(gfxengine_t *e) : stream_window_t(e)
 	need_refresh = true;
 	autoinvalidate(true);
 	psystems = NULL;
-	psystempool = NULL;
+	skipclock = 0;
+	spawnprog = NULL;
+	spawnprogsize = 0;
 	pscount = pcount = 0;
+	statpscount = statpcount = 0;
+	for(int i = 0; i < FIRE_PS_CLASSES; ++i)
+		psystempool[i] = NULL;
+	arena = NULL;
+	arenaused = FIRE_ARENA_BLOCK;
+	arenasize = 0;
+	psalloc = palloc = 0;
+	pspeak = ppeak = 0;
 	standby_timer = FIRE_STANDBY_DELAY;
+	refresh_dst = NULL;
+	refresh_pitch = 0;
+	refresh_fill = true;
+	ditherseed = 16576;
+	asyncthread = NULL;
+	asyncgo = asyncdone = NULL;
+	asyncquit = asyncfailed = false;
+	asyncactive = asyncbusy = asyncrendered = false;
+	pixbufs[0] = pixbufs[1] = NULL;
+	pixshown = 0;
+	pixfull = 0;
+	fire_select_kernels();
+	KOBO_FirePool::open();
 }
 
 
 KOBO_Fire::~KOBO_Fire()
 {
+	if(asyncthread)
+	{
+		Sync();
+		asyncquit = true;
+		SDL_SemPost(asyncgo);
+		SDL_WaitThread(asyncthread, NULL);
+	}
+	if(asyncgo)
+		SDL_DestroySemaphore(asyncgo);
+	if(asyncdone)
+		SDL_DestroySemaphore(asyncdone);
+	KOBO_FirePool::close();
 	free(buffers[0]);
 	free(buffers[1]);
-	while(psystems)
+	free(pixbufs[0]);
+	free(pixbufs[1]);
+	free(tilestate);
+	free(spawnprog);
+	while(arena)
 	{
-		KOBO_ParticleSystem *ps = psystems;
-		psystems = ps->next;
-		delete ps;
+		void *b = arena;
+		arena = *(void **)b;
+		free(b);
 	}
-	while(psystempool)
+}
+
+
+// Round up to a multiple of 16 bytes, to keep the arena nicely aligned
+#define	FIRE_ARENA_ALIGN(x)	(((x) + 15) & ~15)
+
+KOBO_ParticleSystem *KOBO_Fire::AllocPSystem(int nparticles)
+{
+	int sc = 0;
+	while((sc < FIRE_PS_CLASSES - 1) &&
+			((FIRE_MIN_PARTICLES << sc) < nparticles))
+		++sc;
+	int size = FIRE_MIN_PARTICLES << sc;
+
+	KOBO_ParticleSystem *ps = psystempool[sc];
+	if(ps)
+		psystempool[sc] = ps->next;
+	else
 	{
-		KOBO_ParticleSystem *ps = psystempool;
-		psystempool = ps->next;
-		delete ps;
+		// Carve a new one from the arena
+		unsigned hsize = FIRE_ARENA_ALIGN(sizeof(KOBO_ParticleSystem));
+		unsigned psize = hsize + 7 * size * sizeof(int);
+		if(arenaused + psize > FIRE_ARENA_BLOCK)
+		{
+			void *b = malloc(FIRE_ARENA_BLOCK);
+			if(!b)
+			{
+				log_printf(ELOG, "KOBO_Fire: Out of memory!\n");
+				return NULL;
+			}
+			*(void **)b = arena;
+			arena = b;
+			arenaused = FIRE_ARENA_ALIGN(sizeof(void *));
+			arenasize += FIRE_ARENA_BLOCK;
+		}
+		char *m = (char *)arena + arenaused;
+		arenaused += psize;
+		ps = (KOBO_ParticleSystem *)m;
+		ps->sizeclass = sc;
+		int *d = (int *)(m + hsize);
+		ps->px = d;
+		ps->py = d + size;
+		ps->pz = d + size * 2;
+		ps->pdx = d + size * 3;
+		ps->pdy = d + size * 4;
+		ps->pzc = d + size * 5;
+		ps->pdrag = d + size * 6;
 	}
+
+	++psalloc;
+	palloc += size;
+	if(psalloc > pspeak)
+		pspeak = psalloc;
+	if(palloc > ppeak)
+		ppeak = palloc;
+	ps->next = NULL;
+	ps->skipbase = skipclock;
+	ps->life = -1;
+	return ps;
+}
+
+
+void KOBO_Fire::FreePSystem(KOBO_ParticleSystem *ps)
+{
+	--psalloc;
+	palloc -= FIRE_MIN_PARTICLES << ps->sizeclass;
+	ps->next = psystempool[ps->sizeclass];
+	psystempool[ps->sizeclass] = ps;
 }
 
 
 void KOBO_Fire::SetPalette(unsigned pal)
 {
+	Sync();
 	ncolors = engine->palette_size(pal) + 1;
 	if(ncolors > FIRE_MAX_COLORS)
 		ncolors = FIRE_MAX_COLORS;
@@ -159,11 +563,13 @@ void KOBO_Fire::SetPalette(unsigned pal)
 	for( ; i < FIRE_MAX_COLORS; ++i)
 		colors[i] = map_rgb(0xff00ff);	// Error: Should never be seen!
 	threshold = FIRE_HEAT_THRESHOLD / ncolors;
+	lutdither = -1;
 }
 
 
 void KOBO_Fire::SetWorldSize(int w, int h)
 {
+	Sync();
 	worldw = w;
 	worldh = h;
 }
@@ -171,11 +577,25 @@ void KOBO_Fire::SetWorldSize(int w, int h)
 
 void KOBO_Fire::UpdateViewSize()
 {
+	Sync();
+
+	// Async pixel buffers are reallocated by the next update()
+	free(pixbufs[0]);
+	free(pixbufs[1]);
+	pixbufs[0] = pixbufs[1] = NULL;
+	asyncactive = false;
+
+	// Resolution divisor; 1, 2 or 4
+	scaleshift = 0;
+	while((scaleshift < 2) && ((2 << scaleshift) <= prefs->firescale))
+		++scaleshift;
+
 	// Calculate tile granularity, power-of-two buffer size with margin
 	if(width() && height())
 	{
-		unsigned w = width() + viewmargin;
-		unsigned h = height() + viewmargin;
+		int round = (1 << scaleshift) - 1;
+		unsigned w = (width() + viewmargin + round) >> scaleshift;
+		unsigned h = (height() + viewmargin + round) >> scaleshift;
 		bufw = FIRE_TILE_SIZE;
 		while(bufw < w)
 			bufw <<= 1;
@@ -186,11 +606,11 @@ void KOBO_Fire::UpdateViewSize()
 	else
 		bufw = bufh = 0;	// Invisible window ==> disable!
 
-	xmargin = bufw - width();
-	ymargin = bufh - height();
+	xmargin = (bufw << scaleshift) - width();
+	ymargin = (bufh << scaleshift) - height();
 
 	// Update texture size
-	buffersize(bufw, bufh);
+	buffersize(bufw, bufh, 1 << scaleshift);
 
 	// Update internal rendering buffer size
 	unsigned size = bufw * bufh * sizeof(Uint32);
@@ -209,14 +629,40 @@ void KOBO_Fire::UpdateViewSize()
 		else
 			size = 0;
 	}
+	if(size)
+	{
+		// Tile state: hot flags for both buffers, need, dirty...
+		tilesw = bufw / FIRE_TILE_SIZE;
+		tilesh = bufh / FIRE_TILE_SIZE;
+		unsigned nt = tilesw * tilesh;
+		Uint8 *ts = (Uint8 *)realloc(tilestate, nt * 6);
+		if(ts)
+		{
+			tilestate = ts;
+			tilehot[0] = ts;
+			tilehot[1] = ts + nt;
+			tileneed = ts + nt * 2;
+			tiledirty = ts + nt * 3;
+			tileprev = ts + nt * 4;
+			texdirty = ts + nt * 5;
+		}
+		else
+			size = 0;
+	}
 	if(size && buffers[0] && buffers[1])
 		Clear(true, false);
 	else
 	{
 		free(buffers[0]);
 		free(buffers[1]);
+		free(tilestate);
 		bufw = bufh = 0;
+		tilesw = tilesh = 0;
 		buffers[0] = buffers[1] = NULL;
+		tilestate = NULL;
+		tilehot[0] = tilehot[1] = NULL;
+		tileneed = tiledirty = NULL;
+		tileprev = texdirty = NULL;
 	}
 }
 
@@ -231,13 +677,16 @@ void KOBO_Fire::place(int left, int top, int sizex, int sizey)
 void KOBO_Fire::scroll(int x, int y, bool wrap)
 {
 	stream_window_t::scroll(x, y, wrap);
-	cxmin = mod(CS2PIXEL(scrollx) - xmargin / 2, worldw);
-	cymin = mod(CS2PIXEL(scrolly) - ymargin / 2, worldh);
+	nextcxmin = mod(CS2PIXEL(scrollx) - xmargin / 2, worldw);
+	nextcymin = mod(CS2PIXEL(scrolly) - ymargin / 2, worldh);
 }
 
 
 void KOBO_Fire::Clear(bool buffer, bool particles)
 {
+	Sync();
+	if(skipclock)
+		FinishSkip();
 	if(buffer)
 	{
 		unsigned size = bufw * bufh * sizeof(Uint32);
@@ -245,6 +694,10 @@ void KOBO_Fire::Clear(bool buffer, bool particles)
 		{
 			memset(buffers[0], 0, size);
 			memset(buffers[1], 0, size);
+			unsigned nt = tilesw * tilesh;
+			memset(tilehot[0], 0, nt * 2);
+			memset(tiledirty, 1, nt);
+			memset(tileprev, 0, nt);
 		}
 		need_refresh = true;
 	}
@@ -254,43 +707,183 @@ void KOBO_Fire::Clear(bool buffer, bool particles)
 		{
 			KOBO_ParticleSystem *ps = psystems;
 			psystems = ps->next;
-			ps->next = psystempool;
-			psystempool = ps;
+			FreePSystem(ps);
 		}
 
 	standby_timer = 0;
 }
 
 
-bool KOBO_Fire::RunPSystem(KOBO_ParticleSystem *ps)
+// SaveParticles() state: Noise state, number of particle systems, and then
+// for each particle system, a header followed by the particles.
+#define	FIRE_STATE_HEADER	2
+#define	FIRE_PS_HEADER		5
+#define	FIRE_PARTICLE_WORDS	7
+
+unsigned KOBO_Fire::SaveParticles(int32_t *buf)
 {
-	int xmask = bufw - 1;
-	int ymask = bufh - 1;
-	Uint32 *dst = buffers[current_buffer];
-	for(int i = 0; i < ps->nparticles; ++i)
+	Sync();
+	if(skipclock)
+		FinishSkip();
+	unsigned size = FIRE_STATE_HEADER;
+	int n = 0;
+	for(KOBO_ParticleSystem *ps = psystems; ps; ps = ps->next, ++n)
+	{
+		int32_t *d = buf + size;
+		size += FIRE_PS_HEADER + ps->nparticles * FIRE_PARTICLE_WORDS;
+		if(!buf)
+			continue;
+		*d++ = ps->delay;
+		*d++ = ps->x;
+		*d++ = ps->y;
+		*d++ = ps->threshold;
+		*d++ = ps->nparticles;
+		for(int i = 0; i < ps->nparticles; ++i)
+		{
+			*d++ = ps->px[i];
+			*d++ = ps->py[i];
+			*d++ = ps->pz[i];
+			*d++ = ps->pdx[i];
+			*d++ = ps->pdy[i];
+			*d++ = ps->pzc[i];
+			*d++ = ps->pdrag[i];
+		}
+	}
+	if(buf)
+	{
+		buf[0] = noisestate;
+		buf[1] = n;
+	}
+	return size;
+}
+
+
+void KOBO_Fire::RestoreParticles(const int32_t *buf, unsigned size)
+{
+	Sync();
+	Clear(false, true);
+	if(size < FIRE_STATE_HEADER)
+		return;
+
+	noisestate = buf[0];
+	int n = buf[1];
+	const int32_t *s = buf + FIRE_STATE_HEADER;
+	const int32_t *end = buf + size;
+
+	// Rebuild the list in the original order
+	KOBO_ParticleSystem *last = NULL;
+	for(int j = 0; j < n; ++j)
 	{
-		KOBO_Particle *p = &ps->particles[i];
+		if(s + FIRE_PS_HEADER > end)
+			break;
+		int np = s[4];
+		if((np < 0) || (np > FIRE_MAX_PARTICLES) ||
+				(s + FIRE_PS_HEADER +
+				np * FIRE_PARTICLE_WORDS > end))
+		{
+			log_printf(ELOG, "KOBO_Fire::RestoreParticles(): "
+					"Corrupt state data!\n");
+			break;
+		}
 
-		// Update
-		p->z = p->z * p->zc >> 12;
-		if(p->z < ps->threshold)
+		KOBO_ParticleSystem *ps = AllocPSystem(np);
+		if(!ps)
+			break;
+		if(last)
+			last->next = ps;
+		else
+			psystems = ps;
+		last = ps;
+
+		ps->delay = *s++;
+		ps->x = *s++;
+		ps->y = *s++;
+		ps->threshold = *s++;
+		ps->nparticles = *s++;
+		for(int i = 0; i < np; ++i)
 		{
-			// Dead! Remove.
-			--ps->nparticles;
-			ps->particles[i] = ps->particles[ps->nparticles];
-			--i;
-			continue;
+			ps->px[i] = *s++;
+			ps->py[i] = *s++;
+			ps->pz[i] = *s++;
+			ps->pdx[i] = *s++;
+			ps->pdy[i] = *s++;
+			ps->pzc[i] = *s++;
+			ps->pdrag[i] = *s++;
 		}
-		p->x += p->dx;
-		p->y += p->dy;
-		p->dx = (p->dx >> 2) * p->drag >> 10;
-		p->dy = (p->dy >> 2) * p->drag >> 10;
+	}
+}
+
+
+// Move and cool down 'n' particles. There are no branches or dependencies, so
+// this can be vectorized, as long as the compiler knows that the arrays don't
+// alias. (GCC only reliably takes __restrict into account for arguments.)
+static inline void fire_move_particles(int n,
+		int * __restrict px, int * __restrict py,
+		int * __restrict pz, int * __restrict pdx,
+		int * __restrict pdy, const int * __restrict pzc,
+		const int * __restrict pdrag)
+{
+	for(int i = 0; i < n; ++i)
+	{
+		pz[i] = pz[i] * pzc[i] >> 12;
+		px[i] += pdx[i];
+		py[i] += pdy[i];
+		pdx[i] = (pdx[i] >> 2) * pdrag[i] >> 10;
+		pdy[i] = (pdy[i] >> 2) * pdrag[i] >> 10;
+	}
+}
+
+
+// Update all particles of 'ps', and remove the ones that have cooled down below
+// the threshold. Returns the number of particles left.
+static inline int fire_update_particles(KOBO_ParticleSystem *ps)
+{
+	int n = ps->nparticles;
+	fire_move_particles(n, ps->px, ps->py, ps->pz, ps->pdx, ps->pdy,
+			ps->pzc, ps->pdrag);
+
+	// Remove dead particles, keeping the order of the rest
+	int threshold = ps->threshold;
+	int i = 0;
+	while((i < n) && (ps->pz[i] >= threshold))
+		++i;
+	int j = i;
+	for( ; i < n; ++i)
+	{
+		if(ps->pz[i] < threshold)
+			continue;
+		ps->px[j] = ps->px[i];
+		ps->py[j] = ps->py[i];
+		ps->pz[j] = ps->pz[i];
+		ps->pdx[j] = ps->pdx[i];
+		ps->pdy[j] = ps->pdy[i];
+		ps->pzc[j] = ps->pzc[i];
+		ps->pdrag[j] = ps->pdrag[i];
+		++j;
+	}
+	return ps->nparticles = j;
+}
 
-		// Render
-		dst[bufw * ((p->y >> 16) & ymask) +
-				((p->x >> 16) & xmask)] += p->z;
+
+bool KOBO_Fire::RunPSystem(KOBO_ParticleSystem *ps)
+{
+	int n = fire_update_particles(ps);
+
+	// Render. (At reduced resolution, heat is scaled by pixel area.)
+	int xmask = bufw - 1;
+	int ymask = bufh - 1;
+	int cs = 16 + scaleshift;
+	int zs = scaleshift * 2;
+	Uint32 *dst = buffers[current_buffer];
+	Uint8 *hot = tilehot[current_buffer];
+	for(int i = 0; i < n; ++i)
+	{
+		int x = (ps->px[i] >> cs) & xmask;
+		int y = (ps->py[i] >> cs) & ymask;
+		dst[bufw * y + x] += ps->pz[i] >> zs;
+		hot[tilesw * (y / FIRE_TILE_SIZE) + x / FIRE_TILE_SIZE] = 1;
 	}
-	return ps->nparticles > 0;
+	return n > 0;
 }
 
 
@@ -325,8 +918,7 @@ void KOBO_Fire::RunParticles()
 					pps->next = nps;
 				else
 					psystems = nps;
-				ps->next = psystempool;
-				psystempool = ps;
+				FreePSystem(ps);
 				ps = nps;
 			}
 		}
@@ -334,97 +926,161 @@ void KOBO_Fire::RunParticles()
 }
 
 
-bool KOBO_Fire::RunPSystemNR(KOBO_ParticleSystem *ps)
+/*
+ * Fast-forward
+ *
+ * While skipping, update_norender() only advances 'skipclock', and drops the
+ * particle systems that are known to have burned out by then. The survivors
+ * are aged in closed form by FinishSkip(), before anything looks at them. This
+ * is not exact, as it ignores the rounding of the fixed point math, but the
+ * fire doesn't affect the game logic anyway.
+ */
+
+// Number of updates a particle survives, including the one that removes it
+static int fire_particle_life(int z, int zc, int threshold)
+{
+	if(threshold <= 0)
+		return INT_MAX;
+	if(z < threshold || z <= 0 || zc <= 0)
+		return 1;
+	if(zc >= 4096)
+		return INT_MAX;
+	double l = log((double)threshold / z) / log(zc / 4096.0);
+	if(l >= INT_MAX - 1)
+		return INT_MAX;
+	return (int)l + 1;
+}
+
+
+// Age all particles of 'ps' by 'frames' updates, and remove the ones that would
+// have cooled down below the threshold. Returns the number of particles left.
+static int fire_skip_particles(KOBO_ParticleSystem *ps, int frames)
 {
-	for(int i = 0; i < ps->nparticles; ++i)
+	int n = ps->nparticles;
+	int j = 0;
+	for(int i = 0; i < n; ++i)
 	{
-		KOBO_Particle *p = &ps->particles[i];
+		if(fire_particle_life(ps->pz[i], ps->pzc[i], ps->threshold) <=
+				frames)
+			continue;
+
+		// Velocity decays geometrically, so the distance traveled is
+		// the sum of a geometric series.
+		double d = ps->pdrag[i] / 4096.0;
+		double dn = pow(d, frames);
+		double dist = fabs(1.0 - d) < 1e-9 ?
+				frames : (1.0 - dn) / (1.0 - d);
+		ps->px[j] = ps->px[i] + (int)(ps->pdx[i] * dist);
+		ps->py[j] = ps->py[i] + (int)(ps->pdy[i] * dist);
+		ps->pdx[j] = ps->pdx[i] * dn;
+		ps->pdy[j] = ps->pdy[i] * dn;
+		ps->pz[j] = ps->pz[i] * pow(ps->pzc[i] / 4096.0, frames);
+		ps->pzc[j] = ps->pzc[i];
+		ps->pdrag[j] = ps->pdrag[i];
+		++j;
+	}
+	return ps->nparticles = j;
+}
 
-		// Update
-		p->z = p->z * p->zc >> 12;
-		if(p->z < ps->threshold)
+
+// Drop particle systems that have burned out by 'skipclock'
+void KOBO_Fire::SkipParticles()
+{
+	KOBO_ParticleSystem *ps = psystems;
+	KOBO_ParticleSystem *pps = NULL;
+	while(ps)
+	{
+		if(ps->life < 0)
 		{
-			// Dead! Remove.
-			--ps->nparticles;
-			ps->particles[i] = ps->particles[ps->nparticles];
-			--i;
-			continue;
+			// Calculated once, on the first skipped frame
+			ps->life = 0;
+			for(int i = 0; i < ps->nparticles; ++i)
+			{
+				int l = fire_particle_life(ps->pz[i],
+						ps->pzc[i], ps->threshold);
+				if(l > ps->life)
+					ps->life = l;
+			}
+		}
+		int age = skipclock - ps->skipbase - ps->delay;
+		if((age > 0) && (age >= ps->life))
+		{
+			KOBO_ParticleSystem *nps = ps->next;
+			if(pps)
+				pps->next = nps;
+			else
+				psystems = nps;
+			FreePSystem(ps);
+			ps = nps;
+		}
+		else
+		{
+			pps = ps;
+			ps = ps->next;
 		}
-		p->x += p->dx;
-		p->y += p->dy;
-		p->dx = (p->dx >> 2) * p->drag >> 10;
-		p->dy = (p->dy >> 2) * p->drag >> 10;
 	}
-	return ps->nparticles > 0;
 }
 
 
-void KOBO_Fire::RunParticlesNR()
+// Bring the surviving particle systems up to date after fast-forwarding
+void KOBO_Fire::FinishSkip()
 {
 	pscount = pcount = 0;
 	KOBO_ParticleSystem *ps = psystems;
 	KOBO_ParticleSystem *pps = NULL;
 	while(ps)
 	{
-		if(ps->delay)
+		int frames = skipclock - ps->skipbase;
+		ps->skipbase = 0;
+		ps->life = -1;
+		if(frames <= ps->delay)
 		{
-			--ps->delay;
+			ps->delay -= frames;
+			pps = ps;
+			ps = ps->next;
+			continue;
+		}
+		frames -= ps->delay;
+		ps->delay = 0;
+		++pscount;
+		if(IsOnScreen(ps) && fire_skip_particles(ps, frames))
+		{
+			pcount += ps->nparticles;
 			pps = ps;
 			ps = ps->next;
 		}
 		else
 		{
-			++pscount;
-			if(IsOnScreen(ps) && RunPSystemNR(ps))
-			{
-				pcount += ps->nparticles;
-				// Next...
-				pps = ps;
-				ps = ps->next;
-			}
+			KOBO_ParticleSystem *nps = ps->next;
+			if(pps)
+				pps->next = nps;
 			else
-			{
-				// Done! Remove particle system.
-				KOBO_ParticleSystem *nps = ps->next;
-				if(pps)
-					pps->next = nps;
-				else
-					psystems = nps;
-				ps->next = psystempool;
-				psystempool = ps;
-				ps = nps;
-			}
+				psystems = nps;
+			FreePSystem(ps);
+			ps = nps;
 		}
 	}
+	skipclock = 0;
+	statpscount = pscount;
+	statpcount = pcount;
 }
 
 
 KOBO_ParticleSystem *KOBO_Fire::NewPSystem(int x, int y, int vx, int vy,
-		const KOBO_ParticleFXDef *fxd, int delay)
+		const KOBO_ParticleFXStep *prog, unsigned step, int delay)
 {
+	const KOBO_ParticleFXStep *st = &prog[step];
 	KOBO_ParticleSystem *ps = NULL;
+	int nparticles = st->count;
 
-	int nparticles = fxd->init_count;
-	if(nparticles > FIRE_MAX_PARTICLES)
-	{
-		log_printf(WLOG, "KOBO_Fire::Spawn() too many particles! "
-				"(%d - max is %d)\n", nparticles,
-				FIRE_MAX_PARTICLES);
-		nparticles = FIRE_MAX_PARTICLES;
-	}
+	delay += RandRange(st->delay) >> 16;
 
-	delay += RandRange(fxd->delay) >> 16;
-
-	if(!fxd->child)
+	if(!st->child)
 	{
 		// Not nested - create actual PS, and generate particles
-		if(psystempool)
-		{
-			ps = psystempool;
-			psystempool = ps->next;
-		}
-		else
-			ps = new KOBO_ParticleSystem;
+		ps = AllocPSystem(nparticles);
+		if(!ps)
+			return NULL;
 		ps->next = psystems;
 		psystems = ps;
 
@@ -433,7 +1089,7 @@ KOBO_ParticleSystem *KOBO_Fire::NewPSystem(int x, int y, int vx, int vy,
 		ps->y = y >> 8;
 
 		if(ncolors)
-			ps->threshold = fxd->threshold / ncolors;
+			ps->threshold = st->threshold / ncolors;
 		else
 			ps->threshold = 0;
 		if(ps->threshold < threshold)
@@ -444,8 +1100,8 @@ KOBO_ParticleSystem *KOBO_Fire::NewPSystem(int x, int y, int vx, int vy,
 	// Convert position and velocity, and apply offset randomization
 	x <<= 8;
 	y <<= 8;
-	x += RandRange(fxd->xoffs);
-	y += RandRange(fxd->yoffs);
+	x += RandRange(st->xoffs);
+	y += RandRange(st->yoffs);
 	vx <<= 8;
 	vy <<= 8;
 
@@ -456,12 +1112,12 @@ KOBO_ParticleSystem *KOBO_Fire::NewPSystem(int x, int y, int vx, int vy,
 	int drag_min, drag_max;
 	int heat_min, heat_max;
 	int fade_min, fade_max;
-	RRPrepare(fxd->radius, radius_min, radius_max);
-	RRPrepare(fxd->twist, twist_min, twist_max);
-	RRPrepare(fxd->speed, speed_min, speed_max);
-	RRPrepare(fxd->drag, drag_min, drag_max);
-	RRPrepare(fxd->heat, heat_min, heat_max);
-	RRPrepare(fxd->fade, fade_min, fade_max);
+	RRPrepare(st->radius, radius_min, radius_max);
+	RRPrepare(st->twist, twist_min, twist_max);
+	RRPrepare(st->speed, speed_min, speed_max);
+	RRPrepare(st->drag, drag_min, drag_max);
+	RRPrepare(st->heat, heat_min, heat_max);
+	RRPrepare(st->fade, fade_min, fade_max);
 
 	// These are actually 20:12 internally, for headroom...
 	drag_min >>= 4;
@@ -469,30 +1125,36 @@ KOBO_ParticleSystem *KOBO_Fire::NewPSystem(int x, int y, int vx, int vy,
 	fade_min >>= 4;
 	fade_max >>= 4;
 
+	// Angles are 16 bit fractions of a full turn here
 	for(int i = 0; i < nparticles; ++i)
 	{
-		float a = Noise() * M_PI / 32768.0f;
+		int a = Noise();
 		float r = RandRange(radius_min, radius_max);
 		float v = RandRange(speed_min, speed_max);
-		int px = x + sinf(a) * r;
-		int py = y + cosf(a) * r;
-		a += RandRange(twist_min, twist_max) * M_PI / 32768.0f;
-		int pvx = sinf(a) * v + vx;
-		int pvy = cosf(a) * v + vy;
+		int px = x + fire_sin(a) * r;
+		int py = y + fire_cos(a) * r;
+		a += RandRange(twist_min, twist_max);
+		int pvx = fire_sin(a) * v + vx;
+		int pvy = fire_cos(a) * v + vy;
 		if(ps)
 		{
-			KOBO_Particle *p = &ps->particles[i];
-			p->x = px;
-			p->y = py;
-			p->dx = pvx;
-			p->dy = pvy;
-			p->drag = RandRange(drag_min, drag_max);
-			p->z = RandRange(heat_min, heat_max);
-			p->zc = RandRange(fade_min, fade_max);
+			ps->px[i] = px;
+			ps->py[i] = py;
+			ps->pdx[i] = pvx;
+			ps->pdy[i] = pvy;
+			ps->pdrag[i] = RandRange(drag_min, drag_max);
+			ps->pz[i] = RandRange(heat_min, heat_max);
+			ps->pzc[i] = RandRange(fade_min, fade_max);
 		}
 		else
-			Spawn(px >> 8, py >> 8, pvx >> 8, pvy >> 8,
-					fxd->child, delay);
+		{
+			// Spawn the child cluster
+			unsigned cs = st->child;
+			do
+				NewPSystem(px >> 8, py >> 8, pvx >> 8,
+						pvy >> 8, prog, cs, delay);
+			while(!prog[cs++].last);
+		}
 	}
 
 	// NOTE: We don't return a PS for nested effects! There is no actual
@@ -504,9 +1166,29 @@ KOBO_ParticleSystem *KOBO_Fire::NewPSystem(int x, int y, int vx, int vy,
 KOBO_ParticleSystem *KOBO_Fire::Spawn(int x, int y, int vx, int vy,
 		const KOBO_ParticleFXDef *fxd, int delay)
 {
-	KOBO_ParticleSystem *first = NewPSystem(x, y, vx, vy, fxd, delay);
-	for(fxd = fxd->next; fxd; fxd = fxd->next)
-		NewPSystem(x, y, vx, vy, fxd, delay);
+	Sync();
+
+	// Definitions that haven't been compiled are compiled on the fly
+	const KOBO_ParticleFXStep *prog = fxd->program;
+	if(!prog)
+	{
+		unsigned n = fxd->ProgramSize();
+		if(n > spawnprogsize)
+		{
+			free(spawnprog);
+			spawnprog = (KOBO_ParticleFXStep *)malloc(
+					n * sizeof(*spawnprog));
+			spawnprogsize = spawnprog ? n : 0;
+			if(!spawnprog)
+				return NULL;
+		}
+		fxd->Emit(spawnprog, 0);
+		prog = spawnprog;
+	}
+
+	KOBO_ParticleSystem *first = NewPSystem(x, y, vx, vy, prog, 0, delay);
+	for(unsigned step = 0; !prog[step].last; )
+		NewPSystem(x, y, vx, vy, prog, ++step, delay);
 	return first;
 }
 
@@ -545,11 +1227,445 @@ static inline void fire_update(Uint32 *src, Uint32 *dst,
 	}
 }
 
-void KOBO_Fire::update()
+
+// Interior pass of the fire filter, without horizontal wrapping
+static void fire_update_c(Uint32 *src, Uint32 *dst, int width, int height,
+		int xmin, int ymin, int xmax, int ymax, int fade)
 {
-	if(!bufw || !bufh)
+	fire_update(src, dst, width, height, xmin, ymin, xmax, ymax,
+			false, fade);
+}
+
+#ifdef FIRE_X86_SIMD
+// SSE2 has no 32 bit mullo, so we do even and odd lanes separately
+__attribute__((target("sse2")))
+static inline __m128i fire_mullo_sse2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32),
+			_mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(
+			_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+			_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+#endif
+
+#if defined(FIRE_X86_SIMD) && !defined(FIRE_NOFILTER)
+/*
+ * SIMD versions of the interior pass. These do exactly the same 32 bit integer
+ * math as fire_update(), so the output is identical, but process 4 (SSE2) or 8
+ * (AVX2) pixels at a time. Any remaining pixels are done by the scalar code.
+ */
+
+__attribute__((target("sse2")))
+static void fire_update_sse2(Uint32 *src, Uint32 *dst, int width, int height,
+		int xmin, int ymin, int xmax, int ymax, int fade)
+{
+	int ymask = height - 1;
+	__m128i vfade = _mm_set1_epi32(fade / 10);
+	int xend = xmin + ((xmax - xmin + 1) & ~3);
+	for(int y = ymin; y <= ymax; ++y)
+	{
+		Uint32 *srow0 = &src[width * ((y - 1) & ymask)];
+		Uint32 *srow1 = &src[width * y];
+		Uint32 *srow2 = &src[width * ((y + 1) & ymask)];
+		Uint32 *drow = &dst[width * y];
+		for(int x = xmin; x < xend; x += 4)
+		{
+#define	FIRE_LD(r, o)	_mm_loadu_si128((const __m128i *)&r[x + o])
+			__m128i s = _mm_add_epi32(FIRE_LD(srow0, 0),
+					FIRE_LD(srow2, 0));
+			s = _mm_add_epi32(s, _mm_add_epi32(FIRE_LD(srow1, -1),
+					FIRE_LD(srow1, 1)));
+			s = _mm_add_epi32(s, _mm_slli_epi32(FIRE_LD(srow1, 0),
+					3));
+			__m128i sc = _mm_add_epi32(FIRE_LD(srow0, -1),
+					FIRE_LD(srow0, 1));
+			sc = _mm_add_epi32(sc, _mm_add_epi32(FIRE_LD(srow2, -1),
+					FIRE_LD(srow2, 1)));
+#undef	FIRE_LD
+			s = _mm_add_epi32(s, _mm_srli_epi32(sc, 1));
+			s = _mm_srli_epi32(fire_mullo_sse2(s, vfade), 8);
+			_mm_storeu_si128((__m128i *)&drow[x], s);
+		}
+	}
+	if(xend <= xmax)
+		fire_update(src, dst, width, height, xend, ymin, xmax, ymax,
+				false, fade);
+}
+
+__attribute__((target("avx2")))
+static void fire_update_avx2(Uint32 *src, Uint32 *dst, int width, int height,
+		int xmin, int ymin, int xmax, int ymax, int fade)
+{
+	int ymask = height - 1;
+	__m256i vfade = _mm256_set1_epi32(fade / 10);
+	int xend = xmin + ((xmax - xmin + 1) & ~7);
+	for(int y = ymin; y <= ymax; ++y)
+	{
+		Uint32 *srow0 = &src[width * ((y - 1) & ymask)];
+		Uint32 *srow1 = &src[width * y];
+		Uint32 *srow2 = &src[width * ((y + 1) & ymask)];
+		Uint32 *drow = &dst[width * y];
+		for(int x = xmin; x < xend; x += 8)
+		{
+#define	FIRE_LD(r, o)	_mm256_loadu_si256((const __m256i *)&r[x + o])
+			__m256i s = _mm256_add_epi32(FIRE_LD(srow0, 0),
+					FIRE_LD(srow2, 0));
+			s = _mm256_add_epi32(s, _mm256_add_epi32(
+					FIRE_LD(srow1, -1), FIRE_LD(srow1, 1)));
+			s = _mm256_add_epi32(s, _mm256_slli_epi32(
+					FIRE_LD(srow1, 0), 3));
+			__m256i sc = _mm256_add_epi32(FIRE_LD(srow0, -1),
+					FIRE_LD(srow0, 1));
+			sc = _mm256_add_epi32(sc, _mm256_add_epi32(
+					FIRE_LD(srow2, -1), FIRE_LD(srow2, 1)));
+#undef	FIRE_LD
+			s = _mm256_add_epi32(s, _mm256_srli_epi32(sc, 1));
+			s = _mm256_srli_epi32(_mm256_mullo_epi32(s, vfade), 8);
+			_mm256_storeu_si256((__m256i *)&drow[x], s);
+		}
+	}
+	if(xend <= xmax)
+		fire_update(src, dst, width, height, xend, ymin, xmax, ymax,
+				false, fade);
+}
+#endif
+
+
+/*
+ * Palette lookup and dithering
+ *
+ * All dither modes boil down to ((heat * ncolors) >> 12), plus some dither
+ * offset, shifted down and clamped to the palette size. As that never gets
+ * past the clamping limit for values above ncolors << 4, everything after the
+ * multiplication is done via a table per dither phase (see UpdateLUT()), and
+ * the kernels below just select the phase for each pixel.
+ *
+ * 'lut' is the start of the LUT, and 'p0' and 'p1' are the offsets of the
+ * tables to use for even and odd pixels, respectively.
+ *
+ * NOTE: Noise dithering used to draw from Noise() in pixel order, which cannot
+ *       be split into bands. The noise is now seeded per row and span (see
+ *       render_tiles()), so the pattern differs from older versions, though
+ *       it has the same distribution.
+ */
+
+static void fire_lut_c(Uint32 *dst, const Uint32 *src, int n, unsigned nc,
+		const Uint32 *lut, int p0, int p1)
+{
+	unsigned qmax = nc << 4;
+	const Uint32 *l[2] = { lut + p0, lut + p1 };
+	for(int x = 0; x < n; ++x)
+	{
+		unsigned q = src[x] * nc >> 12;
+		if(q > qmax)
+			q = qmax;
+		dst[x] = l[x & 1][q];
+	}
+}
+
+// Noise dithering; the phase of each pixel is two bits from an LCG, seeded
+// with 'ns'. Returns the new LCG state.
+static unsigned fire_lut_noise_c(Uint32 *dst, const Uint32 *src, int n,
+		unsigned nc, const Uint32 *lut, unsigned ns)
+{
+	unsigned qmax = nc << 4;
+	for(int x = 0; x < n; ++x)
+	{
+		unsigned q = src[x] * nc >> 12;
+		if(q > qmax)
+			q = qmax;
+		ns *= 1566083941UL;
+		ns++;
+		dst[x] = lut[((ns * (ns >> 16) >> 16) & 3) * FIRE_LUT_SIZE + q];
+	}
+	return ns;
+}
+
+#ifdef FIRE_X86_SIMD
+// SSE2 has no gather, so only the index calculations are done 4 at a time.
+// (q is at most 20 bits, so signed compares will do for the clamping.)
+__attribute__((target("sse2")))
+static inline __m128i fire_lut_q_sse2(const Uint32 *src, __m128i vnc,
+		__m128i vqmax)
+{
+	__m128i q = _mm_loadu_si128((const __m128i *)src);
+	q = _mm_srli_epi32(fire_mullo_sse2(q, vnc), 12);
+	__m128i over = _mm_cmpgt_epi32(q, vqmax);
+	return _mm_or_si128(_mm_andnot_si128(over, q),
+			_mm_and_si128(over, vqmax));
+}
+
+__attribute__((target("sse2")))
+static inline void fire_lut_store_sse2(Uint32 *dst, const Uint32 *lut,
+		__m128i q)
+{
+	Uint32 i[4] __attribute__((aligned(16)));
+	_mm_store_si128((__m128i *)i, q);
+	dst[0] = lut[i[0]];
+	dst[1] = lut[i[1]];
+	dst[2] = lut[i[2]];
+	dst[3] = lut[i[3]];
+}
+
+__attribute__((target("sse2")))
+static void fire_lut_sse2(Uint32 *dst, const Uint32 *src, int n, unsigned nc,
+		const Uint32 *lut, int p0, int p1)
+{
+	__m128i vnc = _mm_set1_epi32(nc);
+	__m128i vqmax = _mm_set1_epi32(nc << 4);
+	__m128i vp = _mm_setr_epi32(p0, p1, p0, p1);
+	int x = 0;
+	for( ; x + 4 <= n; x += 4)
+	{
+		__m128i q = fire_lut_q_sse2(&src[x], vnc, vqmax);
+		fire_lut_store_sse2(&dst[x], lut, _mm_add_epi32(q, vp));
+	}
+	if(x < n)
+		fire_lut_c(dst + x, src + x, n - x, nc, lut, p0, p1);
+}
+
+// The LCG is run as 4 interleaved sequences, stepping 4 states at a time
+__attribute__((target("sse2")))
+static unsigned fire_lut_noise_sse2(Uint32 *dst, const Uint32 *src, int n,
+		unsigned nc, const Uint32 *lut, unsigned ns)
+{
+	if(n < 4)
+		return fire_lut_noise_c(dst, src, n, nc, lut, ns);
+
+	unsigned a4 = 1;
+	unsigned c4 = 0;
+	Uint32 s[4] __attribute__((aligned(16)));
+	for(int i = 0; i < 4; ++i)
+	{
+		a4 *= 1566083941UL;
+		c4 = c4 * 1566083941UL + 1;
+		ns *= 1566083941UL;
+		ns++;
+		s[i] = ns;
+	}
+	__m128i vns = _mm_load_si128((const __m128i *)s);
+	__m128i va4 = _mm_set1_epi32(a4);
+	__m128i vc4 = _mm_set1_epi32(c4);
+	__m128i vnc = _mm_set1_epi32(nc);
+	__m128i vqmax = _mm_set1_epi32(nc << 4);
+	__m128i vphase = _mm_set1_epi32(3);
+	__m128i vsize = _mm_set1_epi32(FIRE_LUT_SIZE);
+	int x = 0;
+	while(1)
+	{
+		__m128i q = fire_lut_q_sse2(&src[x], vnc, vqmax);
+		__m128i p = fire_mullo_sse2(vns, _mm_srli_epi32(vns, 16));
+		p = _mm_and_si128(_mm_srli_epi32(p, 16), vphase);
+		q = _mm_add_epi32(q, fire_mullo_sse2(p, vsize));
+		fire_lut_store_sse2(&dst[x], lut, q);
+		x += 4;
+		if(x + 4 > n)
+			break;
+		vns = _mm_add_epi32(fire_mullo_sse2(vns, va4), vc4);
+	}
+	_mm_store_si128((__m128i *)s, vns);
+	ns = s[3];
+	if(x < n)
+		ns = fire_lut_noise_c(dst + x, src + x, n - x, nc, lut, ns);
+	return ns;
+}
+
+__attribute__((target("avx2")))
+static void fire_lut_avx2(Uint32 *dst, const Uint32 *src, int n, unsigned nc,
+		const Uint32 *lut, int p0, int p1)
+{
+	__m256i vnc = _mm256_set1_epi32(nc);
+	__m256i vqmax = _mm256_set1_epi32(nc << 4);
+	__m256i vp = _mm256_setr_epi32(p0, p1, p0, p1, p0, p1, p0, p1);
+	int x = 0;
+	for( ; x + 8 <= n; x += 8)
+	{
+		__m256i q = _mm256_loadu_si256((const __m256i *)&src[x]);
+		q = _mm256_srli_epi32(_mm256_mullo_epi32(q, vnc), 12);
+		q = _mm256_min_epu32(q, vqmax);
+		q = _mm256_add_epi32(q, vp);
+		_mm256_storeu_si256((__m256i *)&dst[x],
+				_mm256_i32gather_epi32((const int *)lut, q, 4));
+	}
+	if(x < n)
+		fire_lut_c(dst + x, src + x, n - x, nc, lut, p0, p1);
+}
+
+// The LCG is run as 8 interleaved sequences, stepping 8 states at a time
+__attribute__((target("avx2")))
+static unsigned fire_lut_noise_avx2(Uint32 *dst, const Uint32 *src, int n,
+		unsigned nc, const Uint32 *lut, unsigned ns)
+{
+	if(n < 8)
+		return fire_lut_noise_c(dst, src, n, nc, lut, ns);
+
+	unsigned a8 = 1;
+	unsigned c8 = 0;
+	unsigned s[8];
+	for(int i = 0; i < 8; ++i)
+	{
+		a8 *= 1566083941UL;
+		c8 = c8 * 1566083941UL + 1;
+		ns *= 1566083941UL;
+		ns++;
+		s[i] = ns;
+	}
+	__m256i vns = _mm256_loadu_si256((const __m256i *)s);
+	__m256i va8 = _mm256_set1_epi32(a8);
+	__m256i vc8 = _mm256_set1_epi32(c8);
+	__m256i vnc = _mm256_set1_epi32(nc);
+	__m256i vqmax = _mm256_set1_epi32(nc << 4);
+	__m256i vphase = _mm256_set1_epi32(3);
+	__m256i vsize = _mm256_set1_epi32(FIRE_LUT_SIZE);
+	int x = 0;
+	while(1)
+	{
+		__m256i q = _mm256_loadu_si256((const __m256i *)&src[x]);
+		q = _mm256_srli_epi32(_mm256_mullo_epi32(q, vnc), 12);
+		q = _mm256_min_epu32(q, vqmax);
+		__m256i p = _mm256_mullo_epi32(vns,
+				_mm256_srli_epi32(vns, 16));
+		p = _mm256_and_si256(_mm256_srli_epi32(p, 16), vphase);
+		q = _mm256_add_epi32(q, _mm256_mullo_epi32(p, vsize));
+		_mm256_storeu_si256((__m256i *)&dst[x],
+				_mm256_i32gather_epi32((const int *)lut, q, 4));
+		x += 8;
+		if(x + 8 > n)
+			break;
+		vns = _mm256_add_epi32(_mm256_mullo_epi32(vns, va8), vc8);
+	}
+	_mm256_storeu_si256((__m256i *)s, vns);
+	ns = s[7];
+	if(x < n)
+		ns = fire_lut_noise_c(dst + x, src + x, n - x, nc, lut, ns);
+	return ns;
+}
+#endif
+
+static void (*fire_update_interior)(Uint32 *src, Uint32 *dst,
+		int width, int height, int xmin, int ymin, int xmax, int ymax,
+		int fade) = NULL;
+static void (*fire_lut)(Uint32 *dst, const Uint32 *src, int n, unsigned nc,
+		const Uint32 *lut, int p0, int p1) = NULL;
+static unsigned (*fire_lut_noise)(Uint32 *dst, const Uint32 *src, int n,
+		unsigned nc, const Uint32 *lut, unsigned ns) = NULL;
+
+// Pick the fastest filter and palette kernels the CPU supports
+static void fire_select_kernels()
+{
+	if(fire_update_interior)
 		return;
+	for(int i = 0; i < FIRE_SIN_SIZE; ++i)
+		fire_sintab[i] = sinf(i * 2.0f * M_PI / FIRE_SIN_SIZE);
+
+	const char *name = "scalar";
+	fire_update_interior = fire_update_c;
+	fire_lut = fire_lut_c;
+	fire_lut_noise = fire_lut_noise_c;
+#ifdef FIRE_X86_SIMD
+	if(SDL_HasAVX2())
+	{
+		name = "AVX2";
+#  ifndef FIRE_NOFILTER
+		fire_update_interior = fire_update_avx2;
+#  endif
+		fire_lut = fire_lut_avx2;
+		fire_lut_noise = fire_lut_noise_avx2;
+	}
+	else if(SDL_HasSSE2())
+	{
+		name = "SSE2";
+#  ifndef FIRE_NOFILTER
+		fire_update_interior = fire_update_sse2;
+#  endif
+		fire_lut = fire_lut_sse2;
+		fire_lut_noise = fire_lut_noise_sse2;
+	}
+#endif
+	log_printf(VLOG, "KOBO_Fire: Using %s kernels.\n", name);
+}
 
+// Filter the tiles in tile rows [tymin, tymax] that have hot neighbors, and
+// clear any tiles that no longer do, if they were hot the last time around.
+void KOBO_Fire::filter_tiles(int tymin, int tymax)
+{
+	Uint32 *src = buffers[current_buffer];
+	Uint32 *dst = buffers[!current_buffer];
+	Uint8 *hot = tilehot[!current_buffer];
+	for(int ty = tymin; ty <= tymax; ++ty)
+	{
+		int ymin = ty * FIRE_TILE_SIZE;
+		int ymax = ymin + FIRE_TILE_SIZE - 1;
+		int t0 = ty * tilesw;
+		for(int tx = 0; tx < (int)tilesw; )
+		{
+			if(!tileneed[t0 + tx])
+			{
+				// Tile went cold; clear it, if needed
+				if(hot[t0 + tx])
+				{
+					Uint32 *d = &dst[bufw * ymin +
+							tx * FIRE_TILE_SIZE];
+					for(int y = ymin; y <= ymax; ++y)
+						memset(d + bufw * (y - ymin), 0,
+								FIRE_TILE_SIZE *
+								sizeof(Uint32));
+					hot[t0 + tx] = 0;
+					tiledirty[t0 + tx] = 1;
+				}
+				++tx;
+				continue;
+			}
+
+			// Filter a run of tiles in one go
+			int txend = tx;
+			while((txend < (int)tilesw) && tileneed[t0 + txend])
+				++txend;
+			int xmin = tx * FIRE_TILE_SIZE;
+			int xmax = txend * FIRE_TILE_SIZE - 1;
+			fire_update_interior(src, dst, bufw, bufh,
+					xmin ? xmin : 1, ymin,
+					MIN(xmax, (int)bufw - 2),
+					ymax, fade);
+			if(!xmin)
+				fire_update(src, dst, bufw, bufh,
+						0, ymin, 0, ymax,
+						true, fade);
+			if(xmax == (int)bufw - 1)
+				fire_update(src, dst, bufw, bufh,
+						xmax, ymin, xmax, ymax,
+						true, fade);
+
+			// Check which tiles are still hot
+			for( ; tx < txend; ++tx)
+			{
+				int h = 0;
+				for(int y = ymin; !h && (y <= ymax); ++y)
+				{
+					Uint32 *d = &dst[bufw * y +
+							tx * FIRE_TILE_SIZE];
+					for(int x = 0; x < FIRE_TILE_SIZE; ++x)
+						h |= d[x];
+				}
+				hot[t0 + tx] = h != 0;
+				tiledirty[t0 + tx] = 1;
+			}
+		}
+	}
+}
+
+
+void KOBO_Fire::filter_band(void *fire, int tymin, int tymax)
+{
+	((KOBO_Fire *)fire)->filter_tiles(tymin, tymax);
+}
+
+
+// Run particles and filter
+void KOBO_Fire::Simulate()
+{
 	if(prefs->firebench)
 		particle_prof.SampleBegin();
 
@@ -574,26 +1690,37 @@ void KOBO_Fire::update()
 	if(prefs->firebench)
 		filter_prof.SampleBegin();
 
+#ifdef	FIRE_SHOW_EDGE
 	Uint32 *src = buffers[current_buffer];
 	Uint32 *dst = buffers[!current_buffer];
-
-#ifdef	FIRE_SHOW_EDGE
 	for(unsigned x = 0; x < bufw; ++x)
 		src[x] = src[(bufh - 1) * bufw + x] = 0;
 	for(unsigned y = 1; y < bufh - 1; ++y)
 		src[y * bufw] = src[y * bufw + bufw - 1] = 0;
 #endif
 
+	// Find the tiles that have any hot tiles around them. (Wrapping!)
+	Uint8 *hot = tilehot[current_buffer];
+	memset(tileneed, 0, tilesw * tilesh);
+	for(unsigned ty = 0; ty < tilesh; ++ty)
+		for(unsigned tx = 0; tx < tilesw; ++tx)
+		{
+			if(!hot[ty * tilesw + tx])
+				continue;
+			for(int y = -1; y <= 1; ++y)
+			{
+				unsigned ny = (ty + y + tilesh) % tilesh;
+				for(int x = -1; x <= 1; ++x)
+				{
+					unsigned nx = (tx + x + tilesw) %
+							tilesw;
+					tileneed[ny * tilesw + nx] = 1;
+				}
+			}
+		}
+
 	// Update the "fire filter" (overwrite previous buffer)
-	fire_update(src, dst, bufw, bufh,
-			1, 0,		bufw - 2, bufh - 1,
-			false, fade);
-	fire_update(src, dst, bufw, bufh,
-			0, 0,		0, bufh - 1,
-			true, fade);
-	fire_update(src, dst, bufw, bufh,
-			bufw - 1, 0,	bufw - 1, bufh - 1,
-			true, fade);
+	KOBO_FirePool::run(filter_band, this, tilesh);
 
 #ifdef	FIRE_SHOW_EDGE
 	for(unsigned x = 0; x < bufw; ++x)
@@ -606,6 +1733,8 @@ void KOBO_Fire::update()
 		dst[y * bufw] = Noise() >> 1;
 		dst[y * bufw + bufw - 1] = Noise() >> 2;
 	}
+	memset(tilehot[!current_buffer], 1, tilesw * tilesh);
+	memset(tiledirty, 1, tilesw * tilesh);
 #endif
 
 	// Swap buffers
@@ -618,97 +1747,381 @@ void KOBO_Fire::update()
 }
 
 
-void KOBO_Fire::update_norender()
+void KOBO_Fire::update()
 {
 	if(!bufw || !bufh)
 		return;
 
-	// Run particle systems
-	RunParticlesNR();
+	KOBO_FirePool::configure(prefs->firethreads);
+
+	if(skipclock)
+		FinishSkip();
+
+	if(prefs->fireasync && StartAsync())
+	{
+		// Start the next job
+		Sync();
+		cxmin = nextcxmin;
+		cymin = nextcymin;
+		asyncbusy = true;
+		SDL_SemPost(asyncgo);
+		return;
+	}
+
+	StopAsync();
+	cxmin = nextcxmin;
+	cymin = nextcymin;
+	Simulate();
+	statpscount = pscount;
+	statpcount = pcount;
 }
 
 
-void KOBO_Fire::refresh(SDL_Rect *r)
+void KOBO_Fire::update_norender()
 {
-	if(!need_refresh || !bufw || !bufh || !ncolors)
+	if(!bufw || !bufh)
 		return;
 
-	// Source
-	Uint32 *srcbuf = buffers[current_buffer];
+	Sync();
+	cxmin = nextcxmin;
+	cymin = nextcymin;
+	++skipclock;
+	SkipParticles();
+}
 
-	// Destination
-	Uint32 *dstbuf;
-	int pitch = lock(r, &dstbuf);
-	if(!pitch)
+
+bool KOBO_Fire::StartAsync()
+{
+	if(asyncactive)
+		return true;
+	if(asyncfailed)
+		return false;
+
+	if(!asyncthread)
 	{
-		log_printf(ELOG, "KOBO_Fire::refresh() failed to lock "
-				"buffer!\n");
+		asyncgo = SDL_CreateSemaphore(0);
+		asyncdone = SDL_CreateSemaphore(0);
+		if(asyncgo && asyncdone)
+			asyncthread = SDL_CreateThread(async_thread,
+					"FireAsync", this);
+		if(!asyncthread)
+		{
+			log_printf(WLOG, "KOBO_Fire: Could not start async "
+					"thread: %s\n", SDL_GetError());
+			asyncfailed = true;
+			return false;
+		}
+	}
+
+	unsigned size = bufw * bufh * sizeof(Uint32);
+	for(int i = 0; i < 2; ++i)
+		if(!pixbufs[i] && !(pixbufs[i] = (Uint32 *)malloc(size)))
+		{
+			log_printf(WLOG, "KOBO_Fire: Could not allocate "
+					"async buffers!\n");
+			asyncfailed = true;
+			return false;
+		}
+
+	// Both buffers need to be rendered from scratch
+	pixfull = 2;
+	memset(texdirty, 1, tilesw * tilesh);
+	need_refresh = true;
+	asyncactive = true;
+	return true;
+}
+
+
+void KOBO_Fire::StopAsync()
+{
+	if(!asyncactive)
 		return;
+	Sync();
+	asyncactive = false;
+
+	// The jobs have been eating the dirty flags, so refresh everything
+	memset(tiledirty, 1, tilesw * tilesh);
+	need_refresh = true;
+}
+
+
+void KOBO_Fire::WaitAsync()
+{
+	SDL_SemWait(asyncdone);
+	asyncbusy = false;
+	statpscount = pscount;
+	statpcount = pcount;
+	if(!asyncrendered)
+		return;
+
+	// Show the new buffer, and upload whatever changed
+	pixshown = !pixshown;
+	unsigned nt = tilesw * tilesh;
+	for(unsigned i = 0; i < nt; ++i)
+		texdirty[i] |= tileprev[i];
+}
+
+
+int KOBO_Fire::async_thread(void *fire)
+{
+	KOBO_Fire *f = (KOBO_Fire *)fire;
+	while(1)
+	{
+		SDL_SemWait(f->asyncgo);
+		if(f->asyncquit)
+			return 0;
+		f->Simulate();
+		f->asyncrendered = f->need_refresh;
+		if(f->need_refresh)
+			f->RenderAsync();
+		SDL_SemPost(f->asyncdone);
 	}
+}
 
+
+// Render to the pixel buffer that is not being shown. That buffer was last
+// rendered two jobs ago, so tiles that changed in the previous job need to be
+// rendered as well.
+void KOBO_Fire::RenderAsync()
+{
 	if(prefs->firebench)
 		render_prof.SampleBegin();
 
-	// Render!
-	for(unsigned y = 0; y < bufh; ++y)
+	bool full = pixfull > 0;
+	if(full)
+		--pixfull;
+	unsigned nt = tilesw * tilesh;
+	for(unsigned i = 0; i < nt; ++i)
 	{
-		Uint32 *src = &srcbuf[bufw * y];
-		Uint32 *dst = &dstbuf[pitch * y];
-		int sx = 0;
-		switch(dither)
-		{
-		  default:
-		  case GFX_DITHER_NONE:
-			for(unsigned x = 0; x < bufw; ++x)
+		Uint8 d = tiledirty[i] | full;
+		tiledirty[i] = d | tileprev[i];
+		tileprev[i] = d;
+	}
+
+	refresh_dst = pixbufs[!pixshown];
+	refresh_pitch = bufw;
+	refresh_rect.x = refresh_rect.y = 0;
+	refresh_rect.w = bufw;
+	refresh_rect.h = bufh;
+	refresh_fill = false;
+	UpdateLUT();
+	ditherseed *= 1566083941UL;
+	ditherseed++;
+	KOBO_FirePool::run(render_band, this, tilesh);
+	refresh_dst = NULL;
+	refresh_fill = true;
+	need_refresh = false;
+
+	if(prefs->firebench)
+		render_prof.SampleEnd();
+}
+
+
+// Upload the changed parts of the last completed job to the texture
+void KOBO_Fire::RefreshAsync()
+{
+	int tx0 = tilesw, ty0 = tilesh, tx1 = -1, ty1 = -1;
+	for(int ty = 0; ty < (int)tilesh; ++ty)
+		for(int tx = 0; tx < (int)tilesw; ++tx)
+			if(texdirty[ty * tilesw + tx])
 			{
-				unsigned n = src[x] * ncolors >> 16;
-				if(n >= ncolors)
-					n = ncolors - 1;
-				dst[x] = colors[n];
+				tx0 = MIN(tx0, tx);
+				ty0 = MIN(ty0, ty);
+				tx1 = MAX(tx1, tx);
+				ty1 = MAX(ty1, ty);
 			}
-			break;
-		  case GFX_DITHER_2X2:
-			for(unsigned x = 0; x < bufw; ++x)
+	if(tx1 < 0)
+		return;
+
+	SDL_Rect r;
+	r.x = tx0 * FIRE_TILE_SIZE;
+	r.y = ty0 * FIRE_TILE_SIZE;
+	r.w = (tx1 - tx0 + 1) * FIRE_TILE_SIZE;
+	r.h = (ty1 - ty0 + 1) * FIRE_TILE_SIZE;
+	stream_window_t::update(&r, pixbufs[pixshown] + r.y * bufw + r.x,
+			bufw);
+	memset(texdirty, 0, tilesw * tilesh);
+}
+
+
+// Render pixels [x0, x1] of row 'y' to 'dst', which points at pixel x0
+void KOBO_Fire::render_span(Uint32 *dst, int x0, int x1, int y, unsigned ns)
+{
+	Uint32 *src = &buffers[current_buffer][bufw * y + x0];
+	int n = x1 - x0 + 1;
+	int sx = x0;
+	int pe, po;	// Dither phase of even and odd pixels
+	switch(dither)
+	{
+	  default:
+	  case GFX_DITHER_NONE:
+		pe = po = 0;
+		break;
+	  case GFX_DITHER_2X2:
+		pe = (sx ^ y) & 1;
+		po = pe ^ 1;
+		break;
+	  case GFX_DITHER_SKEWED:
+		sx += (y & 2) >> 1;
+		// Fall-through!
+	  case GFX_DITHER_ORDERED:
+		pe = (((sx ^ y) & 1) << 1) + (y & 1);
+		po = pe ^ 2;
+		break;
+	  case GFX_DITHER_NOISE:
+		fire_lut_noise(dst, src, n, ncolors, lut, ns);
+		return;
+	}
+	fire_lut(dst, src, n, ncolors, lut,
+			pe * FIRE_LUT_SIZE, po * FIRE_LUT_SIZE);
+}
+
+
+// Rebuild the palette/dither LUT, if needed. Entry q of the table for phase p
+// maps ((heat * ncolors) >> 12) == q to the color that refresh() used to
+// calculate for that dither phase.
+void KOBO_Fire::UpdateLUT()
+{
+	if((lutdither == (int)dither) && (lutcolors == ncolors))
+		return;
+	lutdither = dither;
+	lutcolors = ncolors;
+	unsigned qmax = ncolors << 4;
+	for(int p = 0; p < 4; ++p)
+		for(unsigned q = 0; q <= qmax; ++q)
+		{
+			unsigned n;
+			switch(dither)
 			{
-				unsigned n = src[x] * ncolors;
-				n >>= 12;
-				n += (((x + sx) ^ y) & 1) << 3;
-				n >>= 4;
-				if(n >= ncolors)
-					n = ncolors - 1;
-				dst[x] = colors[n];
+			  default:
+			  case GFX_DITHER_NONE:
+				n = q >> 4;
+				break;
+			  case GFX_DITHER_2X2:
+				n = (q + ((p & 1) << 3)) >> 4;
+				break;
+			  case GFX_DITHER_SKEWED:
+			  case GFX_DITHER_ORDERED:
+				n = (q + (p << 2)) >> 4;
+				break;
+			  case GFX_DITHER_NOISE:
+				n = ((q >> 2) + p) >> 2;
+				break;
 			}
-			break;
-		  case GFX_DITHER_SKEWED:
-			sx = (y & 2) >> 1;
-			// Fall-through!
-		  case GFX_DITHER_ORDERED:
-			for(unsigned x = 0; x < bufw; ++x)
+			if(n >= ncolors)
+				n = ncolors - 1;
+			lut[p * FIRE_LUT_SIZE + q] = colors[n];
+		}
+}
+
+
+// Render the dirty tiles in tile rows [tymin, tymax] of the locked area. Clean
+// tiles in there are cold, and just need to be filled with color 0, as locked
+// texture memory is write-only. (Tile rows are relative to the locked area.)
+void KOBO_Fire::render_tiles(int tymin, int tymax)
+{
+	int lx0 = refresh_rect.x / FIRE_TILE_SIZE;
+	int lx1 = (refresh_rect.x + refresh_rect.w) / FIRE_TILE_SIZE;
+	int ly0 = refresh_rect.y / FIRE_TILE_SIZE;
+	for(int ty = ly0 + tymin; ty <= ly0 + tymax; ++ty)
+	{
+		int t0 = ty * tilesw;
+		for(int tx = lx0; tx < lx1; )
+		{
+			int txend = tx + 1;
+			bool dirty = tiledirty[t0 + tx];
+			while((txend < lx1) && (tiledirty[t0 + txend] == dirty))
+				++txend;
+			int x0 = tx * FIRE_TILE_SIZE;
+			int x1 = txend * FIRE_TILE_SIZE - 1;
+			int y1 = (dirty || refresh_fill) ?
+					(ty + 1) * FIRE_TILE_SIZE : 0;
+			for(int y = ty * FIRE_TILE_SIZE; y < y1; ++y)
 			{
-				unsigned n = src[x] * ncolors;
-				n >>= 12;
-				n += (((((x + sx) ^ y) & 1) << 1) + (y & 1))
-						<< 2;
-				n >>= 4;
-				if(n >= ncolors)
-					n = ncolors - 1;
-				dst[x] = colors[n];
+				Uint32 *dst = &refresh_dst[refresh_pitch *
+						(y - refresh_rect.y) +
+						x0 - refresh_rect.x];
+				if(dirty)
+				{
+					// Noise sequence per row and span, so
+					// that the result does not depend on
+					// how rows are split into bands
+					unsigned ns = ditherseed ^
+							((y * tilesw + tx) *
+							2654435761UL);
+					render_span(dst, x0, x1, y, ns);
+				}
+				else
+					for(int x = x0; x <= x1; ++x)
+						dst[x - x0] = colors[0];
 			}
-			break;
-		  case GFX_DITHER_NOISE:
-			for(unsigned x = 0; x < bufw; ++x)
+			for( ; tx < txend; ++tx)
+				tiledirty[t0 + tx] = 0;
+		}
+	}
+}
+
+
+void KOBO_Fire::render_band(void *fire, int tymin, int tymax)
+{
+	((KOBO_Fire *)fire)->render_tiles(tymin, tymax);
+}
+
+
+void KOBO_Fire::refresh(SDL_Rect *r)
+{
+	if(asyncactive)
+	{
+		RefreshAsync();
+		return;
+	}
+
+	if(!need_refresh || !bufw || !bufh || !ncolors)
+		return;
+
+	// Find the area covered by dirty tiles. (The whole buffer is always
+	// refreshed, so 'r' is ignored.)
+	int tx0 = tilesw, ty0 = tilesh, tx1 = -1, ty1 = -1;
+	for(int ty = 0; ty < (int)tilesh; ++ty)
+		for(int tx = 0; tx < (int)tilesw; ++tx)
+			if(tiledirty[ty * tilesw + tx])
 			{
-				unsigned n = src[x] * ncolors;
-				n >>= 14;
-				n += Noise() & 3;
-				n >>= 2;
-				if(n >= ncolors)
-					n = ncolors - 1;
-				dst[x] = colors[n];
+				tx0 = MIN(tx0, tx);
+				ty0 = MIN(ty0, ty);
+				tx1 = MAX(tx1, tx);
+				ty1 = MAX(ty1, ty);
 			}
-			break;
-		}
+	if(tx1 < 0)
+	{
+		need_refresh = false;
+		return;
 	}
+	refresh_rect.x = tx0 * FIRE_TILE_SIZE;
+	refresh_rect.y = ty0 * FIRE_TILE_SIZE;
+	refresh_rect.w = (tx1 - tx0 + 1) * FIRE_TILE_SIZE;
+	refresh_rect.h = (ty1 - ty0 + 1) * FIRE_TILE_SIZE;
+
+	// Destination
+	Uint32 *dstbuf;
+	int pitch = lock(&refresh_rect, &dstbuf);
+	if(!pitch)
+	{
+		log_printf(ELOG, "KOBO_Fire::refresh() failed to lock "
+				"buffer!\n");
+		return;
+	}
+
+	if(prefs->firebench)
+		render_prof.SampleBegin();
+
+	// Render!
+	refresh_dst = dstbuf;
+	refresh_pitch = pitch;
+	UpdateLUT();
+	ditherseed *= 1566083941UL;
+	ditherseed++;
+	KOBO_FirePool::run(render_band, this, ty1 - ty0 + 1);
+	refresh_dst = NULL;
 
 	if(prefs->firebench)
 		render_prof.SampleEnd();
@@ -56,13 +56,25 @@
 // Maximum number of particles in one particle system
 #define	FIRE_MAX_PARTICLES	1024
 
-// World size granularity
-// (TODO: Tile subdivision for rendering optimizations)
+// Particle system size classes: FIRE_MIN_PARTICLES << n, n < FIRE_PS_CLASSES
+#define	FIRE_MIN_PARTICLES	16
+#define	FIRE_PS_CLASSES		7
+
+// Size of the blocks particle systems are allocated from (bytes)
+#define	FIRE_ARENA_BLOCK	(256 * 1024)
+
+// World size granularity, and size of the tiles used for tracking activity
 #define	FIRE_TILE_SIZE		32
 
+// Maximum number of threads used for filtering and rendering
+#define	FIRE_MAX_THREADS	16
+
 // Maximum colors supported, including transparency
 #define	FIRE_MAX_COLORS		32
 
+// Entries per dither phase in the palette/dither LUT
+#define	FIRE_LUT_SIZE		(FIRE_MAX_COLORS * 16 + 1)
+
 // Minimum heat threshold for particles. (16:16)
 //	1.0 (65536) would kill particles as soon as they translate to color
 //	entry 0. However, since particle rendering is additive, particles below
@@ -115,11 +127,30 @@ struct KOBO_RandSpec
 	}
 };
 
+// Compiled particle system definition
+//	A definition, along with the rest of its cluster and any children, is
+//	flattened into an array of steps, where each cluster occupies a range of
+//	consecutive steps.
+struct KOBO_ParticleFXStep
+{
+	unsigned	child;		// First step of child cluster, or 0
+	bool		last;		// Last step of cluster
+	int		count;		// Number of initial particles
+	int		threshold;
+	KOBO_RangeSpec	delay, xoffs, yoffs;
+	KOBO_RandSpec	radius, twist, speed, drag, heat, fade;
+};
+
 class KOBO_ParticleFXDef
 {
 	friend class KOBO_Fire;
 	KOBO_ParticleFXDef	*next;	// Next in cluster
 	KOBO_ParticleFXDef	*child;	// Child "particle" definition
+	KOBO_ParticleFXStep	*program;	// Compiled cluster, or NULL
+	unsigned		programsize;	// Steps in 'program'
+	void Decompile();
+	unsigned ProgramSize() const;
+	unsigned Emit(KOBO_ParticleFXStep *prog, unsigned pos) const;
   public:
 
 	// General parameters
@@ -153,27 +184,35 @@ class KOBO_ParticleFXDef
 
 	// Get/create definition to spawn instead of plain particles
 	KOBO_ParticleFXDef *Child();
-};
 
-// Single particle
-struct KOBO_Particle
-{
-	int	x, y, z;	// Position and heat (16:16)
-	int	dx, dy;		// Velocity (16:16)
-	int	zc;		// Cool-down ratio (20:12)
-	int	drag;		// Drag coefficient (20:12)
+	// Compile the cluster for KOBO_Fire::Spawn(). This must be redone after
+	// any changes, as Spawn() will otherwise keep using the old program!
+	// Definitions that are not compiled are compiled on every Spawn().
+	bool Compile();
 };
 
 // Particle system
+//	Particles are stored as one array per field, so that the compiler can
+//	vectorize the updates. The arrays are allocated right after the
+//	struct, sized by the size class of the system.
 struct KOBO_ParticleSystem
 {
 	KOBO_ParticleSystem	*next;
+	int			sizeclass;
 	int			delay;
 	int			x, y;
 	// TODO: <parameters for issuing new particles>
 	int			threshold;
 	int			nparticles;
-	KOBO_Particle		particles[FIRE_MAX_PARTICLES];
+	int			skipbase;	// 'skipclock' at creation
+	int			life;		// Lifetime estimate, or -1
+
+	// Particles
+	int	*px, *py;	// Position (16:16)
+	int	*pz;		// Heat (16:16)
+	int	*pdx, *pdy;	// Velocity (16:16)
+	int	*pzc;		// Cool-down ratio (20:12)
+	int	*pdrag;		// Drag coefficient (20:12)
 };
 
 // Particle systems + "fire effect" engine
@@ -188,15 +227,62 @@ class KOBO_Fire : public stream_window_t
 
 	// Current culling window, top/left corner
 	int		cxmin, cymin;
+	int		nextcxmin, nextcymin;	// Applied by update()
 
 	// Work buffer (16:16 fixed point "heat" values)
 	unsigned	bufw, bufh, current_buffer;
+	int		scaleshift;	// log2(world pixels per buffer pixel)
 	Uint32		*buffers[2];
 	bool		need_refresh;	// Buffer needs refresh to texture
 	int		standby_timer;	// Delay before entering standby!
 
+	// Activity tracking (FIRE_TILE_SIZE tiles)
+	unsigned	tilesw, tilesh;
+	Uint8		*tilestate;	// (Allocation for the arrays below)
+	Uint8		*tilehot[2];	// Tile has nonzero heat, per buffer
+	Uint8		*tileneed;	// Tile needs filtering this frame
+	Uint8		*tiledirty;	// Tile needs refresh to texture
+	Uint8		*tileprev;	// Tile changed by the last async update
+	Uint8		*texdirty;	// Tile needs upload to texture (async)
+
+	// Band jobs for the worker threads
+	Uint32		*refresh_dst;	// Locked texture, during refresh()
+	int		refresh_pitch;
+	SDL_Rect	refresh_rect;	// Locked area, during refresh()
+	bool		refresh_fill;	// Fill clean tiles with color 0
+	unsigned	ditherseed;	// GFX_DITHER_NOISE state
+	void filter_tiles(int tymin, int tymax);
+	void render_span(Uint32 *dst, int x0, int x1, int y, unsigned ns);
+	void render_tiles(int tymin, int tymax);
+	static void filter_band(void *fire, int tymin, int tymax);
+	static void render_band(void *fire, int tymin, int tymax);
+
 	void UpdateViewSize();
 
+	// Asynchronous updates. (prefs->fireasync)
+	//	update() starts a job on the async thread that runs the particles
+	//	and the filter, and then renders the result into one of two pixel
+	//	buffers, while the main thread uploads the other one to the
+	//	texture. Anything that touches the state used by the job has to
+	//	call Sync() first.
+	SDL_Thread	*asyncthread;
+	SDL_sem		*asyncgo, *asyncdone;
+	bool		asyncquit;	// Tell the async thread to terminate
+	bool		asyncfailed;	// Could not start async thread
+	bool		asyncactive;	// Async mode; pixel buffers in use
+	bool		asyncbusy;	// Job in progress
+	bool		asyncrendered;	// Last job rendered to pixbufs[]
+	Uint32		*pixbufs[2];	// Rendered output
+	unsigned	pixshown;	// pixbufs[] index to upload from
+	int		pixfull;	// Jobs left that must render everything
+	bool StartAsync();
+	void StopAsync();
+	void WaitAsync();
+	void RenderAsync();
+	void RefreshAsync();
+	static int async_thread(void *fire);
+	void Simulate();
+
 	// Colors
 	unsigned	ncolors;
 	Uint32		colors[FIRE_MAX_COLORS];
@@ -204,18 +290,40 @@ class KOBO_Fire : public stream_window_t
 	int		fade;		// Fade-out coefficient (24:8)
 	int		threshold;	// Minimum particle heat threshold
 
+	// Palette/dither LUT; one table per dither phase
+	Uint32		lut[4 * FIRE_LUT_SIZE];
+	int		lutdither;	// Dither mode of 'lut', or -1
+	unsigned	lutcolors;	// Number of colors in 'lut'
+	void UpdateLUT();
+
 	// Particles
 	KOBO_ParticleSystem	*psystems;	// Active particle systems
-	KOBO_ParticleSystem	*psystempool;	// Particle system free pool
 	int pscount, pcount;
+	int statpscount, statpcount;	// As of the last completed update
+
+	// Particle system arena, with one free pool per size class
+	KOBO_ParticleSystem	*psystempool[FIRE_PS_CLASSES];
+	void		*arena;		// Blocks, linked via first pointer
+	unsigned	arenaused;	// Bytes used in the current block
+	unsigned	arenasize;	// Total size of all blocks
+	int		psalloc, palloc;	// Systems/particles allocated
+	int		pspeak, ppeak;		// High-water marks
+	KOBO_ParticleSystem *AllocPSystem(int nparticles);
+	void FreePSystem(KOBO_ParticleSystem *ps);
 	bool RunPSystem(KOBO_ParticleSystem *ps);
 	void RunParticles();
-	bool RunPSystemNR(KOBO_ParticleSystem *ps);
-	void RunParticlesNR();
+
+	// Fast-forward (update_norender())
+	int		skipclock;	// Frames skipped, not yet applied
+	void SkipParticles();
+	void FinishSkip();
 
 	// Particle systems
+	KOBO_ParticleFXStep	*spawnprog;	// For uncompiled definitions
+	unsigned		spawnprogsize;
 	KOBO_ParticleSystem *NewPSystem(int x, int y, int vx, int vy,
-			const KOBO_ParticleFXDef *fxd, int delay);
+			const KOBO_ParticleFXStep *prog, unsigned step,
+			int delay);
 
 	// RNG
 	unsigned noisestate;
@@ -243,9 +351,9 @@ class KOBO_Fire : public stream_window_t
 
 	bool IsOnScreen(KOBO_ParticleSystem *ps)
 	{
-		if(mod(ps->x - cxmin, worldw) >= (int)bufw)
+		if(mod(ps->x - cxmin, worldw) >= (int)(bufw << scaleshift))
 			return false;
-		if(mod(ps->y - cymin, worldh) >= (int)bufh)
+		if(mod(ps->y - cymin, worldh) >= (int)(bufh << scaleshift))
 			return false;
 		return true;
 	}
@@ -261,16 +369,35 @@ class KOBO_Fire : public stream_window_t
 	void scroll(int x, int y, bool wrap);
 
 	void SetPalette(unsigned pal);
-	void SetDither(gfx_dither_t dth)	{ dither = dth; }
-	void SetFade(float coeff)		{ fade = coeff * 256.0f; }
+	void SetDither(gfx_dither_t dth)
+	{
+		Sync();
+		dither = dth;
+	}
+	void SetFade(float coeff)
+	{
+		Sync();
+		fade = coeff * 256.0f;
+	}
 
 	// Wold map size (set to 0 to disable wrapping)
 	void SetWorldSize(int w, int h);
 
 	void update();
+
+	// Fast-forward version of update(); only drops particle systems as
+	// they burn out, and leaves the rest to be aged in one go by the next
+	// update(), or whatever else needs the particles.
 	void update_norender();
 	void refresh(SDL_Rect *r);
 
+	// Wait for any asynchronous update to finish
+	void Sync()
+	{
+		if(asyncbusy)
+			WaitAsync();
+	}
+
 	// Spawn new particle system as specified by 'fxd', at (x, y), with an
 	// initial velocity bias of (vx, vy). Coordinates are 24:8 fixp.
 	// 'delay' is added to whatever delay value the PS itself calculates.
@@ -279,16 +406,30 @@ class KOBO_Fire : public stream_window_t
 
 	bool PSVisible(KOBO_ParticleSystem *ps)
 	{
+		Sync();
+		if(skipclock)
+			FinishSkip();
 		if(!ps->nparticles)
 			return false;
 		return IsOnScreen(ps);
 	}
 	void Clear(bool buffer = true, bool particles = false);
 
-	int StatPSystems()	{ return pscount; }
-	int StatParticles()	{ return pcount; }
+	// Save/restore particle system state, for game state keyframes. The
+	// state is a flat array of 32 bit words. Call SaveParticles() with
+	// 'buf' set to NULL to get the required buffer size. (Words.)
+	unsigned SaveParticles(int32_t *buf);
+	void RestoreParticles(const int32_t *buf, unsigned size);
+
+	int StatPSystems()	{ return statpscount; }
+	int StatParticles()	{ return statpcount; }
+
+	// Arena high-water marks; systems and particle slots allocated
+	int StatPSystemsPeak()	{ return pspeak; }
+	int StatParticlesPeak()	{ return ppeak; }
+	unsigned StatArenaSize()	{ return arenasize; }
 
-	// Benchmarking
+	// Benchmarking (Call Sync() before reading these!)
 	KOBO_Profiler	particle_prof;	// Particles (update + render)
 	KOBO_Profiler	filter_prof;	// Filter (fade, blur)
 	KOBO_Profiler	render_prof;	// Render (dither + palette lookup)
@@ -25,13 +25,7 @@
 #include "cs.h"
 #include <math.h>
 
-game_t game;
-
-
-game_t::game_t()
-{
-	reset();
-}
+KOBO_TLS game_t game;
 
 
 void game_t::reset()
@@ -23,6 +23,8 @@
 #ifndef	_KOBO_GAME_H_
 #define	_KOBO_GAME_H_
 
+#include "config.h"
+
 
   ////////////////////////////////////////////////////
  // Constant game parameters
@@ -182,13 +184,13 @@ class game_t
 	int	enemy_m_health;
 	int	bomb_delay;	// Bomb trigger-to-detonation delay
 
-	game_t();
 	void reset();
 	void set(game_types_t tp, skill_levels_t sk);
 
 	int scale_vel_damage(int vel, int dmg);
 };
 
-extern game_t game;
+// NOTE: Each thread needs to reset() this before use!
+extern KOBO_TLS game_t game;
 
 #endif /*_KOBO_GAME_H_*/
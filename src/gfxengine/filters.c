@@ -502,6 +502,9 @@ int s_filter_displayformat(s_bank_t *b, unsigned first, unsigned frames,
 		s->texture = SDL_CreateTextureFromSurface(
 				(SDL_Renderer *)args->data,
 				s->surface);
+		s->area.x = s->area.y = 0;
+		s->area.w = s->surface->w;
+		s->area.h = s->surface->h;
 #if 0
 		SDL_FreeSurface(s->surface);
 		s->surface = NULL;
@@ -453,6 +453,7 @@ int gfxengine_t::loadimage(int bank, const char *name)
 		return -15;
 	}
 	cs_engine_set_image_size(csengine, bank, b->w, b->h);
+	s_pack_bank(gfx, bank, sdlrenderer);
 
 	log_printf(DLOG, "  Ok.\n");
 	return 0;
@@ -476,6 +477,7 @@ int gfxengine_t::loadtiles(int bank, int w, int h, const char *name)
 	}
 
 	cs_engine_set_image_size(csengine, bank, w, h);
+	s_pack_bank(gfx, bank, sdlrenderer);
 
 	log_printf(DLOG, "  Ok. (%d frames)\n", s_get_bank(gfx, bank)->max+1);
 	return 0;
@@ -1307,6 +1309,13 @@ void gfxengine_t::render_window(windowbase_t *win)
 }
 
 
+void gfxengine_t::invalidate_windows()
+{
+	for(windowbase_t *w = windows; w; w = w->next)
+		w->invalidate();
+}
+
+
 /*
  * Generic render() callback for sprites and tiles.
  */
@@ -1329,6 +1338,9 @@ void gfxengine_t::render_sprite(cs_obj_t *o)
 
 cs_obj_t *gfxengine_t::get_obj(int layer)
 {
+	if(!csengine)
+		return NULL;
+
 	cs_obj_t *o = cs_engine_get_obj(csengine);
 	if(o)
 	{
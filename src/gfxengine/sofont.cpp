@@ -25,6 +25,7 @@
 #include "stdlib.h"
 #include "sofont.h"
 #include "string.h"
+#include <limits.h>
 
 SoFont::SoFont(SDL_Renderer *_target)
 {
@@ -41,15 +42,34 @@ SoFont::SoFont(SDL_Renderer *_target)
 	xspace = 0;
 	tabsize = 64;
 	xscale = yscale = 256;
+	glyphsw = glyphsh = 1;
+	runs = NULL;
+	runclock = 0;
+	hits = misses = 0;
+#ifdef SOFONT_GEOMETRY
+	vertices = NULL;
+	indices = NULL;
+#endif
 }
 
 SoFont::~SoFont()
 {
+	if(hits || misses)
+		log_printf(DLOG, "SoFont: %u run cache hits, %u misses\n",
+				hits, misses);
 	if(glyphs)
 		SDL_DestroyTexture(glyphs);
 	delete [] CharPos;
 	delete [] CharOffset;
 	delete [] Spacing;
+	if(runs)
+		for(int i = 0; i < SOFONT_RUN_CACHE; ++i)
+			free(runs[i].glyphs);
+	free(runs);
+#ifdef SOFONT_GEOMETRY
+	free(vertices);
+	free(indices);
+#endif
 }
 
 namespace SoFontUtilities
@@ -240,6 +260,7 @@ bool SoFont::Load(SDL_Surface *FontSurface)
 	if(glyphs)
 		SDL_DestroyTexture(glyphs);
 	glyphs = NULL;
+	FlushCache();
 	height = FontSurface->h - 1;
 	while(x < FontSurface->w)
 	{
@@ -281,6 +302,8 @@ bool SoFont::Load(SDL_Surface *FontSurface)
 				"surface\n");
 		return false;
 	}
+	glyphsw = FontSurface->w;
+	glyphsh = FontSurface->h;
 
 	delete [] CharPos;
 	delete [] CharOffset;
@@ -343,18 +366,221 @@ bool SoFont::Load(SDL_Surface *FontSurface)
 	return true;
 }
 
+void SoFont::FlushCache()
+{
+	if(!runs)
+		return;
+	for(int i = 0; i < SOFONT_RUN_CACHE; ++i)
+		runs[i].used = 0;
+}
+
+// Look up 'text' in the run cache, or recycle the least recently used run
+// for it. Returns NULL if the text is too long to cache.
+SoFontRun *SoFont::GetRun(const char *text)
+{
+	Uint32 h = 2166136261U;
+	int len;
+	for(len = 0; text[len]; ++len)
+	{
+		if(len >= SOFONT_RUN_MAXLEN)
+			return NULL;
+		h = (h ^ (Uint8)text[len]) * 16777619U;
+	}
+	if(!runs)
+	{
+		runs = (SoFontRun *)calloc(SOFONT_RUN_CACHE,
+				sizeof(SoFontRun));
+		if(!runs)
+			return NULL;
+	}
+
+	if(!++runclock)
+	{
+		FlushCache();	// Wrapped! Just start over.
+		runclock = 1;
+	}
+	SoFontRun *lru = runs;
+	for(int i = 0; i < SOFONT_RUN_CACHE; ++i)
+	{
+		SoFontRun *r = runs + i;
+		if(r->used && (r->hash == h) && (r->xscale == xscale) &&
+				(r->yscale == yscale) && !strcmp(r->text, text))
+		{
+			r->used = runclock;
+			++hits;
+			return r;
+		}
+		if(r->used < lru->used)
+			lru = r;
+	}
+
+	++misses;
+	lru->hash = h;
+	lru->used = runclock;
+	lru->xscale = xscale;
+	lru->yscale = yscale;
+	lru->width = -1;
+	lru->nglyphs = -1;
+	memcpy(lru->text, text, len + 1);
+	return lru;
+}
+
+// Same as the PutString() loop, but relative to (0, 0), and without clipping
+bool SoFont::LayoutRun(SoFontRun *r)
+{
+	int len = strlen(r->text);
+	if(r->maxglyphs < len)
+	{
+		SoFontGlyph *g = (SoFontGlyph *)realloc(r->glyphs,
+				len * sizeof(SoFontGlyph));
+		if(!g)
+			return false;
+		r->glyphs = g;
+		r->maxglyphs = len;
+	}
+	const char *text = r->text;
+	int x = 0, y = 0;
+	int cull = INT_MIN;
+	r->nglyphs = 0;
+	for(int i = 0; text[i] != '\0'; ++i)
+	{
+		if(text[i] == ' ')
+			x += spacew * xscale >> 8;
+		else if(text[i] == '\t')
+		{
+			x += tabsize * xscale >> 8;
+			x -= x % (tabsize * xscale >> 8);
+		}
+		else if(text[i] == '\n')
+		{
+			x = 0;
+			y += height * yscale >> 8;
+		}
+		else if(text[i] == '\r')
+		{
+			x = 0;
+			y += height * yscale >> 9;
+		}
+		else if((text[i] >= START_CHAR) && (text[i] <= max_i))
+		{
+			int ofs = text[i] - START_CHAR;
+			SoFontGlyph *g = r->glyphs + r->nglyphs++;
+			g->src.w = CharPos[ofs + 1] - CharPos[ofs];
+			g->src.h = height;
+			g->src.x = CharPos[ofs];
+			g->src.y = 1;
+			g->dst.x = x - (CharOffset[ofs] * xscale >> 8);
+			g->dst.y = y;
+			g->dst.w = (int)g->src.w * xscale >> 8;
+			g->dst.h = (int)g->src.h * yscale >> 8;
+			g->cull = cull;
+			x += (Spacing[ofs] + xspace) * xscale >> 8;
+		}
+		if(x > cull)
+			cull = x;
+	}
+	return true;
+}
+
+void SoFont::PutRun(SoFontRun *r, int x, int y, SDL_Rect *clip, int targetw)
+{
+	int n = r->nglyphs;
+	if(!n)
+		return;
+#ifdef SOFONT_GEOMETRY
+	// Fast path: No clipping or culling; one call for the whole string
+	if(!clip && (r->glyphs[n - 1].cull <= targetw - x))
+	{
+		if(!vertices)
+		{
+			vertices = (SDL_Vertex *)malloc(SOFONT_RUN_MAXLEN *
+					4 * sizeof(SDL_Vertex));
+			indices = (int *)malloc(SOFONT_RUN_MAXLEN * 6 *
+					sizeof(int));
+			if(vertices && indices)
+				for(int i = 0; i < SOFONT_RUN_MAXLEN; ++i)
+				{
+					int *ind = indices + i * 6;
+					ind[0] = i * 4;
+					ind[1] = i * 4 + 1;
+					ind[2] = i * 4 + 2;
+					ind[3] = i * 4 + 2;
+					ind[4] = i * 4 + 1;
+					ind[5] = i * 4 + 3;
+				}
+		}
+		if(vertices && indices)
+		{
+			// RenderGeometry() only uses the vertex colors
+			SDL_Color c;
+			SDL_GetTextureColorMod(glyphs, &c.r, &c.g, &c.b);
+			SDL_GetTextureAlphaMod(glyphs, &c.a);
+			float tw = 1.0f / glyphsw;
+			float th = 1.0f / glyphsh;
+			for(int i = 0; i < n; ++i)
+			{
+				SoFontGlyph *g = r->glyphs + i;
+				SDL_Vertex *v = vertices + i * 4;
+				float x0 = x + g->dst.x;
+				float y0 = y + g->dst.y;
+				float x1 = x0 + g->dst.w;
+				float y1 = y0 + g->dst.h;
+				float u0 = g->src.x * tw;
+				float v0 = g->src.y * th;
+				float u1 = (g->src.x + g->src.w) * tw;
+				float v1 = (g->src.y + g->src.h) * th;
+				v[0].position.x = x0;	v[0].position.y = y0;
+				v[0].tex_coord.x = u0;	v[0].tex_coord.y = v0;
+				v[1].position.x = x1;	v[1].position.y = y0;
+				v[1].tex_coord.x = u1;	v[1].tex_coord.y = v0;
+				v[2].position.x = x0;	v[2].position.y = y1;
+				v[2].tex_coord.x = u0;	v[2].tex_coord.y = v1;
+				v[3].position.x = x1;	v[3].position.y = y1;
+				v[3].tex_coord.x = u1;	v[3].tex_coord.y = v1;
+				for(int j = 0; j < 4; ++j)
+					v[j].color = c;
+			}
+			SDL_RenderGeometry(target, glyphs, vertices, n * 4,
+					indices, n * 6);
+			return;
+		}
+	}
+#endif
+	for(int i = 0; i < n; ++i)
+	{
+		SoFontGlyph *g = r->glyphs + i;
+		if(g->cull > targetw - x)
+			break;
+		SDL_Rect srcrect = g->src;
+		SDL_Rect dstrect = g->dst;
+		dstrect.x += x;
+		dstrect.y += y;
+		if(clip)
+			sdcRects(&srcrect, &dstrect, *clip);
+		SDL_RenderCopy(target, glyphs, &srcrect, &dstrect);
+	}
+}
+
 void SoFont::PutString(int x, int y, const char *text, SDL_Rect *clip)
 {
 	if((!glyphs) || (!text))
 		return;
-	int x0 = x;
-	int ofs, i = 0;
-	SDL_Rect srcrect, dstrect;
 	int targetw;
 	if(clip)
 		targetw = clip->x + clip->w;
 	else
 		SDL_RenderGetLogicalSize(target, &targetw, NULL);
+
+	SoFontRun *r = GetRun(text);
+	if(r && ((r->nglyphs >= 0) || LayoutRun(r)))
+	{
+		PutRun(r, x, y, clip, targetw);
+		return;
+	}
+
+	int x0 = x;
+	int ofs, i = 0;
+	SDL_Rect srcrect, dstrect;
 	while(text[i] != '\0')
 	{
 		if(text[i] == ' ')
@@ -481,6 +707,13 @@ int SoFont::TextWidth(const char *text, int min, int max)
 {
 	if(!text)
 		return 0;
+	SoFontRun *r = NULL;
+	if(!min && (max >= SOFONT_RUN_MAXLEN))
+	{
+		r = GetRun(text);
+		if(r && (r->width >= 0))
+			return r->width;
+	}
 	int ofs, x = 0, i = min;
 	int maxx = 0;
 	while((text[i] != '\0') && (i < max))
@@ -514,6 +747,8 @@ int SoFont::TextWidth(const char *text, int min, int max)
 	}
 	if(x >  maxx)
 		maxx = x;
+	if(r)
+		r->width = maxx * xscale >> 8;
 	return maxx * xscale >> 8;
 }
 
@@ -61,6 +61,7 @@
 
 	David Olofson 2017:
 		* Added TabSize() and '\t' tab support.
+		* Added glyph run cache for PutString() and TextWidth().
 */
 
 #ifndef __SOFONT_H
@@ -70,6 +71,38 @@
 
 #define START_CHAR 33
 
+/*
+ * Glyph run cache
+ *	Strings passed to PutString() and TextWidth() are laid out once, and
+ *	then kept in a small LRU cache, keyed by text and scale. Drawing a
+ *	cached string is then a single SDL_RenderGeometry() call, where
+ *	available, unless clipping or culling is needed.
+ */
+#define	SOFONT_RUN_MAXLEN	128	// Longer strings are not cached
+#define	SOFONT_RUN_CACHE	64	// Number of cached runs per font
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+#	define	SOFONT_GEOMETRY
+#endif
+
+struct SoFontGlyph
+{
+	SDL_Rect	src, dst;	// dst relative to string position
+	int		cull;		// Max pen x before this glyph
+};
+
+struct SoFontRun
+{
+	Uint32		hash;
+	Uint32		used;		// LRU timestamp, or 0 if unused
+	int		xscale, yscale;
+	int		width;		// TextWidth(), or -1 if not known
+	int		nglyphs;	// -1 if not laid out yet
+	int		maxglyphs;
+	SoFontGlyph	*glyphs;
+	char		text[SOFONT_RUN_MAXLEN + 1];
+};
+
 class SoFont
 {
 public:
@@ -113,11 +146,26 @@ public:
 	int GetMinChar()	{ return START_CHAR; }
 	int GetMaxChar()	{ return max_i; }
 
-	void ExtraSpace(int xs)	{ xspace = xs; }
-	void TabSize(int ts)	{ tabsize = ts; }
+	void ExtraSpace(int xs)
+	{
+		if(xs != xspace)
+			FlushCache();
+		xspace = xs;
+	}
+	void TabSize(int ts)
+	{
+		if(ts != tabsize)
+			FlushCache();
+		tabsize = ts;
+	}
 
 	SDL_Texture *GetGlyphs()	{ return glyphs; }
 
+	// Glyph run cache
+	void FlushCache();
+	unsigned CacheHits()	{ return hits; }
+	unsigned CacheMisses()	{ return misses; }
+
 protected:
 	SDL_Renderer *target;
 	SDL_Texture *glyphs;
@@ -130,8 +178,19 @@ protected:
 	int tabsize;
 	Uint32 background;
 	int xscale, yscale;
+	int glyphsw, glyphsh;
+	SoFontRun *runs;
+	Uint32 runclock;
+	unsigned hits, misses;
+#ifdef SOFONT_GEOMETRY
+	SDL_Vertex *vertices;
+	int *indices;
+#endif
 	bool DoStartNewChar(SDL_Surface *surface, Sint32 x);
 	void CleanSurface(SDL_Surface *surface);
+	SoFontRun *GetRun(const char *text);
+	bool LayoutRun(SoFontRun *r);
+	void PutRun(SoFontRun *r, int x, int y, SDL_Rect *clip, int targetw);
 };
 
 #endif
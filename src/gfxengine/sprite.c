@@ -158,11 +158,37 @@ s_container_t *s_new_container(unsigned banks)
 void s_delete_container(s_container_t *c)
 {
 	s_delete_all_banks(c);
+	while(c->atlases)
+	{
+		s_atlas_t *a = c->atlases;
+		c->atlases = a->next;
+		if(a->texture)
+			SDL_DestroyTexture(a->texture);
+		free(a);
+	}
 	free(c->banks);
 	free(c);
 }
 
 
+/* Destroy the texture of a sprite, or release its atlas page */
+static void __release_texture(s_sprite_t *s)
+{
+	if(s->atlas)
+	{
+		if(!--s->atlas->users)
+		{
+			SDL_DestroyTexture(s->atlas->texture);
+			s->atlas->texture = NULL;
+		}
+		s->atlas = NULL;
+	}
+	else if(s->texture)
+		SDL_DestroyTexture(s->texture);
+	s->texture = NULL;
+}
+
+
 /*
  * Allocates a new sprite. If the sprite exists already, any texture or surface
  * will be removed, so that one can safely expect to get an *empty* sprite.
@@ -181,9 +207,8 @@ s_sprite_t *s_new_sprite_b(s_bank_t *b, unsigned frame)
 	}
 	else
 	{
-		if(s->texture)
-			SDL_DestroyTexture(s->texture);
-		s->texture = NULL;
+		s = b->sprites[frame];
+		__release_texture(s);
 		if(s->surface)
 			SDL_FreeSurface(s->surface);
 		s->surface = NULL;
@@ -217,11 +242,9 @@ void s_delete_sprite_b(s_bank_t *b, unsigned frame)
 		return;
 	if(!b->sprites[frame])
 		return;
-	if(b->sprites[frame]->texture)
-		SDL_DestroyTexture(b->sprites[frame]->texture);
+	__release_texture(b->sprites[frame]);
 	if(b->sprites[frame]->surface)
 		SDL_FreeSurface(b->sprites[frame]->surface);
-	b->sprites[frame]->texture = NULL;
 	free(b->sprites[frame]);
 	b->sprites[frame] = NULL;
 }
@@ -388,6 +411,8 @@ void s_detach_sprite(s_container_t *c, unsigned bank, unsigned frame)
 	s_sprite_t *s = s_get_sprite(c, bank, frame);
 	if(!s)
 		return;
+	if(s->atlas)
+		__release_texture(s);	/* Can't hand out shared textures! */
 	s->texture = NULL;
 }
 
@@ -691,3 +716,189 @@ int s_set_hotspot(s_container_t *c, unsigned bank, int frame, int x, int y)
 	}
 	return 0;
 }
+
+
+/*
+----------------------------------------------------------------------
+	Texture atlases
+----------------------------------------------------------------------
+ */
+
+/* Free atlas pages that are no longer used by any sprites */
+static void __prune_atlases(s_container_t *c)
+{
+	s_atlas_t **ap = &c->atlases;
+	while(*ap)
+	{
+		s_atlas_t *a = *ap;
+		if(a->users)
+		{
+			ap = &a->next;
+			continue;
+		}
+		*ap = a->next;
+		if(a->texture)
+			SDL_DestroyTexture(a->texture);
+		free(a);
+	}
+}
+
+
+/* Try to find a w x h area in 'a', using simple shelf packing */
+static int __atlas_place(s_atlas_t *a, Uint32 format, int w, int h,
+		SDL_Rect *r)
+{
+	int x = a->x;
+	int y = a->y;
+	int sh = a->shelfh;
+	if(!a->texture || (a->format != format))
+		return 0;
+	if(x + w > a->w)
+	{
+		/* Start a new shelf */
+		y += sh;
+		x = 0;
+		sh = 0;
+	}
+	if(y + h > a->h)
+		return 0;
+	r->x = x;
+	r->y = y;
+	r->w = w;
+	r->h = h;
+	a->x = x + w;
+	a->y = y;
+	a->shelfh = h > sh ? h : sh;
+	return 1;
+}
+
+
+static s_atlas_t *__atlas_alloc(s_container_t *c, SDL_Renderer *renderer,
+		int size, Uint32 format, int w, int h, SDL_Rect *r)
+{
+	s_atlas_t *a;
+	for(a = c->atlases; a; a = a->next)
+		if(__atlas_place(a, format, w, h, r))
+			return a;
+
+	a = (s_atlas_t *)calloc(1, sizeof(s_atlas_t));
+	if(!a)
+		return NULL;
+	a->texture = SDL_CreateTexture(renderer, format,
+			SDL_TEXTUREACCESS_STATIC, size, size);
+	if(!a->texture)
+	{
+		log_printf(WLOG, "sprite: Could not create %dx%d atlas "
+				"texture: %s\n", size, size, SDL_GetError());
+		free(a);
+		return NULL;
+	}
+	SDL_SetTextureBlendMode(a->texture, SDL_BLENDMODE_BLEND);
+	a->format = format;
+	a->w = a->h = size;
+	a->next = c->atlases;
+	c->atlases = a;
+	DBG(log_printf(DLOG, "sprite: New %dx%d atlas page.\n", size, size);)
+	if(!__atlas_place(a, format, w, h, r))
+		return NULL;
+	return a;
+}
+
+
+/* Copy 'src' to 'dst', adding a border of copied edge pixels */
+static void __extrude(Uint32 *dst, SDL_Surface *src)
+{
+	int y;
+	int w = src->w;
+	int h = src->h;
+	int dw = w + 2;
+	for(y = 0; y < h; ++y)
+	{
+		Uint32 *s = (Uint32 *)((char *)src->pixels + src->pitch * y);
+		Uint32 *d = dst + dw * (y + 1);
+		memcpy(d + 1, s, w * sizeof(Uint32));
+		d[0] = s[0];
+		d[w + 1] = s[w - 1];
+	}
+	memcpy(dst, dst + dw, dw * sizeof(Uint32));
+	memcpy(dst + dw * (h + 1), dst + dw * h, dw * sizeof(Uint32));
+}
+
+
+int s_pack_bank(s_container_t *c, unsigned bank, SDL_Renderer *renderer)
+{
+	SDL_RendererInfo info;
+	unsigned i;
+	int packed = 0;
+	int size = S_ATLAS_SIZE;
+	Uint32 *buf;
+	s_bank_t *b = s_get_bank(c, bank);
+	if(!b || !renderer)
+		return -1;
+
+	if(SDL_GetRendererInfo(renderer, &info) == 0)
+	{
+		if(info.max_texture_width && (info.max_texture_width < size))
+			size = info.max_texture_width;
+		if(info.max_texture_height &&
+				(info.max_texture_height < size))
+			size = info.max_texture_height;
+	}
+
+	__prune_atlases(c);
+
+	buf = (Uint32 *)malloc((S_ATLAS_MAX_SPRITE + 2) *
+			(S_ATLAS_MAX_SPRITE + 2) * sizeof(Uint32));
+	if(!buf)
+		return -2;
+
+	for(i = 0; i <= b->max; ++i)
+	{
+		SDL_Rect r;
+		SDL_BlendMode bm;
+		Uint32 ck;
+		s_atlas_t *a;
+		s_sprite_t *s = b->sprites[i];
+		if(!s || !s->texture || s->atlas || !s->surface)
+			continue;
+
+		/* Only plain alpha blended 32 bpp sprites of modest size */
+		if((s->surface->w > S_ATLAS_MAX_SPRITE) ||
+				(s->surface->h > S_ATLAS_MAX_SPRITE) ||
+				(s->surface->w + 2 > size) ||
+				(s->surface->h + 2 > size))
+			continue;
+		if(s->surface->format->BytesPerPixel != 4)
+			continue;
+		if(SDL_GetColorKey(s->surface, &ck) == 0)
+			continue;
+		if((SDL_GetTextureBlendMode(s->texture, &bm) < 0) ||
+				(bm != SDL_BLENDMODE_BLEND))
+			continue;
+
+		a = __atlas_alloc(c, renderer, size,
+				s->surface->format->format,
+				s->surface->w + 2, s->surface->h + 2, &r);
+		if(!a)
+			break;
+
+		__extrude(buf, s->surface);
+		if(SDL_UpdateTexture(a->texture, &r, buf,
+				r.w * sizeof(Uint32)) < 0)
+			continue;
+
+		SDL_DestroyTexture(s->texture);
+		s->texture = a->texture;
+		s->atlas = a;
+		++a->users;
+		s->area.x = r.x + 1;
+		s->area.y = r.y + 1;
+		s->area.w = s->surface->w;
+		s->area.h = s->surface->h;
+		++packed;
+	}
+	free(buf);
+	DBG(log_printf(DLOG, "s_pack_bank(%p, %d): %d/%d frames packed\n",
+			c, bank, packed, b->max + 1);)
+	return packed;
+}
@@ -40,11 +40,29 @@ typedef enum
 
 struct s_container_t;
 
+/*
+ * Texture atlas page. Sprites packed into an atlas share its texture, and only
+ * use their own area of it.
+ */
+typedef struct s_atlas_t s_atlas_t;
+struct s_atlas_t
+{
+	s_atlas_t	*next;
+	SDL_Texture	*texture;
+	Uint32		format;		/* SDL_PIXELFORMAT_* of the texture */
+	int		w, h;
+	int		x, y;		/* Next free position on current shelf */
+	int		shelfh;		/* Height of current shelf */
+	int		users;		/* Number of sprites using the page */
+};
+
 /* sprite image */
 typedef struct
 {
 	int		x, y;		/* kern or hot-spot*/
 	SDL_Texture	*texture;
+	SDL_Rect	area;		/* Area of 'texture' to use */
+	s_atlas_t	*atlas;		/* Atlas owning 'texture', if any */
 	SDL_Surface	*surface;
 /*TODO:	SDL_BlendMode	blendmode;	*/
 } s_sprite_t;
@@ -68,6 +86,7 @@ typedef struct s_container_t
 {
 	int		max;
 	s_bank_t	**banks;
+	s_atlas_t	*atlases;
 } s_container_t;
 
 
@@ -116,6 +135,23 @@ int s_generate_bank(s_container_t *c, unsigned bank, unsigned w, unsigned h,
 int s_set_hotspot(s_container_t *c, unsigned bank, int frame, int x, int y);
 
 
+/*
+ * Texture atlases
+ *
+ * Move the textures of all frames of 'bank' into texture atlas pages shared by
+ * all banks of the container, so that the renderer can draw many sprites
+ * without switching textures. Frames that are too large, or have textures that
+ * cannot be shared, keep their own textures.
+ *
+ * Each frame gets a one pixel border of copied edge pixels, so that filtered
+ * scaling does not pick up pixels from neighboring frames.
+ */
+#define	S_ATLAS_SIZE		2048	/* Preferred page size */
+#define	S_ATLAS_MAX_SPRITE	256	/* Largest frame to pack */
+
+int s_pack_bank(s_container_t *c, unsigned bank, SDL_Renderer *renderer);
+
+
 /*
  * Internal data manipulation API
  * (Will not automatically run plugins.)
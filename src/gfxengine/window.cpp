@@ -45,6 +45,7 @@ windowbase_t::windowbase_t(gfxengine_t *e)
 	_blendmode = GFX_DEFAULT_BLENDMODE;
 	_alphamod = GFX_DEFAULT_ALPHAMOD;
 	_colormod = GFX_DEFAULT_COLORMOD;
+	cache_dirty = true;
 	memset(&phys_rect, 0, sizeof(phys_rect));
 }
 
@@ -150,6 +151,7 @@ stream_window_t::stream_window_t(gfxengine_t *e) : windowbase_t(e)
 {
 	texture = NULL;
 	bufw = bufh = 0;
+	bufscale = 1;
 	scrollx = scrolly = 0;
 	scrollwrap = false;
 }
@@ -192,10 +194,11 @@ void stream_window_t::place(int left, int top, int sizex, int sizey)
 }
 
 
-void stream_window_t::buffersize(int w, int h)
+void stream_window_t::buffersize(int w, int h, int scale)
 {
 	bufw = w;
 	bufh = h;
+	bufscale = scale;
 	realloc_texture();
 }
 
@@ -248,9 +251,9 @@ void stream_window_t::render(SDL_Rect *r)
 			get_r(_colormod), get_g(_colormod), get_b(_colormod));
 	SDL_Rect dr = phys_rect;
 	if(bufw)
-		dr.w = bufw * xs >> 8;
+		dr.w = bufw * bufscale * xs >> 8;
 	if(bufh)
-		dr.h = bufh * ys >> 8;
+		dr.h = bufh * bufscale * ys >> 8;
 	if(scrollwrap)
 	{
 		dr.x -= ((scrollx * xs >> 16) + dr.w * 10) % dr.w;
@@ -289,6 +292,18 @@ window_t::window_t(gfxengine_t *e) : windowbase_t(e)
 	_font = 0;
 	_visible = true;
 	_offscreen = OFFSCREEN_DISABLED;
+	_cache = false;
+	cache_dirty = true;
+	cache_w = cache_h = 0;
+	batching = false;
+	batch_quads = 0;
+	batch_texture = NULL;
+	batch_tw = batch_th = 0.0f;
+	batch_blendmode = GFX_DEFAULT_BLENDMODE;
+#ifdef GFX_BATCHING
+	batch_vertices = NULL;
+	batch_indices = NULL;
+#endif
 }
 
 
@@ -301,6 +316,10 @@ window_t::~window_t()
 	}
 	if(osurface)
 		SDL_FreeSurface(osurface);
+#ifdef GFX_BATCHING
+	free(batch_vertices);
+	free(batch_indices);
+#endif
 }
 
 
@@ -314,6 +333,7 @@ void window_t::visible(bool vis)
 
 void window_t::place(int left, int top, int sizex, int sizey)
 {
+	cache_dirty = true;
 	if(_offscreen != OFFSCREEN_DISABLED)
 	{
 		phys_rect.x = phys_rect.y = 0;
@@ -400,6 +420,86 @@ int window_t::offscreen()
 }
 
 
+void window_t::cache(bool enable)
+{
+	if(_offscreen != OFFSCREEN_DISABLED)
+		return;		// Offscreen windows have their own buffers!
+	_cache = enable;
+	cache_dirty = true;
+	if(!_cache && otexture)
+	{
+		if(renderer)
+			SDL_DestroyTexture(otexture);
+		otexture = NULL;
+	}
+}
+
+
+// Render a cached window. The cache texture is kept in otexture, and the
+// window is temporarily switched to offscreen render target mode to update it.
+void window_t::render(SDL_Rect *r)
+{
+	if(!_cache || !renderer)
+	{
+		windowbase_t::render(r);
+		return;
+	}
+
+	if(!otexture || (cache_w != phys_rect.w) || (cache_h != phys_rect.h))
+	{
+		if(otexture)
+			SDL_DestroyTexture(otexture);
+		otexture = NULL;
+		if(SDL_RenderTargetSupported(renderer))
+			otexture = SDL_CreateTexture(renderer,
+					KOBO_PIXELFORMAT,
+					SDL_TEXTUREACCESS_TARGET,
+					phys_rect.w, phys_rect.h);
+		if(!otexture)
+		{
+			// No render targets, or out of VRAM; don't cache
+			_cache = false;
+			windowbase_t::render(r);
+			return;
+		}
+		// The cache is cleared to transparent black, so anything
+		// blended into it ends up premultiplied by alpha.
+#if SDL_VERSION_ATLEAST(2, 0, 6)
+		SDL_SetTextureBlendMode(otexture, SDL_ComposeCustomBlendMode(
+				SDL_BLENDFACTOR_ONE,
+				SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+				SDL_BLENDOPERATION_ADD,
+				SDL_BLENDFACTOR_ONE,
+				SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+				SDL_BLENDOPERATION_ADD));
+#else
+		SDL_SetTextureBlendMode(otexture, SDL_BLENDMODE_BLEND);
+#endif
+		cache_w = phys_rect.w;
+		cache_h = phys_rect.h;
+		cache_dirty = true;
+	}
+
+	if(cache_dirty)
+	{
+		SDL_Rect pr = phys_rect;
+		cache_dirty = false;	// refresh() may invalidate() again!
+		phys_rect.x = phys_rect.y = 0;
+		_offscreen = OFFSCREEN_RENDER_TARGET;
+		select();
+		SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+		SDL_RenderClear(renderer);
+		refresh(r);
+		flush_batch();
+		_offscreen = OFFSCREEN_DISABLED;
+		phys_rect = pr;
+	}
+
+	select();
+	SDL_RenderCopy(renderer, otexture, NULL, &phys_rect);
+}
+
+
 void window_t::offscreen_invalidate(SDL_Rect *r)
 {
 	switch(_offscreen)
@@ -443,6 +543,9 @@ void window_t::offscreen_invalidate(SDL_Rect *r)
 
 void window_t::invalidate(SDL_Rect *r)
 {
+	cache_dirty = true;
+	if(_cache)
+		return;		// Refreshed by render() as needed
 	if(!engine || !renderer || (_offscreen == OFFSCREEN_DISABLED))
 		return;
 	check_select();
@@ -459,12 +562,14 @@ void window_t::bgimage(int bank, int frame)
 {
 	bg_bank = bank;
 	bg_frame = frame;
+	cache_dirty = true;
 }
 
 
 void window_t::font(int fnt)
 {
 	_font = fnt;
+	cache_dirty = true;
 }
 
 
@@ -630,6 +735,8 @@ void window_t::clear(SDL_Rect *r)
 	if(s)
 	{
 		// Untested!
+		sr.x += s->area.x;
+		sr.y += s->area.y;
 		set_texture_params(s->texture);
 		SDL_RenderCopy(renderer, s->texture, &sr, &dr);
 		restore_texture_params(s->texture);
@@ -783,13 +890,19 @@ void window_t::sprite_fxp(int _x, int _y, int bank, int frame)
 	_y = CS2PIXEL((_y * ys + 128) >> 8);
 	SDL_Rect r;
 
-	check_select();
+	if(!batching)
+		check_select();
 	r.x = phys_rect.x + _x - (s->x * b->xs >> 8);
 	r.y = phys_rect.y + _y - (s->y * b->ys >> 8);
 	r.w = b->w * b->xs >> 8;
 	r.h = b->h * b->ys >> 8;
+	if(batching)
+	{
+		batch_sprite(s->texture, &s->area, &r);
+		return;
+	}
 	set_texture_params(s->texture);
-	SDL_RenderCopy(renderer, s->texture, NULL, &r);
+	SDL_RenderCopy(renderer, s->texture, &s->area, &r);
 	restore_texture_params(s->texture);
 }
 
@@ -815,11 +928,150 @@ void window_t::sprite_fxp_scale(int _x, int _y, int bank, int frame,
 	r.w = (b->w * b->xs >> 8) * xscale;
 	r.h = (b->h * b->ys >> 8) * yscale;
 	set_texture_params(s->texture);
-	SDL_RenderCopy(renderer, s->texture, NULL, &r);
+	SDL_RenderCopy(renderer, s->texture, &s->area, &r);
 	restore_texture_params(s->texture);
 }
 
 
+void window_t::texture_fxp(int _x, int _y, SDL_Texture *tx, int w, int h)
+{
+	if(!engine || !renderer || !tx)
+		return;
+	_x = CS2PIXEL((_x * xs + 128) >> 8);
+	_y = CS2PIXEL((_y * ys + 128) >> 8);
+	SDL_Rect sr, r;
+
+	if(!batching)
+		check_select();
+	sr.x = sr.y = 0;
+	sr.w = w;
+	sr.h = h;
+	r.x = phys_rect.x + _x;
+	r.y = phys_rect.y + _y;
+	r.w = w;
+	r.h = h;
+	if(batching)
+	{
+		batch_sprite(tx, &sr, &r);
+		return;
+	}
+	set_texture_params(tx);
+	SDL_RenderCopy(renderer, tx, &sr, &r);
+	restore_texture_params(tx);
+}
+
+
+void window_t::begin_batch()
+{
+#ifdef GFX_BATCHING
+	if(!batch_vertices)
+	{
+		batch_vertices = (SDL_Vertex *)malloc(GFX_BATCH_QUADS * 4 *
+				sizeof(SDL_Vertex));
+		batch_indices = (int *)malloc(GFX_BATCH_QUADS * 6 *
+				sizeof(int));
+		if(!batch_vertices || !batch_indices)
+		{
+			free(batch_vertices);
+			free(batch_indices);
+			batch_vertices = NULL;
+			batch_indices = NULL;
+			return;
+		}
+		for(int i = 0; i < GFX_BATCH_QUADS; ++i)
+		{
+			int *ind = batch_indices + i * 6;
+			ind[0] = i * 4;
+			ind[1] = i * 4 + 1;
+			ind[2] = i * 4 + 2;
+			ind[3] = i * 4 + 2;
+			ind[4] = i * 4 + 1;
+			ind[5] = i * 4 + 3;
+		}
+	}
+	batching = true;
+#endif
+}
+
+
+void window_t::end_batch()
+{
+	flush_batch();
+	batching = false;
+}
+
+
+void window_t::flush_batch()
+{
+#ifdef GFX_BATCHING
+	if(!batch_quads)
+		return;
+	int n = batch_quads;
+	batch_quads = 0;
+	windowbase_t::check_select();
+	SDL_BlendMode bm = SDL_BLENDMODE_NONE;
+	if(batch_blendmode != GFX_DEFAULT_BLENDMODE)
+	{
+		SDL_GetTextureBlendMode(batch_texture, &bm);
+		SDL_SetTextureBlendMode(batch_texture,
+				(SDL_BlendMode)batch_blendmode);
+	}
+	SDL_RenderGeometry(renderer, batch_texture, batch_vertices, n * 4,
+			batch_indices, n * 6);
+	if(batch_blendmode != GFX_DEFAULT_BLENDMODE)
+		SDL_SetTextureBlendMode(batch_texture, bm);
+#endif
+}
+
+
+// Add a sprite to the batch. Color and alpha modulation go into the vertices,
+// so they don't break batches, but blend mode changes do.
+void window_t::batch_sprite(SDL_Texture *tx, SDL_Rect *sr, SDL_Rect *dr)
+{
+#ifdef GFX_BATCHING
+	if(batch_quads && ((tx != batch_texture) ||
+			(_blendmode != batch_blendmode) ||
+			(batch_quads >= GFX_BATCH_QUADS)))
+		flush_batch();
+	if(!batch_quads)
+	{
+		int tw, th;
+		if(SDL_QueryTexture(tx, NULL, NULL, &tw, &th) < 0)
+			return;
+		batch_texture = tx;
+		batch_tw = 1.0f / tw;
+		batch_th = 1.0f / th;
+		batch_blendmode = _blendmode;
+	}
+	SDL_Color c;
+	c.r = get_r(_colormod);
+	c.g = get_g(_colormod);
+	c.b = get_b(_colormod);
+	c.a = _alphamod;
+	float x0 = dr->x;
+	float y0 = dr->y;
+	float x1 = dr->x + dr->w;
+	float y1 = dr->y + dr->h;
+	float u0 = sr->x * batch_tw;
+	float v0 = sr->y * batch_th;
+	float u1 = (sr->x + sr->w) * batch_tw;
+	float v1 = (sr->y + sr->h) * batch_th;
+	SDL_Vertex *v = batch_vertices + batch_quads * 4;
+	v[0].position.x = x0;	v[0].position.y = y0;
+	v[0].tex_coord.x = u0;	v[0].tex_coord.y = v0;
+	v[1].position.x = x1;	v[1].position.y = y0;
+	v[1].tex_coord.x = u1;	v[1].tex_coord.y = v0;
+	v[2].position.x = x0;	v[2].position.y = y1;
+	v[2].tex_coord.x = u0;	v[2].tex_coord.y = v1;
+	v[3].position.x = x1;	v[3].position.y = y1;
+	v[3].tex_coord.x = u1;	v[3].tex_coord.y = v1;
+	for(int i = 0; i < 4; ++i)
+		v[i].color = c;
+	++batch_quads;
+#endif
+}
+
+
 void window_t::blit(int dx, int dy,
 		int sx, int sy, int sw, int sh, window_t *src)
 {
@@ -881,8 +1133,10 @@ void lowsprites_t::refresh(SDL_Rect *r)
 	engine->target(this);
 	engine->pre_sprite_render();
 	select();
+	begin_batch();
 	for(int i = CS_LAYERS - 1; i >= last_layer; --i)
 		cs_engine_render(engine->cs(), i);
+	end_batch();
 }
 
 
@@ -891,7 +1145,9 @@ void highsprites_t::refresh(SDL_Rect *r)
 {
 	engine->target(this);
 	select();
+	begin_batch();
 	for(int i = first_layer; i >= 0; --i)
 		cs_engine_render(engine->cs(), i);
+	end_batch();
 	engine->post_sprite_render();
 }
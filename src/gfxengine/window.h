@@ -41,6 +41,14 @@
  *		refresh(), and do not need to implement
  *		refresh(). May return -1 if there is an error.
  *
+ *	void cache(bool enable);
+ *		Enable retained mode rendering. refresh() is
+ *		then only called after invalidate(), rendering
+ *		into a texture, which is otherwise just copied
+ *		to the screen. Windows with animated contents
+ *		can call invalidate() from within refresh() to
+ *		have it called again next frame.
+ *
  *	void select();
  *		Makes this window active, and sets up SDL's
  *		clipping appropriately. You should not use
@@ -169,6 +177,11 @@
  *		into this window, placing the top left corner of
  *		'src' at (dx, dy).
  *
+ *	void texture_fxp(int _x, int _y, SDL_Texture *tx, int w, int h);
+ *		Render the whole of texture 'tx', which is w x h
+ *		physical pixels, unscaled at (_x, _y). Batched
+ *		like sprite_fxp().
+ *
  *	int x()		{ return rect.x / xsc; }
  *	int y()		{ return rect.y / ysc; }
  *	int width()	{ return rect.w / xsc; }
@@ -188,6 +201,14 @@
 #include "gfxengine.h"
 #include "SDL.h"
 
+// SDL_RenderGeometry() is needed for sprite batching
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+#	define	GFX_BATCHING
+#endif
+
+// Max number of sprites drawn per SDL_RenderGeometry() call
+#define	GFX_BATCH_QUADS	1024
+
 class gfxengine_t;
 
 enum blendmodes_t
@@ -288,21 +309,32 @@ class windowbase_t
 	void background(Uint32 color)	{ bgcolor = color; }
 	Uint32 background()	{ return bgcolor; }
 
+	// The mods are applied when drawing, so they are baked into the
+	// retained texture of a cached window_t, which must then be redrawn.
 	void colormod(Uint32 color = GFX_DEFAULT_COLORMOD)
 	{
+		if(color == _colormod)
+			return;
 		_colormod = color;
+		cache_dirty = true;
 	}
 	void colormod(Uint8 r, Uint8 g, Uint8 b)
 	{
-		_colormod = map_rgb(r, g, b);
+		colormod(map_rgb(r, g, b));
 	}
 	void alphamod(Uint8 am = GFX_DEFAULT_ALPHAMOD)
 	{
+		if(am == _alphamod)
+			return;
 		_alphamod = am;
+		cache_dirty = true;
 	}
 	void blendmode(blendmodes_t bm = GFX_DEFAULT_BLENDMODE)
 	{
+		if(bm == _blendmode)
+			return;
 		_blendmode = bm;
+		cache_dirty = true;
 	}
 
 	void resetmod()
@@ -419,6 +451,7 @@ class windowbase_t
 	blendmodes_t	_blendmode;
 	Uint32		_colormod, _alphamod;
 	Uint32		fgcolor, bgcolor;
+	bool		cache_dirty;	// Call refresh() before next render()
 
 	void link(gfxengine_t *e);
 	void unlink(void);
@@ -440,7 +473,9 @@ class stream_window_t : public windowbase_t
 
 	void place(int left, int top, int sizex, int sizey);
 
-	void buffersize(int w = 0, int h = 0);
+	// Set texture size. (0 for fit-to-window.) The texture is rendered
+	// 'scale' times larger than its actual size.
+	void buffersize(int w = 0, int h = 0, int scale = 1);
 	virtual void scroll(int x, int y, bool wrap);	// (24:8 fixp)
 
 	// Lock area for updating. 'pixels' is pointed at a write-only buffer
@@ -462,6 +497,7 @@ class stream_window_t : public windowbase_t
   protected:
 	SDL_Texture	*texture;		// Hardware/API texture
 	int		bufw, bufh;		// (0 for fit-to-window)
+	int		bufscale;		// Texture to window scale
 	int		scrollx, scrolly;
 	bool		scrollwrap;
 
@@ -490,6 +526,9 @@ class window_t : public windowbase_t
 
 	int offscreen();
 
+	void cache(bool enable);
+	bool cache()	{ return _cache; }
+
 	// Rendering
 	void bgimage(int bank = -1, int frame = -1);
 
@@ -523,6 +562,18 @@ class window_t : public windowbase_t
 	void blit(int dx, int dy, int sx, int sy, int sw, int sh,
 			window_t *src);
 	void blit(int dx, int dy, window_t *src);
+	void texture_fxp(int _x, int _y, SDL_Texture *tx, int w, int h);
+
+	// Sprite batching
+	//	Between begin_batch() and end_batch(), sprite_fxp() collects
+	//	sprites instead of rendering them right away. Consecutive
+	//	sprites using the same texture (see s_pack_bank()) are drawn
+	//	with a single SDL_RenderGeometry() call. Any other rendering to
+	//	the window flushes the batch first, so the drawing order is
+	//	preserved. Batches must not span rendering to other windows!
+	void begin_batch();
+	void end_batch();
+	void flush_batch();
 
   protected:
 	SDL_Texture	*otexture;	// Buffer for offscreen windows
@@ -535,6 +586,29 @@ class window_t : public windowbase_t
 
 	gfx_offscreen_mode_t	_offscreen;
 
+	bool		_cache;		// Retained mode (see cache())
+	int		cache_w, cache_h;	// Cache texture (otexture) size
+	void render(SDL_Rect *r);
+
+	bool		batching;
+	int		batch_quads;	// Number of sprites in the batch
+	SDL_Texture	*batch_texture;
+	float		batch_tw, batch_th;	// 1 / texture size
+	blendmodes_t	batch_blendmode;
+#ifdef GFX_BATCHING
+	SDL_Vertex	*batch_vertices;
+	int		*batch_indices;
+#endif
+	void batch_sprite(SDL_Texture *tx, SDL_Rect *sr, SDL_Rect *dr);
+
+	// Flush any pending sprites before rendering anything else
+	void check_select()
+	{
+		if(batch_quads)
+			flush_batch();
+		windowbase_t::check_select();
+	}
+
 	void offscreen_invalidate(SDL_Rect *r);
 };
 
@@ -0,0 +1,908 @@
+/*(GPLv2)
+------------------------------------------------------------
+   Kobo Redux - World state keyframes
+------------------------------------------------------------
+ * Copyright 2017 David Olofson
+ *
+ * This program  is free software; you can redistribute it and/or modify it
+ * under the terms  of  the GNU General Public License  as published by the
+ * Free Software Foundation;  either version 2 of the License,  or (at your
+ * option) any later version.
+ *
+ * This program is  distributed  in  the hope that  it will be useful,  but
+ * WITHOUT   ANY   WARRANTY;   without   even   the   implied  warranty  of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * You should have received  a copy of the GNU General Public License along
+ * with this program; if not,  write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "kobo.h"
+#include "kobolog.h"
+#include "keyframe.h"
+#include "myship.h"
+#include "manage.h"
+#include "enemies.h"
+#include "screen.h"
+#include "random.h"
+
+KOBO_keyframe::KOBO_keyframe()
+{
+	next = NULL;
+	nenemies = 0;
+	enemylist = NULL;
+	nmapdiffs = 0;
+	mapdiffs = NULL;
+	firesize = 0;
+	firestate = NULL;
+}
+
+
+KOBO_keyframe::~KOBO_keyframe()
+{
+	free(enemylist);
+	free(mapdiffs);
+	free(firestate);
+}
+
+
+void KOBO_keyframe::compact()
+{
+	free(firestate);
+	firestate = NULL;
+	firesize = 0;
+}
+
+
+/*---------------------------------------------------------------------------
+	Player ship
+---------------------------------------------------------------------------*/
+
+void KOBO_keyframe::record_player()
+{
+	player.state = myship._state;
+	player.shield_timer = myship.shield_timer;
+	player.ctrl = myship.ctrl;
+	player.di = myship.di;
+	player.fdi = myship.fdi;
+	player.x = myship.x;
+	player.y = myship.y;
+	player.vx = myship.vx;
+	player.vy = myship.vy;
+	player.ax = myship.ax;
+	player.ay = myship.ay;
+	player.hitsize = myship.hitsize;
+	player.health = myship._health;
+	player.charge = myship._charge;
+	player.charged_cooltimer = myship.charged_cooltimer;
+	player.blossom_cooltimer = myship.blossom_cooltimer;
+	player.health_time = myship.health_time;
+	player.nose_reload_timer = myship.nose_reload_timer;
+	player.tail_reload_timer = myship.tail_reload_timer;
+	for(int i = 0; i < MAX_BOLTS; ++i)
+	{
+		KOBO_player_bolt *b = &myship.bolts[i];
+		KOBO_kf_bolt *kb = &player.bolts[i];
+		kb->x = b->x;
+		kb->y = b->y;
+		kb->dx = b->dx;
+		kb->dy = b->dy;
+		kb->dir = b->dir;
+		kb->state = b->state;
+	}
+}
+
+
+void KOBO_keyframe::restore_player()
+{
+	// Make sure the gfxengine object matches the dead/alive state
+	if(player.state == SHIP_DEAD)
+		myship.state(SHIP_DEAD);
+	else if(!myship.object)
+		myship.state(SHIP_NORMAL);
+
+	myship._state = (KOBO_myship_state)player.state;
+	myship.shield_timer = player.shield_timer;
+	myship.ctrl = (KOBO_player_controls)player.ctrl;
+	myship.di = player.di;
+	myship.fdi = player.fdi;
+	myship.x = player.x;
+	myship.y = player.y;
+	myship.vx = player.vx;
+	myship.vy = player.vy;
+	myship.ax = player.ax;
+	myship.ay = player.ay;
+	myship.hitsize = player.hitsize;
+	myship._health = player.health;
+	myship._charge = player.charge;
+	myship.charged_cooltimer = player.charged_cooltimer;
+	myship.blossom_cooltimer = player.blossom_cooltimer;
+	myship.health_time = player.health_time;
+	myship.nose_reload_timer = player.nose_reload_timer;
+	myship.tail_reload_timer = player.tail_reload_timer;
+	for(int i = 0; i < MAX_BOLTS; ++i)
+	{
+		KOBO_player_bolt *b = &myship.bolts[i];
+		KOBO_kf_bolt *kb = &player.bolts[i];
+		b->x = kb->x;
+		b->y = kb->y;
+		b->dx = kb->dx;
+		b->dy = kb->dy;
+		b->dir = kb->dir;
+		b->state = kb->state;
+		if(b->state && !b->object)
+		{
+			b->object = gengine->get_obj(LAYER_PLAYER);
+			if(b->object)
+			{
+				cs_obj_show(b->object);
+				cs_obj_hide(b->object);
+			}
+		}
+		else if(!b->state && b->object)
+		{
+			gengine->free_obj(b->object);
+			b->object = NULL;
+		}
+	}
+	myship.bolt_grid_valid = false;
+	myship.restart_sounds();
+	myship.force_position();
+}
+
+
+/*---------------------------------------------------------------------------
+	Enemies
+---------------------------------------------------------------------------*/
+
+bool KOBO_keyframe::record_enemies()
+{
+	ek1 = enemies.ekind_to_generate_1 ?
+			enemies.ekind_to_generate_1->eki : -1;
+	ek2 = enemies.ekind_to_generate_2 ?
+			enemies.ekind_to_generate_2->eki : -1;
+	e1_interval = enemies.e1_interval;
+	e2_interval = enemies.e2_interval;
+	memcpy(enemystats, enemies.stats, sizeof(enemystats));
+
+	nenemies = 0;
+	for(KOBO_enemy *e = NULL; (e = enemies.next(e)); )
+		++nenemies;
+	if(!nenemies)
+		return true;
+
+	enemylist = (KOBO_kf_enemy *)malloc(nenemies * sizeof(KOBO_kf_enemy));
+	if(!enemylist)
+	{
+		nenemies = 0;
+		return false;
+	}
+
+	KOBO_kf_enemy *ke = enemylist;
+	for(KOBO_enemy *e = NULL; (e = enemies.next(e)); ++ke)
+	{
+		ke->kind = e->ek->eki;
+		ke->x = e->x;
+		ke->y = e->y;
+		ke->h = e->h;
+		ke->v = e->v;
+		ke->contact = e->contact;
+		ke->di = e->di;
+		ke->a = e->a;
+		ke->b = e->b;
+		ke->c = e->c;
+		ke->bank = e->logical_bank;
+		ke->frame = e->frame;
+		ke->health = e->health;
+		ke->damage = e->damage;
+		ke->splash_damage = e->splash_damage;
+		ke->diffx = e->diffx;
+		ke->diffy = e->diffy;
+		ke->mindiff = e->mindiff;
+		ke->hitsize = e->hitsize;
+		ke->flags = 0;
+		if(e->takes_splash_damage)
+			ke->flags |= KOBO_KFEF_TAKES_SPLASH_DAMAGE;
+		if(e->shootable)
+			ke->flags |= KOBO_KFEF_SHOOTABLE;
+		if(e->physics)
+			ke->flags |= KOBO_KFEF_PHYSICS;
+		if(e->mapcollide)
+			ke->flags |= KOBO_KFEF_MAPCOLLIDE;
+		if(e->detonate_on_contact)
+			ke->flags |= KOBO_KFEF_DETONATE_ON_CONTACT;
+	}
+	return true;
+}
+
+
+void KOBO_keyframe::restore_enemies()
+{
+	enemies.off();
+
+	// Rebuild the live index in the original order, as that affects the
+	// order of evaluation, and thus, the game logic! The list is recorded
+	// newest first, so we add the enemies in reverse order.
+	for(int i = nenemies - 1; i >= 0; --i)
+	{
+		KOBO_kf_enemy *ke = &enemylist[i];
+		const KOBO_enemy_kind *ek = enemies.enemy_kind(
+				(KOBO_enemy_kinds)ke->kind);
+		if(!ek)
+		{
+			log_printf(ELOG, "KOBO_keyframe::restore(): Illegal "
+					"enemy kind %d!\n", ke->kind);
+			continue;
+		}
+		KOBO_enemy *e = enemies.alloc();
+		e->ek = ek;
+		e->x = ke->x;
+		e->y = ke->y;
+		e->h = ke->h;
+		e->v = ke->v;
+		e->contact = ke->contact;
+		e->di = ke->di;
+		e->a = ke->a;
+		e->b = ke->b;
+		e->c = ke->c;
+		e->set_bank(ke->bank);
+		e->frame = ke->frame;
+		e->health = ke->health;
+		e->damage = ke->damage;
+		e->splash_damage = ke->splash_damage;
+		e->diffx = ke->diffx;
+		e->diffy = ke->diffy;
+		e->mindiff = ke->mindiff;
+		e->hitsize = ke->hitsize;
+		e->takes_splash_damage = ke->flags &
+				KOBO_KFEF_TAKES_SPLASH_DAMAGE;
+		e->shootable = ke->flags & KOBO_KFEF_SHOOTABLE;
+		e->physics = ke->flags & KOBO_KFEF_PHYSICS;
+		e->mapcollide = ke->flags & KOBO_KFEF_MAPCOLLIDE;
+		e->detonate_on_contact = ke->flags &
+				KOBO_KFEF_DETONATE_ON_CONTACT;
+
+		e->soundhandle = 0;
+		if(ek->sound)
+			e->startsound(ek->sound);
+
+		e->object = NULL;
+		if(e->actual_bank >= 0)
+		{
+			e->object = gengine->get_obj(ek->layer);
+			if(e->object)
+			{
+				e->object->point.v.x = e->x;
+				e->object->point.v.y = e->y;
+				cs_point_force(&e->object->point);
+				cs_obj_show(e->object);
+			}
+		}
+
+		enemies.add_live(e);
+	}
+
+	enemies.ekind_to_generate_1 = enemies.enemy_kind(
+			(KOBO_enemy_kinds)ek1);
+	enemies.ekind_to_generate_2 = enemies.enemy_kind(
+			(KOBO_enemy_kinds)ek2);
+	enemies.e1_interval = e1_interval;
+	enemies.e2_interval = e2_interval;
+
+	// NOTE: Must be done last, as off() updates the stats!
+	memcpy(enemies.stats, enemystats, sizeof(enemystats));
+}
+
+
+/*---------------------------------------------------------------------------
+	Stage map
+---------------------------------------------------------------------------*/
+
+#define	KF_MAP_TILES	(MAP_SIZEX * MAP_SIZEY)
+#define	KF_MAP_X(i)	((i) & (MAP_SIZEX - 1))
+#define	KF_MAP_Y(i)	((i) >> MAP_SIZEX_LOG2)
+
+bool KOBO_keyframe::record_map()
+{
+	generate_count = screen.generate_count;
+
+	nmapdiffs = 0;
+	for(int i = 0; i < KF_MAP_TILES; ++i)
+		if(screen.get_map(KF_MAP_X(i), KF_MAP_Y(i)) !=
+				screen.get_initial_map(KF_MAP_X(i), KF_MAP_Y(i)))
+			++nmapdiffs;
+	if(!nmapdiffs)
+		return true;
+
+	mapdiffs = (uint32_t *)malloc(nmapdiffs * sizeof(uint32_t));
+	if(!mapdiffs)
+	{
+		nmapdiffs = 0;
+		return false;
+	}
+
+	uint32_t *md = mapdiffs;
+	for(int i = 0; i < KF_MAP_TILES; ++i)
+	{
+		int n = screen.get_map(KF_MAP_X(i), KF_MAP_Y(i));
+		if(n != screen.get_initial_map(KF_MAP_X(i), KF_MAP_Y(i)))
+			*md++ = (i << 16) | n;
+	}
+	return true;
+}
+
+
+void KOBO_keyframe::restore_map()
+{
+	// Only touch tiles that actually differ, to avoid redrawing the whole
+	// radar map.
+	unsigned d = 0;
+	for(int i = 0; i < KF_MAP_TILES; ++i)
+	{
+		int x = KF_MAP_X(i);
+		int y = KF_MAP_Y(i);
+		int n;
+		if((d < nmapdiffs) && ((int)(mapdiffs[d] >> 16) == i))
+			n = mapdiffs[d++] & 0xffff;
+		else
+			n = screen.get_initial_map(x, y);
+		if(screen.get_map(x, y) != n)
+			screen.set_map(x, y, n);
+	}
+	screen.generate_count = generate_count;
+}
+
+
+/*---------------------------------------------------------------------------
+	Fire/particle effects
+---------------------------------------------------------------------------*/
+
+bool KOBO_keyframe::record_fire()
+{
+	if(!wfire || manage.headless())
+		return true;	// Headless
+	firesize = wfire->SaveParticles(NULL);
+	firestate = (int32_t *)malloc(firesize * sizeof(int32_t));
+	if(!firestate)
+	{
+		firesize = 0;
+		return false;
+	}
+	wfire->SaveParticles(firestate);
+	return true;
+}
+
+
+void KOBO_keyframe::restore_fire()
+{
+	if(!wfire || manage.headless())
+		return;
+	if(firestate)
+		wfire->RestoreParticles(firestate, firesize);
+	else
+		wfire->Clear(false, true);
+}
+
+
+/*---------------------------------------------------------------------------
+	Keyframe record/restore
+---------------------------------------------------------------------------*/
+
+bool KOBO_keyframe::record()
+{
+	frame = manage.game_time();
+	seed = gamerand.get_seed();
+	score = manage.current_score();
+	remaining_cores = manage.cores_remaining();
+	record_player();
+	if(!record_map() || !record_enemies())
+	{
+		log_printf(ELOG, "OOM in KOBO_keyframe::record()!\n");
+		return false;
+	}
+	if(!record_fire())
+		log_printf(WLOG, "Could not record fire state in keyframe!\n");
+	return true;
+}
+
+
+void KOBO_keyframe::restore()
+{
+	// Keyframes are only recorded while playing, so if we're restoring one
+	// after the player died, we're effectively rewinding to before that.
+	if(manage.gamestate != GS_PLAYING)
+	{
+		manage.state(GS_PLAYING);
+		manage.delay_count = 0;
+	}
+	manage.playtime = frame;
+	manage.score = score;
+	manage.score_changed = true;
+	manage.remaining_cores = remaining_cores;
+	gamerand.set_seed(seed);
+	restore_map();
+	restore_enemies();
+	restore_player();
+	restore_fire();
+}
+
+
+/*---------------------------------------------------------------------------
+	Keyframe comparison (desync debugging)
+---------------------------------------------------------------------------*/
+
+static unsigned kf_diff(int level, const char *desc, int i, const char *desc2,
+		int32_t ref, int32_t current)
+{
+	if(ref == current)
+		return 0;
+	if(level < 0)
+		return 1;
+	char buf[64];
+	if(i >= 0)
+		snprintf(buf, sizeof(buf), "%s[%d]%s", desc, i, desc2);
+	else
+		snprintf(buf, sizeof(buf), "%s%s", desc, desc2);
+	log_printf(level, "  %s: %d -> %d\n", buf, ref, current);
+	return 1;
+}
+
+
+unsigned KOBO_keyframe::diff_player(const KOBO_keyframe *ref, int level)
+{
+	unsigned n = 0;
+#define	KF_DIFF(x)	n += kf_diff(level, "player", -1, "." #x, \
+				ref->player.x, player.x);
+	KF_DIFF(state)
+	KF_DIFF(shield_timer)
+	KF_DIFF(ctrl)
+	KF_DIFF(di)
+	KF_DIFF(x)
+	KF_DIFF(y)
+	KF_DIFF(vx)
+	KF_DIFF(vy)
+	KF_DIFF(ax)
+	KF_DIFF(ay)
+	KF_DIFF(health)
+	KF_DIFF(charge)
+	KF_DIFF(charged_cooltimer)
+	KF_DIFF(blossom_cooltimer)
+	KF_DIFF(health_time)
+	KF_DIFF(nose_reload_timer)
+	KF_DIFF(tail_reload_timer)
+#undef	KF_DIFF
+	for(int i = 0; i < MAX_BOLTS; ++i)
+	{
+		const KOBO_kf_bolt *rb = &ref->player.bolts[i];
+		const KOBO_kf_bolt *b = &player.bolts[i];
+		if(!rb->state && !b->state)
+			continue;	// Unused in both
+#define	KF_DIFF(x)	n += kf_diff(level, "bolt", i, "." #x, \
+				rb->x, b->x);
+		KF_DIFF(state)
+		KF_DIFF(x)
+		KF_DIFF(y)
+		KF_DIFF(dx)
+		KF_DIFF(dy)
+		KF_DIFF(dir)
+#undef	KF_DIFF
+	}
+	return n;
+}
+
+
+// Enemies are compared in list order, skipping effects, as those may differ
+// between themes. Any difference in the number of enemies is reported, and the
+// extra enemies at the end of the longer list are listed.
+unsigned KOBO_keyframe::diff_enemies(const KOBO_keyframe *ref, int level)
+{
+	unsigned n = 0;
+	for(int i = 0; i < KOBO_EK__COUNT; ++i)
+	{
+		KOBO_enemy_kinds eki = (KOBO_enemy_kinds)i;
+		if(enemies.is_effect(eki))
+			continue;
+		const char *ename = enemies.enemy_name(eki);
+		const KOBO_enemystats *rs = &ref->enemystats[i];
+		const KOBO_enemystats *s = &enemystats[i];
+		n += kf_diff(level, ename, -1, ".spawned", rs->spawned,
+				s->spawned);
+		n += kf_diff(level, ename, -1, ".killed", rs->killed,
+				s->killed);
+		n += kf_diff(level, ename, -1, ".health", rs->health,
+				s->health);
+		n += kf_diff(level, ename, -1, ".damage", rs->damage,
+				s->damage);
+	}
+	n += kf_diff(level, "ek1", -1, "", ref->ek1, ek1);
+	n += kf_diff(level, "ek2", -1, "", ref->ek2, ek2);
+	n += kf_diff(level, "e1_interval", -1, "", ref->e1_interval,
+			e1_interval);
+	n += kf_diff(level, "e2_interval", -1, "", ref->e2_interval,
+			e2_interval);
+
+	unsigned ri = 0, ci = 0, ei = 0;
+	while(1)
+	{
+		while((ri < ref->nenemies) && enemies.is_effect(
+				(KOBO_enemy_kinds)ref->enemylist[ri].kind))
+			++ri;
+		while((ci < nenemies) && enemies.is_effect(
+				(KOBO_enemy_kinds)enemylist[ci].kind))
+			++ci;
+		if((ri >= ref->nenemies) || (ci >= nenemies))
+			break;
+		const KOBO_kf_enemy *re = &ref->enemylist[ri++];
+		const KOBO_kf_enemy *e = &enemylist[ci++];
+		if(re->kind != e->kind)
+		{
+			if(level >= 0)
+				log_printf(level, "  enemy[%d]: %s -> %s\n", ei,
+						enemies.enemy_name(
+						(KOBO_enemy_kinds)re->kind),
+						enemies.enemy_name(
+						(KOBO_enemy_kinds)e->kind));
+			return n + 1;	// Lists out of sync; give up!
+		}
+#define	KF_DIFF(x)	n += kf_diff(level, "enemy", ei, "." #x, \
+				re->x, e->x);
+		KF_DIFF(x)
+		KF_DIFF(y)
+		KF_DIFF(h)
+		KF_DIFF(v)
+		KF_DIFF(a)
+		KF_DIFF(b)
+		KF_DIFF(c)
+		KF_DIFF(contact)
+		KF_DIFF(health)
+		KF_DIFF(damage)
+		KF_DIFF(splash_damage)
+		KF_DIFF(flags)
+#undef	KF_DIFF
+		++ei;
+	}
+	for( ; ri < ref->nenemies; ++ri)
+	{
+		const KOBO_kf_enemy *re = &ref->enemylist[ri];
+		if(enemies.is_effect((KOBO_enemy_kinds)re->kind))
+			continue;
+		if(level >= 0)
+			log_printf(level, "  enemy[%d]: %s at (%d, %d) -> "
+					"<none>\n", ei, enemies.enemy_name(
+					(KOBO_enemy_kinds)re->kind),
+					re->x, re->y);
+		++ei;
+		++n;
+	}
+	for( ; ci < nenemies; ++ci)
+	{
+		const KOBO_kf_enemy *e = &enemylist[ci];
+		if(enemies.is_effect((KOBO_enemy_kinds)e->kind))
+			continue;
+		if(level >= 0)
+			log_printf(level, "  enemy[%d]: <none> -> %s at "
+					"(%d, %d)\n", ei, enemies.enemy_name(
+					(KOBO_enemy_kinds)e->kind),
+					e->x, e->y);
+		++ei;
+		++n;
+	}
+	return n;
+}
+
+
+unsigned KOBO_keyframe::diff_map(const KOBO_keyframe *ref, int level)
+{
+	unsigned n = kf_diff(level, "generate_count", -1, "",
+			ref->generate_count, generate_count);
+	unsigned rd = 0, cd = 0;
+	while((rd < ref->nmapdiffs) || (cd < nmapdiffs))
+	{
+		int ri = rd < ref->nmapdiffs ? ref->mapdiffs[rd] >> 16 :
+				KF_MAP_TILES;
+		int ci = cd < nmapdiffs ? mapdiffs[cd] >> 16 : KF_MAP_TILES;
+		int i = ri < ci ? ri : ci;
+		int x = KF_MAP_X(i);
+		int y = KF_MAP_Y(i);
+		int rn = ri == i ? ref->mapdiffs[rd++] & 0xffff :
+				screen.get_initial_map(x, y);
+		int cn = ci == i ? mapdiffs[cd++] & 0xffff :
+				screen.get_initial_map(x, y);
+		if(rn != cn)
+		{
+			if(level >= 0)
+				log_printf(level, "  map(%d, %d): %4.4x -> "
+						"%4.4x\n", x, y, rn, cn);
+			++n;
+		}
+	}
+	return n;
+}
+
+
+unsigned KOBO_keyframe::diff(const KOBO_keyframe *ref, int level)
+{
+	unsigned n = 0;
+	n += kf_diff(level, "seed", -1, "", ref->seed, seed);
+	n += kf_diff(level, "score", -1, "", ref->score, score);
+	n += kf_diff(level, "remaining_cores", -1, "", ref->remaining_cores,
+			remaining_cores);
+	n += diff_player(ref, level);
+	n += diff_enemies(ref, level);
+	n += diff_map(ref, level);
+	return n;
+}
+
+
+/*---------------------------------------------------------------------------
+	Keyframe save/load
+---------------------------------------------------------------------------*/
+
+void KOBO_keyframe::save_player(pfile_t *pf)
+{
+	pf->write(player.state);
+	pf->write(player.shield_timer);
+	pf->write(player.ctrl);
+	pf->write(player.di);
+	pf->write(player.fdi);
+	pf->write(player.x);
+	pf->write(player.y);
+	pf->write(player.vx);
+	pf->write(player.vy);
+	pf->write(player.ax);
+	pf->write(player.ay);
+	pf->write(player.hitsize);
+	pf->write(player.health);
+	pf->write(player.charge);
+	pf->write(player.charged_cooltimer);
+	pf->write(player.blossom_cooltimer);
+	pf->write(player.health_time);
+	pf->write(player.nose_reload_timer);
+	pf->write(player.tail_reload_timer);
+
+	// Only active bolts are saved, but we need to keep the indices, as
+	// they affect the order in which bolts hit things.
+	int32_t nbolts = 0;
+	for(int i = 0; i < MAX_BOLTS; ++i)
+		if(player.bolts[i].state)
+			++nbolts;
+	pf->write(nbolts);
+	for(int32_t i = 0; i < MAX_BOLTS; ++i)
+	{
+		KOBO_kf_bolt *kb = &player.bolts[i];
+		if(!kb->state)
+			continue;
+		pf->write(i);
+		pf->write(kb->x);
+		pf->write(kb->y);
+		pf->write(kb->dx);
+		pf->write(kb->dy);
+		pf->write(kb->dir);
+		pf->write(kb->state);
+	}
+}
+
+
+bool KOBO_keyframe::load_player(pfile_t *pf)
+{
+	pf->read(player.state);
+	pf->read(player.shield_timer);
+	pf->read(player.ctrl);
+	pf->read(player.di);
+	pf->read(player.fdi);
+	pf->read(player.x);
+	pf->read(player.y);
+	pf->read(player.vx);
+	pf->read(player.vy);
+	pf->read(player.ax);
+	pf->read(player.ay);
+	pf->read(player.hitsize);
+	pf->read(player.health);
+	pf->read(player.charge);
+	pf->read(player.charged_cooltimer);
+	pf->read(player.blossom_cooltimer);
+	pf->read(player.health_time);
+	pf->read(player.nose_reload_timer);
+	pf->read(player.tail_reload_timer);
+
+	memset(player.bolts, 0, sizeof(player.bolts));
+	int32_t nbolts = 0;
+	pf->read(nbolts);
+	if((nbolts < 0) || (nbolts > MAX_BOLTS))
+		return false;
+	for(int i = 0; i < nbolts; ++i)
+	{
+		int32_t bi = -1;
+		pf->read(bi);
+		if((bi < 0) || (bi >= MAX_BOLTS))
+			return false;
+		KOBO_kf_bolt *kb = &player.bolts[bi];
+		pf->read(kb->x);
+		pf->read(kb->y);
+		pf->read(kb->dx);
+		pf->read(kb->dy);
+		pf->read(kb->dir);
+		pf->read(kb->state);
+	}
+	return true;
+}
+
+
+void KOBO_keyframe::save_enemies(pfile_t *pf)
+{
+	pf->write(ek1);
+	pf->write(ek2);
+	pf->write(e1_interval);
+	pf->write(e2_interval);
+
+	pf->write((uint32_t)KOBO_EK__COUNT);
+	for(int i = 0; i < KOBO_EK__COUNT; ++i)
+	{
+		pf->write(enemystats[i].spawned);
+		pf->write(enemystats[i].killed);
+		pf->write(enemystats[i].health);
+		pf->write(enemystats[i].damage);
+	}
+
+	pf->write((uint32_t)nenemies);
+	KOBO_kf_enemy *ke = enemylist;
+	for(unsigned i = 0; i < nenemies; ++i, ++ke)
+	{
+		pf->write(ke->kind);
+		pf->write(ke->x);
+		pf->write(ke->y);
+		pf->write(ke->h);
+		pf->write(ke->v);
+		pf->write(ke->contact);
+		pf->write(ke->di);
+		pf->write(ke->a);
+		pf->write(ke->b);
+		pf->write(ke->c);
+		pf->write(ke->bank);
+		pf->write(ke->frame);
+		pf->write(ke->health);
+		pf->write(ke->damage);
+		pf->write(ke->splash_damage);
+		pf->write(ke->diffx);
+		pf->write(ke->diffy);
+		pf->write(ke->mindiff);
+		pf->write(ke->hitsize);
+		pf->write(ke->flags);
+	}
+}
+
+
+bool KOBO_keyframe::load_enemies(pfile_t *pf)
+{
+	pf->read(ek1);
+	pf->read(ek2);
+	pf->read(e1_interval);
+	pf->read(e2_interval);
+
+	uint32_t ekc = 0;
+	pf->read(ekc);
+	if(ekc != KOBO_EK__COUNT)
+		return false;
+	for(int i = 0; i < KOBO_EK__COUNT; ++i)
+	{
+		pf->read(enemystats[i].spawned);
+		pf->read(enemystats[i].killed);
+		pf->read(enemystats[i].health);
+		pf->read(enemystats[i].damage);
+	}
+
+	uint32_t ne = 0;
+	pf->read(ne);
+	if(pf->status() || (ne > (uint32_t)pf->chunk_size()))
+		return false;	// Corrupt data; don't try to allocate that!
+	if(!ne)
+		return true;
+
+	enemylist = (KOBO_kf_enemy *)malloc(ne * sizeof(KOBO_kf_enemy));
+	if(!enemylist)
+		return false;
+	nenemies = ne;
+
+	KOBO_kf_enemy *ke = enemylist;
+	for(unsigned i = 0; i < nenemies; ++i, ++ke)
+	{
+		pf->read(ke->kind);
+		pf->read(ke->x);
+		pf->read(ke->y);
+		pf->read(ke->h);
+		pf->read(ke->v);
+		pf->read(ke->contact);
+		pf->read(ke->di);
+		pf->read(ke->a);
+		pf->read(ke->b);
+		pf->read(ke->c);
+		pf->read(ke->bank);
+		pf->read(ke->frame);
+		pf->read(ke->health);
+		pf->read(ke->damage);
+		pf->read(ke->splash_damage);
+		pf->read(ke->diffx);
+		pf->read(ke->diffy);
+		pf->read(ke->mindiff);
+		pf->read(ke->hitsize);
+		pf->read(ke->flags);
+		if((ke->kind < 0) || (ke->kind >= KOBO_EK__COUNT))
+			return false;
+	}
+	return true;
+}
+
+
+void KOBO_keyframe::save_map(pfile_t *pf)
+{
+	pf->write(generate_count);
+	pf->write((uint32_t)nmapdiffs);
+	for(unsigned i = 0; i < nmapdiffs; ++i)
+		pf->write(mapdiffs[i]);
+}
+
+
+bool KOBO_keyframe::load_map(pfile_t *pf)
+{
+	pf->read(generate_count);
+
+	uint32_t nd = 0;
+	pf->read(nd);
+	if(pf->status() || (nd > KF_MAP_TILES))
+		return false;
+	if(!nd)
+		return true;
+
+	mapdiffs = (uint32_t *)malloc(nd * sizeof(uint32_t));
+	if(!mapdiffs)
+		return false;
+	nmapdiffs = nd;
+
+	for(unsigned i = 0; i < nmapdiffs; ++i)
+	{
+		pf->read(mapdiffs[i]);
+		if((mapdiffs[i] >> 16) >= KF_MAP_TILES)
+			return false;
+		if(i && ((mapdiffs[i] >> 16) <= (mapdiffs[i - 1] >> 16)))
+			return false;	// Must be in map order!
+	}
+	return true;
+}
+
+
+bool KOBO_keyframe::save(pfile_t *pf)
+{
+	pf->chunk_write(KOBO_PF_KFRM_4CC, KOBO_PF_KFRM_VERSION);
+
+	pf->write(frame);
+	pf->write(seed);
+	pf->write(score);
+	pf->write(remaining_cores);
+	save_player(pf);
+	save_enemies(pf);
+	save_map(pf);
+
+	pf->chunk_end();
+	return !pf->status();
+}
+
+
+bool KOBO_keyframe::load(pfile_t *pf)
+{
+	if(pf->chunk_version() != KOBO_PF_KFRM_VERSION)
+	{
+		pf->chunk_end();
+		return false;
+	}
+
+	pf->read(frame);
+	pf->read(seed);
+	pf->read(score);
+	pf->read(remaining_cores);
+	bool ok = load_player(pf) && load_enemies(pf) && load_map(pf);
+
+	pf->chunk_end();
+	return ok && !pf->status();
+}
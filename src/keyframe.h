@@ -0,0 +1,166 @@
+/*(GPLv2)
+------------------------------------------------------------
+   Kobo Redux - World state keyframes
+------------------------------------------------------------
+ * Copyright 2017 David Olofson
+ *
+ * This program  is free software; you can redistribute it and/or modify it
+ * under the terms  of  the GNU General Public License  as published by the
+ * Free Software Foundation;  either version 2 of the License,  or (at your
+ * option) any later version.
+ *
+ * This program is  distributed  in  the hope that  it will be useful,  but
+ * WITHOUT   ANY   WARRANTY;   without   even   the   implied  warranty  of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ * Public License for more details.
+ *
+ * You should have received  a copy of the GNU General Public License along
+ * with this program; if not,  write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * A keyframe is a full snapshot of the game logic state at the end of a logic
+ * frame, taken at regular intervals while a replay is recorded or played back.
+ * Restoring a keyframe right after _manage::init_game() brings the world to
+ * the exact same state as stepping the replay from the start of the stage up
+ * to that frame, so rewind and bookmark skips only need to step the remaining
+ * frames from the closest keyframe.
+ *
+ * Keyframes also cover the fire/particle effects, so that restoring one does
+ * not cause visible glitches, even though those don't affect the game logic.
+ *
+ * Keyframes are saved to campaign files as KFRM chunks, following the REPH
+ * chunk of the replay they belong to. The fire state is not saved, and the map
+ * is stored as a list of changes to the initial stage map, to keep the files
+ * reasonably small.
+ */
+
+#ifndef	_KOBO_KEYFRAME_H_
+#define	_KOBO_KEYFRAME_H_
+
+#include "config.h"
+#include "game.h"
+#include "pfile.h"
+#include "enemies.h"
+
+// World state keyframe
+#define	KOBO_PF_KFRM_4CC	MAKE_4CC('K', 'F', 'R', 'M')
+#define	KOBO_PF_KFRM_VERSION	1
+
+// Enemy state. (Everything but gfxengine objects and sound handles.)
+struct KOBO_kf_enemy
+{
+	int32_t		kind;		// KOBO_enemy_kinds
+	int32_t		x, y;
+	int32_t		h, v;
+	int32_t		contact;
+	int32_t		di;
+	int32_t		a, b, c;
+	int32_t		bank;		// Logical bank
+	int32_t		frame;
+	int32_t		health;
+	int32_t		damage;
+	int32_t		splash_damage;
+	int32_t		diffx, diffy, mindiff;
+	int32_t		hitsize;
+	uint32_t	flags;		// KOBO_KFEF_*
+};
+
+#define	KOBO_KFEF_TAKES_SPLASH_DAMAGE	0x00000001
+#define	KOBO_KFEF_SHOOTABLE		0x00000002
+#define	KOBO_KFEF_PHYSICS		0x00000004
+#define	KOBO_KFEF_MAPCOLLIDE		0x00000008
+#define	KOBO_KFEF_DETONATE_ON_CONTACT	0x00000010
+
+// Player bolt state
+struct KOBO_kf_bolt
+{
+	int32_t		x, y;
+	int32_t		dx, dy;
+	int32_t		dir, state;
+};
+
+class KOBO_keyframe
+{
+	// Player ship
+	struct {
+		int32_t		state;		// KOBO_myship_state
+		int32_t		shield_timer;
+		int32_t		ctrl;		// KOBO_player_controls
+		int32_t		di, fdi;
+		int32_t		x, y;
+		int32_t		vx, vy;
+		int32_t		ax, ay;
+		int32_t		hitsize;
+		int32_t		health;
+		int32_t		charge;
+		int32_t		charged_cooltimer;
+		int32_t		blossom_cooltimer;
+		int32_t		health_time;
+		int32_t		nose_reload_timer;
+		int32_t		tail_reload_timer;
+		KOBO_kf_bolt	bolts[MAX_BOLTS];
+	} player;
+
+	// Enemies, in list order
+	int32_t		ek1, ek2;	// KOBO_enemy_kinds, or -1
+	int32_t		e1_interval, e2_interval;
+	KOBO_enemystats	enemystats[KOBO_EK__COUNT];
+	unsigned	nenemies;
+	KOBO_kf_enemy	*enemylist;
+
+	// Stage map changes and enemy wave generator
+	unsigned	nmapdiffs;
+	uint32_t	*mapdiffs;	// (index << 16) | tile, in map order
+	int32_t		generate_count;
+
+	// Fire/particle effects (KOBO_Fire::SaveParticles() format)
+	unsigned	firesize;
+	int32_t		*firestate;
+
+	void record_player();
+	void restore_player();
+	bool record_enemies();
+	void restore_enemies();
+	bool record_map();
+	void restore_map();
+	bool record_fire();
+	void restore_fire();
+
+	unsigned diff_player(const KOBO_keyframe *ref, int level);
+	unsigned diff_enemies(const KOBO_keyframe *ref, int level);
+	unsigned diff_map(const KOBO_keyframe *ref, int level);
+
+	void save_player(pfile_t *pf);
+	bool load_player(pfile_t *pf);
+	void save_enemies(pfile_t *pf);
+	bool load_enemies(pfile_t *pf);
+	void save_map(pfile_t *pf);
+	bool load_map(pfile_t *pf);
+  public:
+	KOBO_keyframe();
+	~KOBO_keyframe();
+
+	bool record();
+	void restore();
+
+	// Drop data that is not needed for the game logic (fire state)
+	void compact();
+
+	// Log field-by-field differences from 'ref' as "ref -> this", or just
+	// count them if 'level' is negative. Returns the number of differences.
+	unsigned diff(const KOBO_keyframe *ref, int level);
+
+	bool save(pfile_t *pf);
+	bool load(pfile_t *pf);
+
+	KOBO_keyframe	*next;
+
+	uint32_t	frame;		// Logic frames played when recorded
+	uint32_t	seed;		// gamerand state
+	uint32_t	score;
+	int32_t		remaining_cores;
+};
+
+#endif /* _KOBO_KEYFRAME_H_ */
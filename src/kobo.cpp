@@ -330,6 +330,192 @@ void KOBO_main::print_fps_results()
 }
 
 
+// Replay verification job (-verifyreplays)
+struct KOBO_verify_job
+{
+	const char		*name;		// Campaign/demo name
+	KOBO_replay		*replay;
+	KOBO_verify_stats	stats;
+};
+
+static std::vector<KOBO_verify_job> verify_jobs;
+static SDL_atomic_t verify_next_job;
+
+
+static void add_verify_jobs(KOBO_campaign *cmp, const char *name)
+{
+	if(!cmp || cmp->empty())
+		return;
+
+	if(cmp->compatibility() != KOBO_RPCOM_FULL)
+	{
+		log_printf(WLOG, "%s: Incompatible campaign; skipped.\n", name);
+		return;
+	}
+
+	for(int i = 1; i <= cmp->last_stage(); ++i)
+	{
+		KOBO_verify_job job;
+		job.name = name;
+		job.replay = cmp->get_replay(i);
+		memset(&job.stats, 0, sizeof(job.stats));
+		if(job.replay)
+			verify_jobs.push_back(job);
+	}
+}
+
+
+// Grab and run jobs until there are none left. As each thread has its own game
+// logic state, any number of these can run in parallel.
+static int verify_thread(void *data)
+{
+	pubrand.init();
+	game.reset();
+	while(1)
+	{
+		int j = SDL_AtomicAdd(&verify_next_job, 1);
+		if(j >= (int)verify_jobs.size())
+			return 0;
+		manage.verify_replay(verify_jobs[j].replay,
+				verify_jobs[j].stats);
+	}
+}
+
+
+// Load all campaigns and demos, and queue their replays for verification
+static void add_all_verify_jobs()
+{
+	// Make sure we load and verify game state snapshots!
+	prefs->replaydebug = 1;
+
+	static char names[KOBO_MAX_CAMPAIGN_SLOTS * 2][32];
+	savemanager.load(-1);
+	savemanager.load_demos();
+	for(int i = 0; i < KOBO_MAX_CAMPAIGN_SLOTS; ++i)
+	{
+		snprintf(names[i], sizeof(names[i]), "Campaign slot %d", i);
+		add_verify_jobs(savemanager.campaign(i), names[i]);
+	}
+	for(int i = 0; i < KOBO_MAX_CAMPAIGN_SLOTS; ++i)
+	{
+		char *n = names[KOBO_MAX_CAMPAIGN_SLOTS + i];
+		snprintf(n, sizeof(names[0]), "Demo %d", i);
+		add_verify_jobs(savemanager.demo(i), n);
+	}
+}
+
+
+// Headless verification of all campaign and demo replays, using one thread per
+// CPU core. Returns the number of replays that failed verification.
+int KOBO_main::verify_replays()
+{
+	add_all_verify_jobs();
+
+	int nthreads = SDL_GetCPUCount();
+	if(nthreads > (int)verify_jobs.size())
+		nthreads = verify_jobs.size();
+	if(nthreads < 1)
+		nthreads = 1;
+	log_printf(ULOG, "Verifying %d replays using %d threads...\n",
+			(int)verify_jobs.size(), nthreads);
+
+	// Extra worker threads, and one job loop right here
+	Uint32 start = SDL_GetTicks();
+	SDL_AtomicSet(&verify_next_job, 0);
+	std::vector<SDL_Thread *> threads;
+	for(int i = 1; i < nthreads; ++i)
+	{
+		SDL_Thread *t = SDL_CreateThread(verify_thread, "Verify",
+				NULL);
+		if(t)
+			threads.push_back(t);
+		else
+			log_printf(WLOG, "Could not create verification "
+					"thread: %s\n", SDL_GetError());
+	}
+	verify_thread(NULL);
+	for(unsigned i = 0; i < threads.size(); ++i)
+		SDL_WaitThread(threads[i], NULL);
+	Uint32 duration = SDL_GetTicks() - start;
+
+	// Report, in campaign and stage order
+	KOBO_verify_stats vs;
+	memset(&vs, 0, sizeof(vs));
+	const char *lastname = NULL;
+	for(unsigned i = 0; i < verify_jobs.size(); ++i)
+	{
+		KOBO_verify_job &job = verify_jobs[i];
+		if(job.name != lastname)
+			log_printf(ULOG, "%s:\n", job.name);
+		lastname = job.name;
+		if(job.stats.skipped)
+			log_printf(WLOG, "  Stage %d: Incompatible or too "
+					"short replay; skipped.\n",
+					job.replay->stage);
+		else
+			log_printf(job.stats.failed ? ELOG : ULOG,
+					"  Stage %d: %d frames, %d hashed, "
+					"%d/%d states OK%s\n",
+					job.replay->stage,
+					job.stats.frames, job.stats.hashes,
+					job.stats.states - job.stats.diffs,
+					job.stats.states,
+					job.stats.failed ? " FAILED!" : "");
+		if(job.stats.desyncs)
+			log_printf(ELOG, "    Desync in frame %d!\n",
+					job.replay->desync_frame);
+		vs.replays += job.stats.replays;
+		vs.skipped += job.stats.skipped;
+		vs.failed += job.stats.failed;
+		vs.frames += job.stats.frames;
+		vs.states += job.stats.states;
+		vs.diffs += job.stats.diffs;
+		vs.hashes += job.stats.hashes;
+		vs.desyncs += job.stats.desyncs;
+	}
+	verify_jobs.clear();
+
+	log_printf(ULOG, "----------------------------------------\n");
+	log_printf(ULOG, "Replays: %d verified, %d failed, %d skipped\n",
+			vs.replays, vs.failed, vs.skipped);
+	log_printf(ULOG, "States:  %d verified, %d failed\n",
+			vs.states, vs.diffs);
+	log_printf(ULOG, "Hashes:  %d frames verified, %d desyncs\n",
+			vs.hashes, vs.desyncs);
+	log_printf(ULOG, "Frames:  %d in %.2f s (%.0f fps)\n", vs.frames,
+			duration * 0.001f,
+			duration ? vs.frames * 1000.0f / duration : 0.0f);
+	log_printf(ULOG, "----------------------------------------\n");
+	return vs.failed;
+}
+
+
+// Headless desync bisection of all campaign and demo replays. This is done one
+// replay at a time, to keep the logs readable. Returns the number of replays
+// that desync.
+int KOBO_main::bisect_replays()
+{
+	add_all_verify_jobs();
+	int desyncs = 0;
+	const char *lastname = NULL;
+	for(unsigned i = 0; i < verify_jobs.size(); ++i)
+	{
+		KOBO_verify_job &job = verify_jobs[i];
+		if(job.name != lastname)
+			log_printf(ULOG, "%s:\n", job.name);
+		lastname = job.name;
+		log_printf(ULOG, " Stage %d:\n", job.replay->stage);
+		if(manage.bisect_replay(job.replay) >= 0)
+			++desyncs;
+	}
+	verify_jobs.clear();
+	log_printf(ULOG, "----------------------------------------\n");
+	log_printf(ULOG, "%d replays desync.\n", desyncs);
+	log_printf(ULOG, "----------------------------------------\n");
+	return desyncs;
+}
+
+
 bool KOBO_main::escape_hammering()
 {
 	Uint32 nt = SDL_GetTicks();
@@ -957,6 +1143,8 @@ int KOBO_main::init_display(prefs_t *p)
 
 void KOBO_main::close_display()
 {
+	screen.close_graphics();
+
 	delete pfxt_symname;	pfxt_symname = NULL;
 	delete pfxt_hotkeys;	pfxt_hotkeys = NULL;
 
@@ -1425,6 +1613,7 @@ static void kobo_render_highlight(ct_widget_t *wg)
 
 int KOBO_main::open()
 {
+	game.reset();
 	if(init_display(prefs) < 0)
 		return -1;
 
@@ -1527,6 +1716,7 @@ int KOBO_main::restart_video()
 {
 	log_printf(ULOG, "--- Restarting video...\n");
 	wdash->mode(DASHBOARD_BLACK);
+	screen.close_graphics();
 	gengine->hide();
 	close_display();
 	gengine->unload();
@@ -2379,6 +2569,11 @@ void kobo_gfxengine_t::input(float fractional_frame)
 				break;
 			}
 			break;
+		  case SDL_RENDER_TARGETS_RESET:
+			// Contents of target textures lost
+			KOBO_screen::invalidate_bases();
+			invalidate_windows();
+			break;
 		  case SDL_QUIT:
 			km.quit();
 			break;
@@ -2620,6 +2815,13 @@ void kobo_gfxengine_t::post_render()
 	{
 		char buf[40];
 		woverlay->font(B_SMALL_FONT);
+		wfire->Sync();	// The profilers may be in use by an async job
+
+		snprintf(buf, sizeof(buf), "Peak PS:\t%d/%d\t%u kB",
+				wfire->StatPSystemsPeak(),
+				wfire->StatParticlesPeak(),
+				wfire->StatArenaSize() / 1024);
+		woverlay->string(4, DASHH(MAIN) - 60, buf);
 
 		woverlay->string(4, DASHH(MAIN) - 50,
 				"FireFX\tms/frame\tsamples");
@@ -3065,6 +3267,20 @@ int main(int argc, char *argv[])
 		savemanager.resave_all();
 	}
 
+	if(prefs->cmd_verifyreplays)
+	{
+		int failed = km.verify_replays();
+		main_cleanup();
+		return failed ? 1 : 0;
+	}
+
+	if(prefs->cmd_bisectreplays)
+	{
+		int desyncs = km.bisect_replays();
+		main_cleanup();
+		return desyncs ? 1 : 0;
+	}
+
 	km.discover_themes();
 	km.list_themes();
 
@@ -245,6 +245,9 @@ class KOBO_main
 
 	static void print_fps_results();
 
+	static int verify_replays();
+	static int bisect_replays();
+
 	static void place(windowbase_t *w, KOBO_TD_Items td);
 
 	static void set_stagemessage(int stage, const char *hdr,
@@ -80,6 +80,7 @@ typedef struct
 static LOG_level *l_levels = NULL;
 static LOG_target *l_targets = NULL;
 static char *l_buffer = NULL;
+static SDL_mutex *l_mutex = NULL;	/* For l_buffer and the targets */
 
 Uint32 start_time = 0;
 
@@ -368,6 +369,12 @@ int log_open(int flags)
 		log_close();
 		return -3;
 	}
+	l_mutex = SDL_CreateMutex();
+	if(!l_mutex)
+	{
+		log_close();
+		return -4;
+	}
 
 	log_set_target_stream(-1, stdout);
 	log_set_target_flags(-1, 0);
@@ -398,6 +405,9 @@ void log_close(void)
 	l_levels = NULL;
 	free(l_buffer);
 	l_buffer = NULL;
+	if(l_mutex)
+		SDL_DestroyMutex(l_mutex);
+	l_mutex = NULL;
 }
 
 
@@ -519,14 +529,18 @@ static inline int log_print(int level, const char *text)
 
 int log_puts(int level, const char *text)
 {
+	int result;
 	if(CHECK_INIT < 0)
 	{
 		fputs(text, stderr);
 		fputs("\n[Logging not yet initialized!]\n", stderr);
 		return -1;
 	}
+	SDL_LockMutex(l_mutex);
 	snprintf(l_buffer, LOG_BUFFER - 1, "%s\n", text);
-	return log_print(level, l_buffer);
+	result = log_print(level, l_buffer);
+	SDL_UnlockMutex(l_mutex);
+	return result;
 }
 
 
@@ -550,11 +564,14 @@ int log_printf(int level, const char *format, ...)
 	if(!level_is_active(level))
 		return 0;
 
+	SDL_LockMutex(l_mutex);
 	va_start(args, format);
 	result = vsnprintf(l_buffer, LOG_BUFFER - 1, format, args);
 	va_end(args);
 	if(result > 0)
-		return log_print(level, l_buffer);
+		result = log_print(level, l_buffer);
 	else
-		return 0;
+		result = 0;
+	SDL_UnlockMutex(l_mutex);
+	return result;
 }
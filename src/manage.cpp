@@ -43,71 +43,74 @@
 #include "gamectl.h"
 #include "states.h"
 #include "random.h"
+#include "keyframe.h"
+#include "mathutil.h"
 
 #define GIGA             1000000000
 
-KOBO_gamestates _manage::gamestate = GS_NONE;
-KOBO_replaymodes _manage::replaymode = RPM_NONE;
-bool _manage::demo_mode = false;
-bool _manage::is_paused = false;
-Uint32 _manage::transition_timeout = 0;
-
-int _manage::delayed_stage = -1;
-KOBO_gamestates _manage::delayed_gamestate = GS_NONE;
-bool _manage::delayed_demo = false;
-
-int _manage::retry_skip = 0;
-bool _manage::retry_rewind = false;
-
-KOBO_campaign *_manage::campaign = NULL;
-KOBO_replay *_manage::replay = NULL;
-bool _manage::owns_replay = false;
-KOBO_player_controls _manage::lastctrl = KOBO_PC_FIRE;
-unsigned _manage::ctrltimer = 0;
-int _manage::valid_replays = 0;
-
-bool _manage::in_background = false;
-bool _manage::player_ready_armed = false;
-bool _manage::player_is_ready = false;
-bool _manage::show_bars = false;
-float _manage::disp_health;
-float _manage::disp_charge;
-int _manage::flash_score_count = 0;
-bool _manage::score_changed = true;
-int _manage::intro_x = TILE_SIZEX * (64 - 18);
-int _manage::intro_y = TILE_SIZEY * (64 - 7);
-
-int _manage::game_seed;
-int _manage::total_cores;
-int _manage::remaining_cores;
-int _manage::selected_slot = -1;
-int _manage::selected_stage = -1;
-int _manage::last_stage;	// HAX for the start stage selector
-skill_levels_t _manage::selected_skill = KOBO_DEFAULT_SKILL;
-unsigned _manage::highscore = 0;
-unsigned _manage::score;
-unsigned _manage::playtime;
-
-bool _manage::scroll_jump = false;
-int _manage::noise_flash = 500;
-int _manage::noise_duration = 0;
-int _manage::noise_timer = 0;
-float _manage::noise_level = 0.0f;
-
-int _manage::cam_lead_x = 0;
-int _manage::cam_lead_y = 0;
-int _manage::cam_lead_xf = 0;
-int _manage::cam_lead_yf = 0;
-
-int _manage::shake_x = 0;
-int _manage::shake_y = 0;
-int _manage::shake_fade_x = 0;
-int _manage::shake_fade_y = 0;
-
-int _manage::delay_count;
-
-float _manage::sfx_volume = 1.0f;
-bool _manage::sfx_mute = false;
+KOBO_TLS KOBO_gamestates _manage::gamestate = GS_NONE;
+KOBO_TLS KOBO_replaymodes _manage::replaymode = RPM_NONE;
+KOBO_TLS bool _manage::demo_mode = false;
+KOBO_TLS bool _manage::is_paused = false;
+KOBO_TLS Uint32 _manage::transition_timeout = 0;
+KOBO_TLS bool _manage::is_headless = false;
+
+KOBO_TLS int _manage::delayed_stage = -1;
+KOBO_TLS KOBO_gamestates _manage::delayed_gamestate = GS_NONE;
+KOBO_TLS bool _manage::delayed_demo = false;
+
+KOBO_TLS int _manage::retry_skip = 0;
+KOBO_TLS bool _manage::retry_rewind = false;
+
+KOBO_TLS KOBO_campaign *_manage::campaign = NULL;
+KOBO_TLS KOBO_replay *_manage::replay = NULL;
+KOBO_TLS bool _manage::owns_replay = false;
+KOBO_TLS KOBO_player_controls _manage::lastctrl = KOBO_PC_FIRE;
+KOBO_TLS unsigned _manage::ctrltimer = 0;
+KOBO_TLS int _manage::valid_replays = 0;
+
+KOBO_TLS bool _manage::in_background = false;
+KOBO_TLS bool _manage::player_ready_armed = false;
+KOBO_TLS bool _manage::player_is_ready = false;
+KOBO_TLS bool _manage::show_bars = false;
+KOBO_TLS float _manage::disp_health;
+KOBO_TLS float _manage::disp_charge;
+KOBO_TLS int _manage::flash_score_count = 0;
+KOBO_TLS bool _manage::score_changed = true;
+KOBO_TLS int _manage::intro_x = TILE_SIZEX * (64 - 18);
+KOBO_TLS int _manage::intro_y = TILE_SIZEY * (64 - 7);
+
+KOBO_TLS int _manage::game_seed;
+KOBO_TLS int _manage::total_cores;
+KOBO_TLS int _manage::remaining_cores;
+KOBO_TLS int _manage::selected_slot = -1;
+KOBO_TLS int _manage::selected_stage = -1;
+KOBO_TLS int _manage::last_stage;	// HAX for the start stage selector
+KOBO_TLS skill_levels_t _manage::selected_skill = KOBO_DEFAULT_SKILL;
+KOBO_TLS unsigned _manage::highscore = 0;
+KOBO_TLS unsigned _manage::score;
+KOBO_TLS unsigned _manage::playtime;
+
+KOBO_TLS bool _manage::scroll_jump = false;
+KOBO_TLS int _manage::noise_flash = 500;
+KOBO_TLS int _manage::noise_duration = 0;
+KOBO_TLS int _manage::noise_timer = 0;
+KOBO_TLS float _manage::noise_level = 0.0f;
+
+KOBO_TLS int _manage::cam_lead_x = 0;
+KOBO_TLS int _manage::cam_lead_y = 0;
+KOBO_TLS int _manage::cam_lead_xf = 0;
+KOBO_TLS int _manage::cam_lead_yf = 0;
+
+KOBO_TLS int _manage::shake_x = 0;
+KOBO_TLS int _manage::shake_y = 0;
+KOBO_TLS int _manage::shake_fade_x = 0;
+KOBO_TLS int _manage::shake_fade_y = 0;
+
+KOBO_TLS int _manage::delay_count;
+
+KOBO_TLS float _manage::sfx_volume = 1.0f;
+KOBO_TLS bool _manage::sfx_mute = false;
 
 
 const char *enumstr(KOBO_replaymodes rpm)
@@ -655,6 +658,11 @@ void _manage::advance(int frame)
 	if(frame == (int)replay->position())
 		return;		// We're already there!
 
+	// Jump to the closest keyframe, if that saves us some work
+	KOBO_keyframe *kf = replay->find_keyframe(frame);
+	if(kf && (kf->frame > replay->position()))
+		replay->restore_keyframe(kf);
+
 	KOBO_replaymodes replaymode_save = replaymode;
 	replaymode = RPM_REPLAY;
 	if((int)replay->position() + 10 < frame)
@@ -672,9 +680,12 @@ void _manage::advance(int frame)
 			wfire->update_norender();
 		else
 			wfire->update();
+		replay->verify_hash();
 		if(prefs->replaydebug)
 			replay->verify_state();
 		++playtime;
+		if(replaymode_save != RPM_REPLAY)
+			record_keyframe();
 		sound.timestamp_reset();
 	}
 	kill_screenshake();
@@ -685,6 +696,288 @@ void _manage::advance(int frame)
 }
 
 
+// Logic only version of init_game(), for headless replay simulation. As the
+// game logic state is per thread (KOBO_TLS), any number of threads can do this
+// in parallel, as long as they're working on different replays.
+void _manage::headless_start(KOBO_replay *rp)
+{
+	if(replay && owns_replay)
+		delete replay;
+	replay = rp;
+	owns_replay = false;
+	demo_mode = false;
+	is_headless = true;
+	replaymode = RPM_REPLAY;
+	state(GS_PLAYING);
+	delay_count = 0;
+	playtime = 0;
+	selected_stage = replay->stage;
+	game.set((game_types_t)replay->type, (skill_levels_t)replay->skill);
+	gamerand.init(replay->seed);
+	score = replay->score;
+	replay->rewind();
+	screen.init_stage(selected_stage, true);
+	enemies.init();
+	myship.init(replay->health, replay->charge);
+	total_cores = remaining_cores = screen.prepare();
+	screen.generate_fixed_enemies();
+}
+
+
+// Run the game logic for one frame. (Caller verifies and bumps playtime.)
+void _manage::headless_frame()
+{
+	myship.control(replay->read());
+	myship.move();
+	enemies.move();
+	myship.check_base_bolts();
+}
+
+
+// Get to the state after 'frame' logic frames, starting from the closest
+// snapshot, unless we're already closer than that.
+void _manage::headless_seek(KOBO_keyframe *snapshots, unsigned frame)
+{
+	KOBO_keyframe *kf = NULL;
+	for(KOBO_keyframe *s = snapshots; s && (s->frame <= frame); s = s->next)
+		kf = s;
+	if(kf && ((playtime > frame) || (kf->frame > playtime)))
+		replay->restore_keyframe(kf);
+	while(playtime < frame)
+	{
+		headless_frame();
+		++playtime;
+	}
+}
+
+
+void _manage::headless_stop()
+{
+	enemies.off();
+	myship.off();
+	replaymode = RPM_NONE;
+	state(GS_NONE);
+	replay = NULL;
+	is_headless = false;
+}
+
+
+// Simulate a replay from start to end as fast as possible, verifying the game
+// state against any hashes and snapshots (GSTD) along the way. This only runs
+// the game logic, so it works without a display, audio, or themes.
+bool _manage::verify_replay(KOBO_replay *rp, KOBO_verify_stats &vs)
+{
+	if((rp->recorded() < KOBO_MIN_REPLAY_LENGTH) ||
+			(rp->compatibility() != KOBO_RPCOM_FULL))
+	{
+		++vs.skipped;
+		return true;
+	}
+
+	headless_start(rp);
+	while(replay->position() < replay->recorded())
+	{
+		headless_frame();
+		replay->verify_hash();
+		replay->verify_state();
+		++playtime;
+	}
+
+	++vs.replays;
+	vs.frames += playtime;
+	vs.states += replay->verified;
+	vs.diffs += replay->failed;
+	vs.hashes += replay->hashed;
+	if(replay->desync_frame >= 0)
+		++vs.desyncs;
+	bool ok = !replay->failed && (replay->desync_frame < 0);
+	if(!ok)
+		++vs.failed;
+
+	headless_stop();
+	return ok;
+}
+
+
+// Check the state after logic frame 'frame' against whatever reference data the
+// replay has for that frame; the state hash and/or a recorded keyframe.
+bool _manage::bisect_check(KOBO_keyframe *snapshots, unsigned frame)
+{
+	headless_seek(snapshots, frame);
+	headless_frame();
+	bool ok = true;
+	uint32_t h;
+	if(replay->hash(frame, &h) && (state_hash() != h))
+		ok = false;
+	++playtime;
+	KOBO_keyframe *ref = replay->find_keyframe(playtime);
+	if(ref && (ref->frame == playtime))
+	{
+		KOBO_keyframe kf;
+		if(kf.record() && kf.diff(ref, -1))
+			ok = false;
+	}
+	return ok;
+}
+
+
+// Find a frame between 'good' and 'bad' (exclusive) that we have reference data
+// for, as close to the middle as possible. Returns -1 if there is none.
+int _manage::bisect_probe(int good, int bad)
+{
+	int mid = (good + bad) / 2;
+	int best = -1;
+
+	// State hashes cover the start of the replay
+	int hf = (int)replay->hashed_frames() - 1;
+	if(hf > mid)
+		hf = mid;
+	if((hf > good) && (hf < bad))
+		best = hf;
+
+	// Recorded keyframes. (A keyframe at frame N is the state after logic
+	// frame N - 1.)
+	for(KOBO_keyframe *kf = replay->keyframes(); kf; kf = kf->next)
+	{
+		int f = kf->frame - 1;
+		if((f <= good) || (f >= bad))
+			continue;
+		if((best < 0) || (abs(f - mid) < abs(best - mid)))
+			best = f;
+	}
+	return best;
+}
+
+
+// Find the first logic frame where a replay desyncs, and dump the differences.
+//	1. Simulate the replay headless, taking dense snapshots, until the
+//	   first game state snapshot (GSTD) that does not match.
+//	2. Binary search between the last good and the first bad frame, using
+//	   the state hashes and recorded keyframes as reference, and the dense
+//	   snapshots to get to each probe frame quickly.
+//	3. Dump the field-by-field differences from the recorded keyframe at
+//	   that frame, if any, and the changes made by the first bad frame.
+// Returns the first divergent frame, or -1 if none was found.
+int _manage::bisect_replay(KOBO_replay *rp)
+{
+	if((rp->recorded() < KOBO_MIN_REPLAY_LENGTH) ||
+			(rp->compatibility() != KOBO_RPCOM_FULL))
+	{
+		log_printf(WLOG, "  Incompatible or too short replay; "
+				"skipped.\n");
+		return -1;
+	}
+
+	// Pass 1: Find the first failing GSTD snapshot
+	headless_start(rp);
+	KOBO_keyframe *snapshots = NULL;
+	KOBO_keyframe *lastsnap = NULL;
+	int good = -1;
+	int bad = -1;
+	while(replay->position() < replay->recorded())
+	{
+		if(!(playtime % KOBO_BISECT_INTERVAL))
+		{
+			// If we run out of memory, we just drop the snapshot,
+			// and seek from the previous one instead.
+			KOBO_keyframe *kf = new KOBO_keyframe;
+			if(!kf->record())
+				delete kf;
+			else
+			{
+				if(lastsnap)
+					lastsnap->next = kf;
+				else
+					snapshots = kf;
+				lastsnap = kf;
+			}
+		}
+		headless_frame();
+		unsigned verified = replay->verified;
+		if(!replay->verify_state())
+		{
+			bad = playtime;
+			break;
+		}
+		if(replay->verified != verified)
+			good = playtime;
+		++playtime;
+	}
+
+	// No GSTD mismatch, but there may be other reference data, so we
+	// bisect the rest of the replay, with the end as a fake bad frame.
+	bool gstd_failed = bad >= 0;
+	if(!gstd_failed)
+		bad = replay->recorded();
+
+	// Pass 2: Bisect
+	int probe;
+	while((probe = bisect_probe(good, bad)) >= 0)
+	{
+		if(bisect_check(snapshots, probe))
+			good = probe;
+		else
+			bad = probe;
+	}
+
+	if(!gstd_failed && (bad == (int)replay->recorded()))
+	{
+		log_printf(ULOG, "  No desync found in %d frames.\n",
+				replay->recorded());
+		bad = -1;
+	}
+	else
+	{
+		if(bad - good > 1)
+			log_printf(ELOG, "  Desync in frames %d..%d (no "
+					"reference data in between)\n",
+					good + 1, bad);
+		else
+			log_printf(ELOG, "  Desync in frame %d\n", bad);
+
+		// Dump the first bad frame, with before and after states
+		headless_seek(snapshots, bad);
+		KOBO_keyframe before;
+		bool recorded = before.record();
+		headless_frame();
+		uint32_t h;
+		if(replay->hash(bad, &h))
+			log_printf(ELOG, "  State hash: %8.8x -> %8.8x\n",
+					h, state_hash());
+		replay->verify_state();
+		++playtime;
+		KOBO_keyframe after;
+		if(!after.record())
+			recorded = false;
+		if(!recorded)
+			log_printf(ELOG, "  Could not record states for "
+					"the diff!\n");
+		else
+		{
+			KOBO_keyframe *ref = replay->find_keyframe(playtime);
+			if(ref && (ref->frame == playtime))
+			{
+				log_printf(ELOG, "  Differences (recorded -> "
+						"replayed):\n");
+				after.diff(ref, ELOG);
+			}
+			log_printf(ULOG, "  Changes in frame %d "
+					"(before -> after):\n", bad);
+			after.diff(&before, ULOG);
+		}
+	}
+
+	while(snapshots)
+	{
+		KOBO_keyframe *kf = snapshots;
+		snapshots = kf->next;
+		delete kf;
+	}
+	headless_stop();
+	return bad;
+}
+
+
 void _manage::player_ready()
 {
 	player_is_ready = true;
@@ -793,6 +1086,8 @@ void _manage::next_stage()
 	else
 		noise_glitch();
 	finalize_replay();
+	if(replay)
+		replay->compact_keyframes();
 	selected_stage++;
 	if(selected_stage >= GIGA - 1)
 		selected_stage = GIGA - 2;
@@ -1146,15 +1441,19 @@ void _manage::run_game()
 	myship.move();
 	enemies.move();
 	myship.check_base_bolts();
-	if(replay && prefs->replaydebug)
+	if(replay)
 		switch(replaymode)
 		{
 		  case RPM_PLAY:
-			replay->record_state();
+			replay->record_hash();
+			if(prefs->replaydebug)
+				replay->record_state();
 			break;
 		  case RPM_RETRY:
 		  case RPM_REPLAY:
-			replay->verify_state();
+			replay->verify_hash();
+			if(prefs->replaydebug)
+				replay->verify_state();
 			break;
 		  case RPM_NONE:
 			break;
@@ -1162,6 +1461,8 @@ void _manage::run_game()
 	update();
 	wfire->update();
 	++playtime;
+	if(replay && ((replaymode == RPM_PLAY) || (replaymode == RPM_RETRY)))
+		record_keyframe();
 	if(lastctrl == ctrlin)
 		++ctrltimer;
 	else
@@ -1172,6 +1473,26 @@ void _manage::run_game()
 }
 
 
+// Record a world state keyframe, if we're at a keyframe position. This is done
+// during normal play and rewind/retry, so that rewinds and bookmark skips can
+// start from the closest keyframe, rather than from the start of the stage.
+// Keyframes are saved with the replay, so this works with loaded campaigns as
+// well.
+void _manage::record_keyframe()
+{
+	if(prefs->keyframes <= 0)
+		return;
+	int interval = prefs->keyframes * 1000 / game.speed;
+	if(interval < 1)
+		interval = 1;
+	if(playtime % interval)
+		return;
+	if((gamestate != GS_PLAYING) || !myship.alive())
+		return;
+	replay->record_keyframe();
+}
+
+
 // Control input handling: Live + record
 //
 //	Use and record the control input! Stop recording the moment the player
@@ -1544,6 +1865,8 @@ void _manage::abort_game()
 			campaign->save();
 		campaign = NULL;
 	}
+	if(replay)
+		replay->compact_keyframes();
 	if(replay && owns_replay)
 		delete replay;
 	replay = NULL;
@@ -1668,6 +1991,20 @@ void _manage::add_score(int sc)
 }
 
 
+// Hash of everything that matters to the game logic, for detecting replay
+// desyncs on the exact frame where they happen. (See KOBO_replay::verify_hash.)
+uint32_t _manage::state_hash()
+{
+	uint32_t h = hash_mix(0, gamerand.get_seed());
+	h = hash_mix(h, score);
+	h = hash_mix(h, remaining_cores);
+	h = myship.hash(h);
+	h = enemies.hash(h);
+	h = hash_mix(h, screen.map_hash());
+	return hash_final(h);
+}
+
+
 void _manage::reenter()
 {
 	screen.init_background();
@@ -52,77 +52,93 @@ enum KOBO_gamestates
 const char *enumstr(KOBO_replaymodes rpm);
 const char *enumstr(KOBO_gamestates gst);
 
+// Headless replay verification results
+struct KOBO_verify_stats
+{
+	unsigned	replays;	// Replays simulated
+	unsigned	skipped;	// Incompatible or too short replays
+	unsigned	failed;		// Replays with game state mismatches
+	unsigned	frames;		// Logic frames simulated
+	unsigned	states;		// Game state snapshots verified
+	unsigned	diffs;		// Game state snapshots that did not match
+	unsigned	hashes;		// Per-frame state hashes verified
+	unsigned	desyncs;	// Replays with state hash mismatches
+};
+
 class _manage
 {
+	friend class KOBO_keyframe;
+
 	// Engine state
-	static KOBO_gamestates gamestate;
-	static KOBO_replaymodes replaymode;
-	static bool demo_mode;
-	static bool is_paused;
-	static Uint32 transition_timeout;
+	static KOBO_TLS KOBO_gamestates gamestate;
+	static KOBO_TLS KOBO_replaymodes replaymode;
+	static KOBO_TLS bool demo_mode;
+	static KOBO_TLS bool is_paused;
+	static KOBO_TLS Uint32 transition_timeout;
+	static KOBO_TLS bool is_headless;	// Logic only; no display!
 
 	// Asynchronous stage selection with transition effect
-	static int delayed_stage;
-	static KOBO_gamestates delayed_gamestate;
-	static bool delayed_demo;
+	static KOBO_TLS int delayed_stage;
+	static KOBO_TLS KOBO_gamestates delayed_gamestate;
+	static KOBO_TLS bool delayed_demo;
 
 	// Delayed skips and rewinds with transition effect
-	static int retry_skip;	// -1/0/+1
-	static bool retry_rewind;
+	static KOBO_TLS int retry_skip;	// -1/0/+1
+	static KOBO_TLS bool retry_rewind;
 
 	// Campaign and current replay
-	static KOBO_campaign *campaign;
-	static KOBO_replay *replay;
-	static bool owns_replay;
-	static KOBO_player_controls lastctrl;	// Previous control input state
-	static unsigned ctrltimer;	// Frames since last input change
-	static int valid_replays;	// Prevent infinite loop w/ bad replays
+	static KOBO_TLS KOBO_campaign *campaign;
+	static KOBO_TLS KOBO_replay *replay;
+	static KOBO_TLS bool owns_replay;
+	static KOBO_TLS KOBO_player_controls lastctrl;	// Previous control input state
+	static KOBO_TLS unsigned ctrltimer;	// Frames since last input change
+	static KOBO_TLS int valid_replays;	// Prevent infinite loop w/ bad replays
 
 	// User interface
-	static bool in_background;
-	static bool player_ready_armed;
-	static bool player_is_ready;
-	static bool show_bars;
-	static float disp_health;
-	static float disp_charge;
-	static int flash_score_count;
-	static bool score_changed;
-	static int intro_x;
-	static int intro_y;
+	static KOBO_TLS bool in_background;
+	static KOBO_TLS bool player_ready_armed;
+	static KOBO_TLS bool player_is_ready;
+	static KOBO_TLS bool show_bars;
+	static KOBO_TLS float disp_health;
+	static KOBO_TLS float disp_charge;
+	static KOBO_TLS int flash_score_count;
+	static KOBO_TLS bool score_changed;
+	static KOBO_TLS int intro_x;
+	static KOBO_TLS int intro_y;
 
 	// Game logic
-	static int game_seed;
-	static int total_cores;
-	static int remaining_cores;
-	static int selected_slot;
-	static int selected_stage;
-	static int last_stage;
-	static skill_levels_t selected_skill;
-	static unsigned highscore;
-	static unsigned score;
-	static unsigned playtime;
+	static KOBO_TLS int game_seed;
+	static KOBO_TLS int total_cores;
+	static KOBO_TLS int remaining_cores;
+	static KOBO_TLS int selected_slot;
+	static KOBO_TLS int selected_stage;
+	static KOBO_TLS int last_stage;
+	static KOBO_TLS skill_levels_t selected_skill;
+	static KOBO_TLS unsigned highscore;
+	static KOBO_TLS unsigned score;
+	static KOBO_TLS unsigned playtime;
 
 	// Transition effects
-	static bool scroll_jump;
-	static int noise_flash;
-	static int noise_duration;
-	static int noise_timer;
-	static float noise_level;
+	static KOBO_TLS bool scroll_jump;
+	static KOBO_TLS int noise_flash;
+	static KOBO_TLS int noise_duration;
+	static KOBO_TLS int noise_timer;
+	static KOBO_TLS float noise_level;
 
 	// Camera lead
-	static int cam_lead_x, cam_lead_y;
-	static int cam_lead_xf, cam_lead_yf;
+	static KOBO_TLS int cam_lead_x, cam_lead_y;
+	static KOBO_TLS int cam_lead_xf, cam_lead_yf;
 
 	// Screen shake
-	static int shake_x, shake_y;
-	static int shake_fade_x, shake_fade_y;
+	static KOBO_TLS int shake_x, shake_y;
+	static KOBO_TLS int shake_fade_x, shake_fade_y;
 
 	// Timing
-	static int delay_count;
+	static KOBO_TLS int delay_count;
 
 	// Sound
-	static float sfx_volume;
-	static bool sfx_mute;
+	static KOBO_TLS float sfx_volume;
+	static KOBO_TLS bool sfx_mute;
 
 	static void put_player_stats();
 	static void put_info();
@@ -150,8 +166,17 @@ class _manage
 	static void run_intro();
 	static void run_pause();
 	static void run_game();
+	static void record_keyframe();
 	static void finalize_replay();
 
+	// Headless replay simulation (verification/bisection)
+	static void headless_start(KOBO_replay *rp);
+	static void headless_frame();
+	static void headless_seek(KOBO_keyframe *snapshots, unsigned frame);
+	static void headless_stop();
+	static bool bisect_check(KOBO_keyframe *snapshots, unsigned frame);
+	static int bisect_probe(int good, int bad);
+
 	static void select_campaign(KOBO_campaign *cmp);
 	static void select_slot(int sl);
 	static void select_stage(int stage, KOBO_gamestates gs);
@@ -194,6 +219,11 @@ class _manage
 	static KOBO_gamestates state()	{ return gamestate; }
 	static bool demo()		{ return demo_mode; }
 
+	// True while running headless replay simulation. The display (wfire
+	// and friends) belongs to the main thread, and must not be touched by
+	// the game logic in this mode, as it may be running in another thread.
+	static bool headless()		{ return is_headless; }
+
 	// Replays
 	static KOBO_replaymodes replay_mode()	{ return replaymode; }
 	static float replay_progress();
@@ -201,6 +231,10 @@ class _manage
 	static int replay_stages();
 	static int bookmark(int bm);
 
+	// Headless replay verification (no display, audio, or themes)
+	static bool verify_replay(KOBO_replay *rp, KOBO_verify_stats &vs);
+	static int bisect_replay(KOBO_replay *rp);	// First bad frame or -1
+
 	// Running the game
 	static void run();
 
@@ -258,6 +292,9 @@ class _manage
 	static void lost_myship();
 	static void destroyed_a_core();
 	static void add_score(int sc);
+
+	// Hash of the current game logic state (replay desync detection)
+	static uint32_t state_hash();
 };
 
 extern _manage manage;
@@ -23,6 +23,8 @@
 #ifndef KOBO_MATHUTIL_H
 #define KOBO_MATHUTIL_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -34,6 +36,31 @@ static inline int mod(int a, int b)
 	return r < 0 ? r + b : r;
 }
 
+/*
+ * Fast 32 bit hashing (MurmurHash3 style) for game state verification.
+ *	hash_mix()	Mix a 32 bit word into a running hash
+ *	hash_final()	Final avalanche; also good for hashing a single word
+ */
+static inline uint32_t hash_mix(uint32_t h, uint32_t k)
+{
+	k *= 0xcc9e2d51;
+	k = (k << 15) | (k >> 17);
+	k *= 0x1b873593;
+	h ^= k;
+	h = (h << 13) | (h >> 19);
+	return h * 5 + 0xe6546b64;
+}
+
+static inline uint32_t hash_final(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
 /*
  * Fast integer atan() approximation. Input is 24:8 fixed point.
  * Output is 0..64 for 0..45 deg, accurate down to LSB.
@@ -30,31 +30,35 @@
 #include "manage.h"
 #include "random.h"
 #include "sound.h"
-
-KOBO_myship_state KOBO_myship::_state;
-int KOBO_myship::shield_timer = 0;
-KOBO_player_controls KOBO_myship::ctrl;
-int KOBO_myship::di;
-int KOBO_myship::fdi;
-int KOBO_myship::dframes;
-int KOBO_myship::x;
-int KOBO_myship::y;
-int KOBO_myship::vx;
-int KOBO_myship::vy;
-int KOBO_myship::ax;
-int KOBO_myship::ay;
-int KOBO_myship::hitsize;
-int KOBO_myship::_health;
-int KOBO_myship::_charge;
-float KOBO_myship::charge_blipp_granularity;
-int KOBO_myship::charged_cooltimer;
-int KOBO_myship::blossom_cooltimer;
-int KOBO_myship::health_time;
-int KOBO_myship::nose_reload_timer;
-int KOBO_myship::tail_reload_timer;
-KOBO_player_bolt KOBO_myship::bolts[MAX_BOLTS];
-cs_obj_t *KOBO_myship::object = NULL;
-bool KOBO_myship::_visible = true;
+#include "mathutil.h"
+
+KOBO_TLS KOBO_myship_state KOBO_myship::_state;
+KOBO_TLS int KOBO_myship::shield_timer = 0;
+KOBO_TLS KOBO_player_controls KOBO_myship::ctrl;
+KOBO_TLS int KOBO_myship::di;
+KOBO_TLS int KOBO_myship::fdi;
+KOBO_TLS int KOBO_myship::dframes;
+KOBO_TLS int KOBO_myship::x;
+KOBO_TLS int KOBO_myship::y;
+KOBO_TLS int KOBO_myship::vx;
+KOBO_TLS int KOBO_myship::vy;
+KOBO_TLS int KOBO_myship::ax;
+KOBO_TLS int KOBO_myship::ay;
+KOBO_TLS int KOBO_myship::hitsize;
+KOBO_TLS int KOBO_myship::_health;
+KOBO_TLS int KOBO_myship::_charge;
+KOBO_TLS float KOBO_myship::charge_blipp_granularity;
+KOBO_TLS int KOBO_myship::charged_cooltimer;
+KOBO_TLS int KOBO_myship::blossom_cooltimer;
+KOBO_TLS int KOBO_myship::health_time;
+KOBO_TLS int KOBO_myship::nose_reload_timer;
+KOBO_TLS int KOBO_myship::tail_reload_timer;
+KOBO_TLS KOBO_player_bolt KOBO_myship::bolts[MAX_BOLTS];
+KOBO_TLS bool KOBO_myship::bolt_grid_valid = false;
+KOBO_TLS int16_t KOBO_myship::bolt_grid[MAP_SIZEY][MAP_SIZEX];
+KOBO_TLS int16_t KOBO_myship::bolt_grid_next[MAX_BOLTS];
+KOBO_TLS cs_obj_t *KOBO_myship::object = NULL;
+KOBO_TLS bool KOBO_myship::_visible = true;
 
 
 void KOBO_myship::state(KOBO_myship_state s)
@@ -134,6 +138,7 @@ void KOBO_myship::off()
 		if(bolts[i].object)
 			gengine->free_obj(bolts[i].object);
 	memset(bolts, 0, sizeof(bolts));
+	bolt_grid_valid = false;
 }
 
 
@@ -142,7 +147,10 @@ void KOBO_myship::init(bool newship)
 	ctrl = KOBO_PC_NONE;
 	shield_timer = 0;
 	di = 1;
-	if(s_bank_t *b = s_get_bank(gengine->get_gfx(), B_PLAYER))
+	s_bank_t *b = NULL;
+	if(gengine->get_gfx())
+		b = s_get_bank(gengine->get_gfx(), B_PLAYER);
+	if(b)
 		dframes = b->max + 1;
 	else
 		dframes = 8;
@@ -165,7 +173,11 @@ void KOBO_myship::init(bool newship)
 		if(game.level_charge >= 0)
 			_charge = game.level_charge;
 	}
-	charge_blipp_granularity = (float)wcharge->led_count() / game.charge;
+	if(manage.headless())
+		charge_blipp_granularity = 0.0f;	// No charge bar blipps
+	else
+		charge_blipp_granularity = (float)wcharge->led_count() /
+				game.charge;
 
 	health_time = charged_cooltimer = blossom_cooltimer = 0;
 	nose_reload_timer = tail_reload_timer = 0;
@@ -175,6 +187,7 @@ void KOBO_myship::init(bool newship)
 		if(bolts[i].object)
 			gengine->free_obj(bolts[i].object);
 	memset(bolts, 0, sizeof(bolts));
+	bolt_grid_valid = false;
 
 	state(SHIP_NORMAL);
 	apply_position();
@@ -192,7 +205,7 @@ void KOBO_myship::init(int rhealth, int rcharge)
 void KOBO_myship::explode()
 {
 	KOBO_ParticleFXDef *pfxd = themedata.pfxdef(KOBO_PFX_PLAYER_DEATH);
-	if(pfxd)
+	if(pfxd && !manage.headless())
 		wfire->Spawn(x, y, 0, 0, pfxd);
 }
 
@@ -284,7 +297,7 @@ void KOBO_myship::handle_controls()
 
 	KOBO_ParticleFXDef *pfxd = themedata.pfxdef((ctrl & KOBO_PC_DIR) ?
 			KOBO_PFX_AFTERBURNER : KOBO_PFX_THRUSTER);
-	if(pfxd)
+	if(pfxd && !manage.headless())
 	{
 		if(ctrl & KOBO_PC_DIR)
 		{
@@ -365,6 +378,8 @@ void KOBO_myship::fire_control()
 
 void KOBO_myship::move()
 {
+	bolt_grid_valid = false;
+
 	// Health regeneration/overcharge fade
 	if(++health_time >= game.health_fade)
 	{
@@ -555,6 +570,39 @@ void KOBO_myship::check_base_bolts()
 }
 
 
+// Mix the game logic state (ship and bolts) into hash 'h'. NOTE: Anything that
+// depends on the graphics theme (sprite frames etc) must NOT go in here!
+uint32_t KOBO_myship::hash(uint32_t h)
+{
+	h = hash_mix(h, _state);
+	h = hash_mix(h, shield_timer);
+	h = hash_mix(h, di);
+	h = hash_mix(h, x);
+	h = hash_mix(h, y);
+	h = hash_mix(h, vx);
+	h = hash_mix(h, vy);
+	h = hash_mix(h, _health);
+	h = hash_mix(h, _charge);
+	h = hash_mix(h, charged_cooltimer);
+	h = hash_mix(h, blossom_cooltimer);
+	h = hash_mix(h, health_time);
+	h = hash_mix(h, nose_reload_timer);
+	h = hash_mix(h, tail_reload_timer);
+	for(int i = 0; i < MAX_BOLTS; i++)
+	{
+		if(!bolts[i].state)
+			continue;
+		h = hash_mix(h, i);
+		h = hash_mix(h, bolts[i].x);
+		h = hash_mix(h, bolts[i].y);
+		h = hash_mix(h, bolts[i].dx);
+		h = hash_mix(h, bolts[i].dy);
+		h = hash_mix(h, bolts[i].state);
+	}
+	return h;
+}
+
+
 // Calculate bounce
 static inline void calc_bounce(int p2, int *p3, int *v)
 {
@@ -647,12 +695,65 @@ void KOBO_myship::update_position()
 }
 
 
+void KOBO_myship::build_bolt_grid()
+{
+	memset(bolt_grid, -1, sizeof(bolt_grid));
+	for(int i = MAX_BOLTS - 1; i >= 0; --i)
+	{
+		if(!bolts[i].state)
+			continue;
+		int16_t *cell = &bolt_grid[WORLD2MAPY(CS2PIXEL(bolts[i].y))]
+				[WORLD2MAPX(CS2PIXEL(bolts[i].x))];
+		bolt_grid_next[i] = *cell;
+		*cell = i;
+	}
+	bolt_grid_valid = true;
+}
+
+
+// Only bolts in the tiles covered by the hit zone are tested, but they're still
+// tested in index order, so that the same bolts hit as with a full scan.
 int KOBO_myship::hit_bolt(int ex, int ey, int hitsize, int health)
 {
+	if(hitsize <= 0)
+		return 0;
+	if(!bolt_grid_valid)
+		build_bolt_grid();
+
+	int x0 = (ex - hitsize) >> TILE_SIZEX_LOG2;
+	int x1 = (ex + hitsize) >> TILE_SIZEX_LOG2;
+	int y0 = (ey - hitsize) >> TILE_SIZEY_LOG2;
+	int y1 = (ey + hitsize) >> TILE_SIZEY_LOG2;
+	if(x1 - x0 >= MAP_SIZEX)
+	{
+		x0 = 0;
+		x1 = MAP_SIZEX - 1;
+	}
+	if(y1 - y0 >= MAP_SIZEY)
+	{
+		y0 = 0;
+		y1 = MAP_SIZEY - 1;
+	}
+
+	// Gather candidates, and insertion sort them by index
+	int cand[MAX_BOLTS];
+	int n = 0;
+	for(int cy = y0; cy <= y1; ++cy)
+		for(int cx = x0; cx <= x1; ++cx)
+			for(int i = bolt_grid[cy & (MAP_SIZEY - 1)]
+					[cx & (MAP_SIZEX - 1)]; i >= 0;
+					i = bolt_grid_next[i])
+			{
+				int j = n++;
+				for( ; j && (cand[j - 1] > i); --j)
+					cand[j] = cand[j - 1];
+				cand[j] = i;
+			}
+
 	int dmg = 0;
-	int i;
-	for(i = 0; i < MAX_BOLTS; i++)
+	for(int c = 0; c < n; ++c)
 	{
+		int i = cand[c];
 		if(bolts[i].state == 0)
 			continue;
 		if(labs(WRAPDISTX(ex, CS2PIXEL(bolts[i].x))) >= hitsize)
@@ -730,6 +831,7 @@ void KOBO_myship::render()
 		ddi -= maxd;
 	fdi += ddi * gengine->frame_delta_time() * 0.02f;
 	fdi = (fdi + maxd) % maxd;
+	whighsprites->begin_batch();
 	whighsprites->sprite_fxp(object->point.gx, object->point.gy,
 			B_PLAYER, fdi >> 8);
 
@@ -758,6 +860,7 @@ void KOBO_myship::render()
 	  default:
 		break;
 	}
+	whighsprites->end_batch();
 
 	if(prefs->show_hit)
 	{
@@ -854,7 +957,7 @@ void KOBO_myship::charged_fire(int dir)
 	charged_cooltimer = game.charged_cooldown;
 
 	KOBO_ParticleFXDef *pfxd = themedata.pfxdef(KOBO_PFX_CHARGED_BLAST);
-	if(pfxd)
+	if(pfxd && !manage.headless())
 	{
 		int sdi = sin(M_PI * (dir - 1) / 4) * 256.0f;
 		int cdi = cos(M_PI * (dir - 1) / 4) * 256.0f;
@@ -891,7 +994,7 @@ void KOBO_myship::fire_blossom()
 	blossom_cooltimer = game.blossom_cooldown;
 
 	KOBO_ParticleFXDef *pfxd = themedata.pfxdef(KOBO_PFX_DEATH_BLOSSOM);
-	if(pfxd)
+	if(pfxd && !manage.headless())
 		wfire->Spawn(x + vx, y + vy, vx >> 2, vy >> 2, pfxd);
 }
 
@@ -47,29 +47,36 @@ struct KOBO_player_bolt
 
 class KOBO_myship
 {
-	static KOBO_myship_state _state;
-	static int shield_timer;
-	static KOBO_player_controls ctrl;
-	static int di;		// Direction (1: N, 2: NE, 3: W etc)
-	static int fdi;		// Filtered direction (sprite frames, 24:8)
-	static int dframes;	// Number of sprite rotation frames
-	static int x, y;	// Position
-	static int vx, vy;	// Velocity
-	static int ax, ay;	// Acceleration
-	static int hitsize;
-	static int _health;
-	static int _charge;	// Weapon boost capacitor charge
-	static float charge_blipp_granularity;
-	static int charged_cooltimer;	// Charged Blast cooldown timer
-	static int blossom_cooltimer;	// Fire Blossom cooldown timer
-	static int health_time;
-	static int nose_reload_timer;
-	static int tail_reload_timer;
-	static KOBO_player_bolt bolts[MAX_BOLTS];
+	friend class KOBO_keyframe;
+	static KOBO_TLS KOBO_myship_state _state;
+	static KOBO_TLS int shield_timer;
+	static KOBO_TLS KOBO_player_controls ctrl;
+	static KOBO_TLS int di;		// Direction (1: N, 2: NE, 3: W etc)
+	static KOBO_TLS int fdi;	// Filtered direction (sprite frames, 24:8)
+	static KOBO_TLS int dframes;	// Number of sprite rotation frames
+	static KOBO_TLS int x, y;	// Position
+	static KOBO_TLS int vx, vy;	// Velocity
+	static KOBO_TLS int ax, ay;	// Acceleration
+	static KOBO_TLS int hitsize;
+	static KOBO_TLS int _health;
+	static KOBO_TLS int _charge;	// Weapon boost capacitor charge
+	static KOBO_TLS float charge_blipp_granularity;
+	static KOBO_TLS int charged_cooltimer;	// Charged Blast cooldown timer
+	static KOBO_TLS int blossom_cooltimer;	// Fire Blossom cooldown timer
+	static KOBO_TLS int health_time;
+	static KOBO_TLS int nose_reload_timer;
+	static KOBO_TLS int tail_reload_timer;
+	static KOBO_TLS KOBO_player_bolt bolts[MAX_BOLTS];
+
+	// Bolt/enemy collision grid; one cell per map tile, listing the bolts
+	// in that tile in index order. Rebuilt as needed after bolts move.
+	static KOBO_TLS bool bolt_grid_valid;
+	static KOBO_TLS int16_t bolt_grid[MAP_SIZEY][MAP_SIZEX];
+	static KOBO_TLS int16_t bolt_grid_next[MAX_BOLTS];
 
 	// For the gfxengine connection
-	static cs_obj_t *object;
-	static bool _visible;
+	static KOBO_TLS cs_obj_t *object;
+	static KOBO_TLS bool _visible;
 
 	static void shot_single(float dir, int loffset, int hoffset,
 			int speed = 65536);
@@ -85,6 +92,7 @@ class KOBO_myship
 	static void handle_controls();
 	static void update_position();
 	static void kill_bolt(int bolt, bool impact);
+	static void build_bolt_grid();
   public:
 	static KOBO_player_controls decode_input();
 	static void control(KOBO_player_controls c)	{ ctrl = c; }
@@ -111,6 +119,7 @@ class KOBO_myship
 	static void render();
 	static int hit_bolt(int ex, int ey, int hitsize, int health);
 	static void check_base_bolts();
+	static uint32_t hash(uint32_t h);	// Hash logic state (replays)
 	static void hit(int dmg);
 	static int health()		{ return _health; }
 	static int shield_time();
@@ -535,6 +535,18 @@ void interface_options_t::build()
 		item("Ordered 4x4", GFX_DITHER_ORDERED);
 		item("Skewed 4x4", GFX_DITHER_SKEWED);
 		item("Noise", GFX_DITHER_NOISE);
+	list("Explosion Threads", &prf->firethreads, 0);
+		item("One Per CPU", 0);
+		item("1", 1);
+		item("2", 2);
+		item("4", 4);
+		item("8", 8);
+		item("16", 16);
+	yesno("Asynchronous Explosions", &prf->fireasync, 0);
+	list("Explosion Resolution", &prf->firescale, OS_RESTART_VIDEO);
+		item("Full", 1);
+		item("1/2", 2);
+		item("1/4", 4);
 #if 0
 	space(1);
 	list("Scale Mode", &prf->scalemode, OS_RELOAD_GRAPHICS);
@@ -614,6 +626,13 @@ void game_options_t::build()
 			item("9 seconds", 9);
 			item("Wait Forever", 10);
 	}
+	list("Replay Keyframes", &prf->keyframes, 0);
+		item("Off", 0);
+		item("Every 2 seconds", 2);
+		item("Every 5 seconds", 5);
+		item("Every 10 seconds", 10);
+		item("Every 20 seconds", 20);
+		item("Every 30 seconds", 30);
 
 	xoffs = 0.5;
 	space(2);
@@ -140,6 +140,11 @@ void prefs_t::init()
 	key("contrast", contrast, 100); desc("Contrast");
 	key("planetdither", planetdither, -1); desc("Planet Dither Style");
 	key("firedither", firedither, -1); desc("Fire Effect Dither Style");
+	key("firethreads", firethreads, 0); desc("Fire Effect Threads");
+	yesno("fireasync", fireasync, 0);
+			desc("Asynchronous Fire Effect Update");
+	key("firescale", firescale, 1);
+			desc("Fire Effect Resolution Divisor");
 	yesno("playerhitfx", playerhitfx, 0);
 			desc("Use visual player hit effects");
 	key("screenshake", screenshake, 3); desc("Screen Shake");
@@ -150,6 +155,7 @@ void prefs_t::init()
 	key("cont_countdown", cont_countdown, 9); desc("Continue Countdown");
 	key("autocontinue", autocontinue, 5);
 			desc("Automatic Continue Timeout");
+	key("keyframes", keyframes, 5); desc("Replay Keyframe Interval");
 
 	section("Debug");
 	yesno("debug", debug, 0); desc("Enable Debug Features");
@@ -211,6 +217,10 @@ void prefs_t::init()
 	key("skill", cmd_skill, SKILL_NORMAL, false); desc("Warp Skill Level");
 	command("resaveall", cmd_resaveall, 0);
 			desc("Resave Config and Saves");
+	command("verifyreplays", cmd_verifyreplays, 0);
+			desc("Verify Replays Headless");
+	command("bisectreplays", cmd_bisectreplays, 0);
+			desc("Locate Replay Desyncs Headless");
 }
 
 
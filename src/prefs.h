@@ -116,6 +116,9 @@ class prefs_t : public config_parser_t
 	int	contrast;	//Graphics contrast
 	int	planetdither;	//Spinning planet dither style
 	int	firedither;	//Fire effect dither mode
+	int	firethreads;	//Fire effect threads (0 = one per CPU)
+	int	fireasync;	//Update fire effect asynchronously
+	int	firescale;	//Fire effect resolution divisor (1, 2, 4)
 	int	playerhitfx;	//Use visual effects when player takes damage
 	int	screenshake;	//Screen shake amount
 	int	titledemos;	//Play demos behind intro and (some) menus
@@ -124,6 +127,7 @@ class prefs_t : public config_parser_t
 	int	countdown;	//"Get Ready" countdown
 	int	cont_countdown;	//"Continue?" countdown
 	int	autocontinue;	//Turn "Continue?" into delay-to-replay
+	int	keyframes;	//Replay keyframe interval (s; 0 to disable)
 
 	// Debug
 	int	debug;
@@ -188,6 +192,8 @@ class prefs_t : public config_parser_t
 	int	cmd_warp;
 	int	cmd_skill;
 	int	cmd_resaveall;
+	int	cmd_verifyreplays;	//Verify all replays headless and exit
+	int	cmd_bisectreplays;	//Locate replay desyncs headless and exit
 };
 
 #endif	//_KOBO_PREFS_H_
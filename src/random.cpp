@@ -22,5 +22,5 @@
 
 #include "random.h"
 
-rand_num_t gamerand;
-rand_num_t pubrand;
+KOBO_TLS rand_num_t gamerand;
+KOBO_TLS rand_num_t pubrand;
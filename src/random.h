@@ -24,6 +24,7 @@
 #ifndef _KOBO_RANDOM_H_
 #define _KOBO_RANDOM_H_
 
+#include "config.h"
 #include "SDL.h"
 
 class rand_num_t
@@ -39,6 +40,7 @@ class rand_num_t
 	}
 
 	Uint32 get_seed()	{ return seed; }
+	void set_seed(Uint32 _seed)	{ seed = _seed; }
 
 	Uint32 get()
 	{
@@ -61,13 +63,15 @@ class rand_num_t
 // from here will screw up demo/replay playback, checkpoints, saves and the
 // like totally, as demos record only the seed used for each level; not every
 // random number used.
-extern rand_num_t gamerand;
+extern KOBO_TLS rand_num_t gamerand;
 
 // Use this "public" random number generator for other stuff, like explosion
 // effects, and things that may pick different amounts of numbers depending on
 // engine version, configuration, computer speed and the like. Due to the
 // issues mentioned above, this generator must NOT be used for anything that
 // affects the game logic in any way.
-extern rand_num_t pubrand;
+//   Like gamerand, this is per thread, as the game logic (which uses it for
+// cosmetic stuff) may run in multiple threads when verifying replays.
+extern KOBO_TLS rand_num_t pubrand;
 
 #endif //_KOBO_RANDOM_H_
@@ -25,6 +25,7 @@
 #include "random.h"
 #include "replay.h"
 #include "replay_gst.h"
+#include "keyframe.h"
 
 // Initial buffer size (enough for about 65 minutes at 30 ms/frame)
 #define	KOBO_REPLAY_BUFFER	131072
@@ -33,7 +34,11 @@
 KOBO_replay::KOBO_replay()
 {
 	buffer = NULL;
+	hashes = NULL;
 	gst_first = gst_last = gst_current = NULL;
+	kf_first = kf_last = NULL;
+	verified = failed = hashed = 0;
+	hashok = desync_frame = -1;
 	clear();
 }
 
@@ -51,6 +56,10 @@ void KOBO_replay::reset()
 	bufsize = 0;
 	bufrecord = bufplay = 0;
 
+	free(hashes);
+	hashes = NULL;
+	hashsize = hashrecord = 0;
+
 	while(gst_first)
 	{
 		KOBO_replay_gst *gst = gst_first;
@@ -59,6 +68,8 @@ void KOBO_replay::reset()
 	}
 	gst_last = gst_current = NULL;
 
+	discard_keyframes();
+
 	version = KOBO_REPLAY_VERSION;
 	gameversion = KOBO_VERSION;
 	config = get_config();
@@ -135,6 +146,16 @@ void KOBO_replay::compact()
 	}
 	buffer = nb;
 	bufsize = bufrecord;
+
+	if(hashsize > hashrecord)
+	{
+		Uint8 *nh = (Uint8 *)realloc(hashes, hashrecord * 4);
+		if(nh || !hashrecord)
+		{
+			hashes = nh;
+			hashsize = hashrecord;
+		}
+	}
 }
 
 
@@ -142,6 +163,8 @@ void KOBO_replay::rewind()
 {
 	bufplay = 0;
 	gst_current = gst_first;
+	verified = failed = hashed = 0;
+	hashok = desync_frame = -1;
 }
 
 
@@ -196,6 +219,14 @@ void KOBO_replay::punchin()
 		gst_last = gst_last->next;
 	}
 
+	// Discard any keyframes beyond this frame. (A keyframe exactly at this
+	// frame is still valid, as it's the state before any new input.)
+	discard_keyframes(punchframe + 1);
+
+	// Discard any state hashes for this frame and on
+	if(hashrecord > punchframe)
+		hashrecord = punchframe;
+
 	// Truncate replay data, and make sure we have a properly sized buffer
 	bufrecord = punchframe;
 	if(bufsize < KOBO_REPLAY_BUFFER)
@@ -274,7 +305,10 @@ void KOBO_replay::log_dump(int level, KOBO_replay_logdump rld)
 		log_printf(level, " |- Data -------------------------\n");
 
 	if(replay)
+	{
 		log_printf(level, " |    recorded: %d frames\n", bufrecord);
+		log_printf(level, " |      hashes: %d frames\n", hashrecord);
+	}
 
 	if(gstd)
 	{
@@ -323,10 +357,165 @@ bool KOBO_replay::verify_state()
 log_printf(ULOG, "(((frame %d missing!)))\n", manage.game_time());
 		return true;
 }
-	return gst_current->verify();
+	++verified;
+	if((int)gst_current->frame == hashok)
+		return true;	// Already verified by the state hash
+	if(gst_current->verify())
+		return true;
+	++failed;
+	return false;
+}
+
+
+void KOBO_replay::record_hash()
+{
+	unsigned frame = manage.game_time();
+	if(frame >= bufrecord)
+		return;		// No input recorded for this frame!
+	if(frame > hashrecord)
+		return;		// Hashes only cover the start of the replay
+	if(frame >= hashsize)
+	{
+		int nhs = hashsize * 3 / 2;
+		if(nhs < KOBO_REPLAY_BUFFER)
+			nhs = KOBO_REPLAY_BUFFER;
+		Uint8 *nh = (Uint8 *)realloc(hashes, nhs * 4);
+		if(!nh)
+		{
+			log_printf(ELOG, "OOM in KOBO_replay::record_hash()!"
+					"\n");
+			return;
+		}
+		hashes = nh;
+		hashsize = nhs;
+	}
+	uint32_t h = manage.state_hash();
+	Uint8 *hp = hashes + frame * 4;
+	hp[0] = h;
+	hp[1] = h >> 8;
+	hp[2] = h >> 16;
+	hp[3] = h >> 24;
+	hashrecord = frame + 1;
+	_modified = true;
+}
+
+
+bool KOBO_replay::hash(unsigned frame, uint32_t *h)
+{
+	if(frame >= hashrecord)
+		return false;
+	Uint8 *hp = hashes + frame * 4;
+	*h = hp[0] | (hp[1] << 8) | (hp[2] << 16) | ((uint32_t)hp[3] << 24);
+	return true;
+}
+
+
+// Compare the current game state against the hash recorded for this frame. The
+// hashes are per frame rather than chained, so this works from any position,
+// such as right after restore_keyframe().
+bool KOBO_replay::verify_hash()
+{
+	unsigned frame = manage.game_time();
+	if(frame >= hashrecord)
+		return true;
+	uint32_t h;
+	hash(frame, &h);
+	if(manage.state_hash() != h)
+	{
+		if(desync_frame < 0)
+		{
+			log_printf(ELOG, "REPLAY DESYNC in frame %d!\n",
+					frame);
+			desync_frame = frame;
+		}
+		return false;
+	}
+	++hashed;
+	if(desync_frame < 0)
+		hashok = frame;
+	return true;
+}
+
+
+bool KOBO_replay::record_keyframe()
+{
+	if(kf_last && (kf_last->frame >= manage.game_time()))
+		return true;	// Already have this one!
+
+	KOBO_keyframe *kf = new KOBO_keyframe;
+	if(!kf->record())
+	{
+		delete kf;
+		return false;
+	}
+	if(kf_last)
+	{
+		kf_last->next = kf;
+		kf_last = kf;
+	}
+	else
+		kf_last = kf_first = kf;
+	_modified = true;
+	return true;
+}
+
+
+KOBO_keyframe *KOBO_replay::find_keyframe(unsigned frame)
+{
+	KOBO_keyframe *found = NULL;
+	for(KOBO_keyframe *kf = kf_first; kf && (kf->frame <= frame);
+			kf = kf->next)
+		found = kf;
+	return found;
+}
+
+
+bool KOBO_replay::restore_keyframe(KOBO_keyframe *kf)
+{
+	if(kf->frame > bufrecord)
+	{
+		log_printf(ELOG, "KOBO_replay::restore_keyframe() beyond end "
+				"of replay data!\n");
+		return false;
+	}
+	if(prefs->debug)
+		log_printf(ULOG, "KOBO_replay::restore_keyframe() at frame "
+				"%d\n", kf->frame);
+	kf->restore();
+	bufplay = kf->frame;
+	gst_current = gst_first;
+	return true;
+}
+
+
+void KOBO_replay::discard_keyframes(unsigned frame)
+{
+	KOBO_keyframe *p = NULL;
+	KOBO_keyframe *kf = kf_first;
+	while(kf && (kf->frame < frame))
+	{
+		p = kf;
+		kf = kf->next;
+	}
+	if(p)
+		p->next = NULL;
+	else
+		kf_first = NULL;
+	kf_last = p;
+	while(kf)
+	{
+		KOBO_keyframe *d = kf;
+		kf = kf->next;
+		delete d;
+	}
 }
 
 
+void KOBO_replay::compact_keyframes()
+{
+	for(KOBO_keyframe *kf = kf_first; kf; kf = kf->next)
+		kf->compact();
+}
 
 
 bool KOBO_replay::load_reph(pfile_t *pf)
@@ -439,6 +628,34 @@ bool KOBO_replay::load_repd(pfile_t *pf)
 }
 
 
+bool KOBO_replay::load_hash(pfile_t *pf)
+{
+	uint32_t n;
+	pf->read(n);
+	if((compat != KOBO_RPCOM_FULL) || !n || (n > bufrecord) ||
+			(pf->chunk_version() != KOBO_PF_HASH_VERSION))
+	{
+		// Hashes are useless without a fully compatible replay!
+		// (Version 1 had only 16 bits per frame; just ignore those.)
+		pf->chunk_end();
+		return true;
+	}
+	Uint8 *nh = (Uint8 *)realloc(hashes, n * 4);
+	if(!nh)
+	{
+		pf->chunk_end();
+		return false;
+	}
+	hashes = nh;
+	hashsize = hashrecord = n;
+	pf->read(hashes, n * 4);
+
+	pf->chunk_end();
+
+	return !pf->status();
+}
+
+
 bool KOBO_replay::load_gstd(pfile_t *pf)
 {
 	KOBO_replay_gst *gst = new KOBO_replay_gst;
@@ -453,6 +670,32 @@ bool KOBO_replay::load_gstd(pfile_t *pf)
 }
 
 
+bool KOBO_replay::load_kfrm(pfile_t *pf)
+{
+	if(compat != KOBO_RPCOM_FULL)
+	{
+		// Keyframes are useless without a fully compatible replay!
+		pf->chunk_end();
+		return true;
+	}
+	KOBO_keyframe *kf = new KOBO_keyframe;
+	if(!kf->load(pf) || (kf_last && (kf->frame <= kf_last->frame)) ||
+			(kf->frame > bufrecord))
+	{
+		delete kf;
+		return false;
+	}
+	if(kf_last)
+	{
+		kf_last->next = kf;
+		kf_last = kf;
+	}
+	else
+		kf_last = kf_first = kf;
+	return true;
+}
+
+
 bool KOBO_replay::load(pfile_t *pf)
 {
 	switch(pf->chunk_type())
@@ -461,6 +704,10 @@ bool KOBO_replay::load(pfile_t *pf)
 		return load_reph(pf);
 	  case KOBO_PF_REPD_4CC:
 		return load_repd(pf);
+	  case KOBO_PF_HASH_4CC:
+		return load_hash(pf);
+	  case KOBO_PF_KFRM_4CC:
+		return load_kfrm(pf);
 	  case KOBO_PF_GSTD_4CC:
 		if(prefs->replaydebug)
 			return load_gstd(pf);
@@ -531,6 +778,25 @@ bool KOBO_replay::save(pfile_t *pf)
 		pf->chunk_end();
 	}
 
+	//
+	// HASH (game state hashes)
+	//
+	if(hashrecord)
+	{
+		pf->chunk_write(KOBO_PF_HASH_4CC, KOBO_PF_HASH_VERSION);
+
+		pf->write(hashrecord);
+		pf->write(hashes, hashrecord * 4);
+
+		pf->chunk_end();
+	}
+
+	//
+	// KFRM (world state keyframes)
+	//
+	for(KOBO_keyframe *kf = kf_first; kf; kf = kf->next)
+		kf->save(pf);
+
 	//
 	// GSTD (debug/verification data)
 	//
@@ -55,6 +55,10 @@
 #define	KOBO_PF_REPD_4CC	MAKE_4CC('R', 'E', 'P', 'D')
 #define	KOBO_PF_REPD_VERSION	1
 
+// Per-frame game state hashes
+#define	KOBO_PF_HASH_4CC	MAKE_4CC('H', 'A', 'S', 'H')
+#define	KOBO_PF_HASH_VERSION	2
+
 // Minimal acceptable length of a replay. (Game logic frames) This is used to
 // determine whether or not a replay is long enough to start the game in replay
 // mode, or if we should just start in "Get Ready" state instead.
@@ -76,6 +80,7 @@ enum KOBO_replay_logdump
 };
 
 class KOBO_replay_gst;
+class KOBO_keyframe;
 
 class KOBO_replay
 {
@@ -89,10 +94,20 @@ class KOBO_replay
 	uint32_t	bufplay;	// Current playback frame
 	uint8_t		*buffer;
 
+	// Game state hashes; _manage::state_hash(), stored as 4 bytes per frame
+	// (LSB first) in order to keep the chunk endian safe
+	uint32_t	hashsize;	// Physical size of buffer (frames)
+	uint32_t	hashrecord;	// Number of frames hashed
+	int32_t		hashok;		// Last frame verified by hash, or -1
+	uint8_t		*hashes;
+
 	KOBO_replay_gst	*gst_first;	// List head
 	KOBO_replay_gst	*gst_last;	// List tail
 	KOBO_replay_gst	*gst_current;	// Current item
 
+	KOBO_keyframe	*kf_first;	// List head
+	KOBO_keyframe	*kf_last;	// List tail
+
 	KOBO_replay_compat	compat;	// Compatibility status of current data
 
 	bool		_modified;
@@ -101,7 +116,9 @@ class KOBO_replay
 	void write(uint8_t b);
 	bool load_reph(pfile_t *pf);
 	bool load_repd(pfile_t *pf);
+	bool load_hash(pfile_t *pf);
 	bool load_gstd(pfile_t *pf);
+	bool load_kfrm(pfile_t *pf);
   public:
 	KOBO_replay();
 	virtual ~KOBO_replay();
@@ -161,11 +178,31 @@ class KOBO_replay
 	// Game state snapshots
 	bool record_state();	// Record snapshot of current game state
 	bool verify_state();	// Verify game state against snapshot, if any
-
-	// Write REPH, REPD, and (optionally) GSTD chucks to campaign file
+	unsigned	verified;	// Snapshots verified since rewind()
+	unsigned	failed;		// Snapshots that did not match
+
+	// Per-frame game state hashes (desync detection)
+	void record_hash();	// Record hash of current game state
+	bool verify_hash();	// Verify game state against hash, if any
+	// Get the hash recorded for 'frame', if any
+	bool hash(unsigned frame, uint32_t *h);
+	unsigned hashed_frames()	{ return hashrecord; }
+	unsigned	hashed;		// Frames verified since rewind()
+	int32_t		desync_frame;	// First frame with hash mismatch, or -1
+
+	// World state keyframes (rewind/skip acceleration)
+	bool record_keyframe();	// Record keyframe of current game state
+	KOBO_keyframe *keyframes()	{ return kf_first; }
+	KOBO_keyframe *find_keyframe(unsigned frame);	// Last at/before frame
+	bool restore_keyframe(KOBO_keyframe *kf);	// Restore + seek
+	void discard_keyframes(unsigned frame = 0);	// Delete at/after frame
+	void compact_keyframes();	// Drop non-logic data to save RAM
+
+	// Write REPH, REPD, HASH, KFRM, and (optionally) GSTD chucks to
+	// campaign file
 	bool save(pfile_t *pf);
 
-	// Read REPH, REPD, or GSTD chuck from campaign file
+	// Read REPH, REPD, HASH, KFRM, or GSTD chuck from campaign file
 	// NOTE: This call expects chunk_read() to have been called first!
 	bool load(pfile_t *pf);
 };
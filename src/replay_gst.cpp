@@ -95,19 +95,8 @@ bool KOBO_replay_gst::verify()
 	verify("player.charge", "", player.charge, myship.charge());
 	for(int i = 0; i < KOBO_EK__COUNT; ++i)
 	{
-		switch((KOBO_enemy_kinds)i)
-		{
-		  case KOBO_EK_RINGEXPL:
-		  case KOBO_EK_GREENBLTEXPL:
-		  case KOBO_EK_REDBLTEXPL:
-		  case KOBO_EK_BLUEBLTEXPL:
-		  case KOBO_EK_BOLTEXPL:
-		  case KOBO_EK_ROCKEXPL:
-			// These enemies should not affect gameplay!
-			continue;
-		  default:
-			break;
-		}
+		if(enemies.is_effect((KOBO_enemy_kinds)i))
+			continue;	// These should not affect gameplay!
 		const char *ename = enemies.enemy_name((KOBO_enemy_kinds)i);
 		verify(ename, ".spawned", enemystats[i].spawned,
 				enemies.stats[i].spawned);
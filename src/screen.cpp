@@ -36,17 +36,20 @@
 #include "scenes.h"
 #include "config.h"
 #include "random.h"
+#include "mathutil.h"
 
-int KOBO_screen::stage;
-int KOBO_screen::region;
-int KOBO_screen::level;
-const KOBO_scene *KOBO_screen::scene;
+KOBO_TLS int KOBO_screen::stage;
+KOBO_TLS int KOBO_screen::region;
+KOBO_TLS int KOBO_screen::level;
+KOBO_TLS const KOBO_scene *KOBO_screen::scene;
 int KOBO_screen::bg_altitude;
 int KOBO_screen::bg_clouds;
-int KOBO_screen::restarts;
-int KOBO_screen::generate_count;
-KOBO_map KOBO_screen::map[KOBO_BG_MAP_LEVELS + 1];
-int KOBO_screen::show_title = 0;
+KOBO_TLS int KOBO_screen::restarts;
+KOBO_TLS int KOBO_screen::generate_count;
+KOBO_TLS KOBO_map KOBO_screen::map[KOBO_BG_MAP_LEVELS + 1];
+KOBO_TLS KOBO_map KOBO_screen::initial_map;
+KOBO_TLS uint32_t KOBO_screen::maphash;
+KOBO_TLS int KOBO_screen::show_title = 0;
 int KOBO_screen::do_noise = 0;
 float KOBO_screen::_fps = 40;
 float KOBO_screen::scroller_speed = SCROLLER_SPEED;
@@ -66,6 +69,7 @@ KOBO_ParticleFXDef KOBO_screen::highlight_fxd;
 Uint32 KOBO_screen::highlight_time = 0;
 KOBO_Starfield KOBO_screen::stars;
 KOBO_GridTFX KOBO_screen::gridtfx;
+KOBO_BaseCache KOBO_screen::basecache[KOBO_BG_MAP_LEVELS + 1];
 bool KOBO_screen::curtains_below = true;
 int KOBO_screen::long_credits_wrap = 0;
 
@@ -80,6 +84,23 @@ void KOBO_screen::init_graphics()
 	highlight_fxd.Default();
 	fade_time = highlight_time = SDL_GetTicks();
 	set_fade(0.0f);
+	close_graphics();
+}
+
+
+// Must be called before the renderer is closed!
+void KOBO_screen::close_graphics()
+{
+	for(int i = 0; i < KOBO_BG_MAP_LEVELS + 1; ++i)
+		basecache[i].reset();
+}
+
+
+// Rerender all cached base tiles. (Map changes are tracked by set_map().)
+void KOBO_screen::invalidate_bases()
+{
+	for(int i = 0; i < KOBO_BG_MAP_LEVELS + 1; ++i)
+		basecache[i].invalidate();
 }
 
 
@@ -530,12 +551,27 @@ void KOBO_screen::help(int t)
 }
 
 
+// The map hash is the XOR of the hashes of all tiles, so that it can be
+// updated incrementally as tiles change. Only the logic bits are hashed, as the
+// tile graphics (pipe and scrap variants) are picked using pubrand.
+static inline uint32_t tile_hash(int x, int y, int n)
+{
+	x &= MAP_SIZEX - 1;
+	y &= MAP_SIZEY - 1;
+	return hash_final((((y << MAP_SIZEX_LOG2) + x) << 16) | MAP_BITS(n));
+}
+
+
 void KOBO_screen::init_stage(int st, bool ingame)
 {
-	wplanet->resetmod();
-	wplanet->blendmode(GFX_BLENDMODE_ALPHA);
-	int cm = 255.0f * themedata.get(KOBO_D_PLANET_COLORMOD, level - 1);
-	wplanet->colormod(cm, cm, cm);
+	if(!manage.headless())
+	{
+		wplanet->resetmod();
+		wplanet->blendmode(GFX_BLENDMODE_ALPHA);
+		int cm = 255.0f * themedata.get(KOBO_D_PLANET_COLORMOD,
+				level - 1);
+		wplanet->colormod(cm, cm, cm);
+	}
 
 	if(!ingame)
 	{
@@ -557,6 +593,11 @@ void KOBO_screen::init_stage(int st, bool ingame)
 
 	// Initialize maps (current + parallax layers)
 	map[0].init(scene);
+	initial_map = map[0];
+	maphash = 0;
+	for(int y = 0; y < MAP_SIZEY; ++y)
+		for(int x = 0; x < MAP_SIZEX; ++x)
+			maphash ^= tile_hash(x, y, map[0].pos(x, y));
 	for(int i = 0; i < KOBO_BG_MAP_LEVELS; ++i)
 	{
 		const KOBO_scene *s = NULL;
@@ -565,8 +606,12 @@ void KOBO_screen::init_stage(int st, bool ingame)
 		map[i + 1].init(s);
 	}
 
-	// Set up backdrop, planet, starfield, ground etc
-	init_background();
+	// Set up backdrop, planet, starfield, ground etc, unless headless
+	if(!manage.headless())
+	{
+		init_background();
+		invalidate_bases();
+	}
 	generate_count = 0;
 }
 
@@ -678,8 +723,13 @@ void KOBO_screen::generate_fixed_enemies()
 
 void KOBO_screen::set_map(int x, int y, int n)
 {
+	maphash ^= tile_hash(x, y, map[0].pos(x, y)) ^ tile_hash(x, y, n);
 	map[0].pos(x, y) = n;
-	wradar->update(x, y);
+	if(!manage.headless())
+	{
+		wradar->update(x, y);
+		basecache[0].invalidate(x, y);
+	}
 }
 
 
@@ -976,7 +1026,8 @@ void KOBO_screen::init_background()
 }
 
 
-void KOBO_screen::render_bases(KOBO_map &map, int tileset, int vx, int vy)
+void KOBO_screen::render_bases(KOBO_map &map, KOBO_BaseCache &cache,
+		int tileset, int vx, int vy)
 {
 	s_bank_t *b = s_get_bank(gengine->get_gfx(), tileset);
 	if(!b)
@@ -1007,12 +1058,19 @@ void KOBO_screen::render_bases(KOBO_map &map, int tileset, int vx, int vy)
 	int ymax = ((DASHH(MAIN) + CS2PIXEL(yo)) / b->w) + 1;
 	int xmax = ((DASHW(MAIN) + CS2PIXEL(xo)) / b->h) + 1;
 	int frame = manage.game_time();
+	wlowsprites->begin_batch();
+
+	// If the cache works, it does everything but the animated tiles
+	bool cached = cache.render(wlowsprites, map, tileset,
+			mx, my, xo, yo, xmax, ymax);
 	for(int y = 0; y < ymax; ++y)
 		for(int x = 0; x < xmax; ++x)
 		{
 			int n = map.pos(mx + x, my + y);
 			if(IS_SPACE(n) && (MAP_TILE(n) == 0))
 				continue;
+			if(cached && !(n & CORE))
+				continue;
 			int tile;
 			if(n & CORE)
 			{
@@ -1028,6 +1086,7 @@ void KOBO_screen::render_bases(KOBO_map &map, int tileset, int vx, int vy)
 					PIXEL2CS(y * b->h) - yo,
 					tileset, tile);
 		}
+	wlowsprites->end_batch();
 	if(prefs->show_map_border)
 	{
 		wlowsprites->foreground(wlowsprites->map_rgb(0, 100, 200));
@@ -1093,13 +1152,13 @@ void KOBO_screen::render_background()
 			  case 0: tiles += B_R1_TILES_SMALL_SPACE; break;
 			  case 1: tiles += B_R1_TILES_TINY_INTERMEDIATE; break;
 			}
-		render_bases(map[m + 1], tiles, vx, vy);
+		render_bases(map[m + 1], basecache[m + 1], tiles, vx, vy);
 	}
 
 	// Render the bases of the current level
 	cm = 255.0f * themedata.get(KOBO_D_BASES_COLORMOD, show_title ? 3 : 2);
 	wlowsprites->colormod(cm, cm, cm);
-	render_bases(map[0], B_R1_TILES + region, vx, vy);
+	render_bases(map[0], basecache[0], B_R1_TILES + region, vx, vy);
 	wlowsprites->resetmod();
 
 	// Adjust scroll position for fire/explosions layer
@@ -28,25 +28,29 @@
 #include "radar.h"
 #include "starfield.h"
 #include "gridtfx.h"
+#include "basecache.h"
 
 class window_t;
 
 class KOBO_screen
 {
+	friend class KOBO_keyframe;
   protected:
 	static window_t *target;
-	static int stage;
-	static int region;
-	static int level;
-	static const KOBO_scene *scene;
+	static KOBO_TLS int stage;
+	static KOBO_TLS int region;
+	static KOBO_TLS int level;
+	static KOBO_TLS const KOBO_scene *scene;
 	static int bg_altitude;
 	static int bg_backdrop;
 	static int bg_clouds;
 	static int bg_planet;
-	static int restarts;
-	static int generate_count;
-	static KOBO_map map[KOBO_BG_MAP_LEVELS + 1];
-	static int show_title;
+	static KOBO_TLS int restarts;
+	static KOBO_TLS int generate_count;
+	static KOBO_TLS KOBO_map map[KOBO_BG_MAP_LEVELS + 1];
+	static KOBO_TLS KOBO_map initial_map;	// map[0] as generated (for keyframes)
+	static KOBO_TLS uint32_t maphash;	// Hash of map[0] (for replays)
+	static KOBO_TLS int show_title;
 	static int do_noise;
 	static float _fps;
 	static float scroller_speed;
@@ -74,11 +78,13 @@ class KOBO_screen
 	static KOBO_Starfield stars;
 
 	static KOBO_GridTFX gridtfx;
+	static KOBO_BaseCache basecache[KOBO_BG_MAP_LEVELS + 1];
 	static bool curtains_below;
 
 	static void render_noise();
 	static void render_highlight();
-	static void render_bases(KOBO_map &map, int tileset, int vx, int vy);
+	static void render_bases(KOBO_map &map, KOBO_BaseCache &cache,
+			int tileset, int vx, int vy);
 	static void clean_scrap_tile(int x, int y)
 	{
 		if((map[0].pos(x, y) & SPACE) && (MAP_TILE(map[0].pos(x, y))))
@@ -88,6 +94,8 @@ class KOBO_screen
 			float speed, int t);
   public:
 	static void init_graphics();
+	static void close_graphics();
+	static void invalidate_bases();
 	static void init_background();
 	static void init_stage(int st, bool ingame);
 	static int prepare();
@@ -97,6 +105,11 @@ class KOBO_screen
 	{
 		return map[0].pos(x, y);
 	}
+	static inline int get_initial_map(int x, int y)
+	{
+		return initial_map.pos(x, y);
+	}
+	static uint32_t map_hash()	{ return maphash; }
 	static inline int test_line(int x1, int y1, int x3, int y3,
 			int *x2, int *y2, int *hx, int *hy)
 	{
@@ -29,12 +29,12 @@
 
 int KOBO_sound::tsdcounter = 0;
 
-int KOBO_sound::listener_x = 0;
-int KOBO_sound::listener_y = 0;
-int KOBO_sound::wrap_x = 0;
-int KOBO_sound::wrap_y = 0;
-int KOBO_sound::scale = 65536 / 1000;
-int KOBO_sound::panscale = 65536 / 700;
+KOBO_TLS int KOBO_sound::listener_x = 0;
+KOBO_TLS int KOBO_sound::listener_y = 0;
+KOBO_TLS int KOBO_sound::wrap_x = 0;
+KOBO_TLS int KOBO_sound::wrap_y = 0;
+KOBO_TLS int KOBO_sound::scale = 65536 / 1000;
+KOBO_TLS int KOBO_sound::panscale = 65536 / 700;
 unsigned KOBO_sound::rumble = 0;
 float KOBO_sound::volscale = 1.0f;
 float KOBO_sound::pitchshift = 0.0f;
@@ -142,13 +142,14 @@ class KOBO_sound
 {
 	static int	tsdcounter;
 
-	// In-game sfx stuff
-	static int	listener_x;
-	static int	listener_y;
-	static int	wrap_x;
-	static int	wrap_y;
-	static int	scale;
-	static int	panscale;
+	// In-game sfx stuff. The positional state is per thread, as the game
+	// logic may run on replay verification threads.
+	static KOBO_TLS int	listener_x;
+	static KOBO_TLS int	listener_y;
+	static KOBO_TLS int	wrap_x;
+	static KOBO_TLS int	wrap_y;
+	static KOBO_TLS int	scale;
+	static KOBO_TLS int	panscale;
 	static float	volscale;
 	static float	pitchshift;
 	static unsigned	rumble;
@@ -1444,8 +1444,13 @@ KOBO_TP_Tokens KOBO_ThemeParser::handle_particles()
 
 	KOBO_TP_Tokens res = particles_body(pfxd);
 	if(res == KTK_KW_PARTICLES)
+	{
 		log_printf(ULOG, "[Theme Loader] particles %s (initial: %d)\n",
 				kobo_pfxnames[pfxi], pfxd->init_count);
+		if(!pfxd->Compile())
+			log_printf(WLOG, "[Theme Loader] Could not compile "
+					"particles %s!\n", kobo_pfxnames[pfxi]);
+	}
 	return res;
 }
 